@@ -0,0 +1,1508 @@
+/*
+ * Host-side benchmark for the colour conversion kernels.
+ *
+ * Builds src/format_conversion.c for the host, checks every kernel against
+ * the reference implementation in reference.c and reports the time spent
+ * per frame and per pixel for both, followed by the scaled kernels and the
+ * ones for the other output formats.
+ *
+ * "bench strips" instead times strip-wise conversion for a range of strip
+ * heights, flushing each strip out of the cache like the plugin does with
+ * sceKernelDcacheWritebackRange(), and reports the best height per format.
+ *
+ * "bench bands [workers] [frame files...]" runs the band-parallel
+ * conversion engine on a pthread pool with 1..N workers (N defaults to the
+ * CPU count), checks that the output matches a single-band run and reports
+ * ns per frame and the speed-up over one worker. Frame files are cycled
+ * through like the dumps of "bench dirty"; without them a noise frame is
+ * converted over and over.
+ *
+ * "bench dirty [frame files...]" replays a frame sequence with and without
+ * the per-row fingerprint cache and reports the time and rows saved. The
+ * files are raw framebuffer dumps (512-pixel stride, 272 lines) in the
+ * layout of each kernel; without files a mostly static synthetic sequence
+ * with a moving band of changed rows is used.
+ *
+ * "bench jpeg [frame files...]" encodes the same kind of frame sequence
+ * with the MJPEG encoder at a few quality settings, with and without the
+ * segment cache, and reports the encode time, share of reused segments
+ * and compressed size per frame. Without files a mostly static and a
+ * high-motion synthetic sequence are used; random pixels say little about
+ * real compressed sizes.
+ *
+ * "bench slices [workers]" encodes the high-motion sequence split into
+ * 1..N slices (N defaults to the CPU count, at most JPEG_MAX_SLICES) on a
+ * pthread pool with one worker per slice, checks each frame against the
+ * same slicing encoded inline and reports ns per frame, the speed-up over
+ * one slice and the bytes per frame the restart markers add.
+ *
+ * "bench h264 [stream file]" encodes the static and high-motion sequences
+ * as H.264, every fourth frame as an unchanged one, and reports the
+ * encode time, bytes per frame and share of coded macroblocks. As a round
+ * trip the stream is written to the file (bench.264 by default) and
+ * decoded with $BENCH_H264_DECODER, a printf format taking the file name
+ * that writes raw I420 frames to stdout (by default with ffmpeg); every
+ * decoded frame must equal the 4:2:0 frame the encoder was given.
+ *
+ * "bench suite [-l label] [-r reps] [-n iterations] [-s strides] [dumps...]"
+ * times every kernel (each source layout to each output format and size)
+ * on a noise frame, a rendered scene and any framebuffer dumps, at each
+ * of a comma-separated list of strides (480 and 512 by default). Every
+ * case is run reps times (7 by default) after a warm-up, with enough
+ * iterations per repetition to take a few milliseconds unless -n is
+ * given, and printed as one CSV row: min, median, mean and standard
+ * deviation of ns per frame, median cycles per output pixel and, for
+ * YUY2 at the native size, whether it matches the reference. -l tags the
+ * rows, e.g. with the revision.
+ *
+ * "bench pipeline [MB/s] [convert_us] [payloads]" runs the plugin's
+ * capture and transmit loop at 480x272 against a simulated USB link (20
+ * MB/s by default), first waiting for each send like the plugin used to
+ * (1s), then with 1, 2 and 3 transmit buffers rotating, then with frames
+ * split into payloads (8 by default). Conversions are padded out to
+ * convert_us (6000 by default) to stand in for the PSP. It reports the
+ * frame rate, the time from capture to the last byte, how busy the link
+ * was, any payload written to while it was still being sent and any frame
+ * the host side did not get back exactly.
+ *
+ * "bench compare old.csv new.csv [threshold]" lines up two suite runs and
+ * flags cases whose median got slower by more than threshold percent (5
+ * by default) and more than the combined noise; it exits with 1 if any
+ * did.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#else
+#define HAVE_RDTSC 0
+#endif
+#include <unistd.h>
+#include <pthread.h>
+#include "format_conversion.h"
+#include "conversion_engine.h"
+#include "jpeg_encoder.h"
+#include "h264_encoder.h"
+#include "reference.h"
+#include "thread_pool.h"
+
+#define FB_WIDTH	480
+#define FB_HEIGHT	272
+#define FB_STRIDE	512
+#define ITERATIONS	200
+#define MAX_WORKERS	8
+#define SEQ_FRAMES	60
+#define SEQ_BAND_LINES	24
+/* Short enough for the sequences to include IDR refreshes */
+#define BENCH_IDR_INTERVAL	16
+#define H264_DEFAULT_STREAM	"bench.264"
+#define H264_DEFAULT_DECODER	"ffmpeg -v error -i %s -f rawvideo -pix_fmt yuv420p - 2>/dev/null"
+
+typedef void (*ref_fn)(const unsigned char *src, unsigned char *dst,
+		       int in_stride, int width, int height);
+
+struct kernel {
+	const char *name;
+	int src_format;
+	ref_fn ref;
+};
+
+static const struct kernel kernels[] = {
+	{"r8g8b8a8_to_yuy2", CONVERSION_SRC_RGBA8888, ref_r8g8b8a8_to_yuy2},
+	{"r5g6b5_to_yuy2",   CONVERSION_SRC_RGB565,   ref_r5g6b5_to_yuy2},
+	{"r5g5b5a1_to_yuy2", CONVERSION_SRC_RGBA5551, ref_r5g5b5a1_to_yuy2},
+	{"r4g4b4a4_to_yuy2", CONVERSION_SRC_RGBA4444, ref_r4g4b4a4_to_yuy2},
+};
+
+static unsigned char fb[FB_STRIDE * FB_HEIGHT * 4] __attribute__((aligned(64)));
+static unsigned char out_ref[FB_WIDTH * FB_HEIGHT * 2] __attribute__((aligned(64)));
+static unsigned char out[FB_WIDTH * FB_HEIGHT * 2] __attribute__((aligned(64)));
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static unsigned long long now_cycles(void)
+{
+#if HAVE_RDTSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* Times the reference kernel if ref is set, the dispatched one otherwise */
+static void measure(const struct conversion_dispatch *dispatch, int src_format, ref_fn ref,
+		    unsigned char *dst, double *ns, double *cpp)
+{
+	conversion_fn fn = dispatch->convert[src_format];
+	int w = dispatch->width, h = dispatch->height;
+	unsigned long long t0, t1, c0, c1;
+	int i;
+
+	if (ref)
+		ref(fb, dst, FB_STRIDE, w, h);
+	else
+		fn(fb, dst, FB_STRIDE, w, h, 0, h);
+
+	t0 = now_ns();
+	c0 = now_cycles();
+	for (i = 0; i < ITERATIONS; i++) {
+		if (ref)
+			ref(fb, dst, FB_STRIDE, w, h);
+		else
+			fn(fb, dst, FB_STRIDE, w, h, 0, h);
+	}
+	c1 = now_cycles();
+	t1 = now_ns();
+
+	*ns = (double)(t1 - t0) / ITERATIONS;
+	*cpp = (double)(c1 - c0) / ITERATIONS / (w * h);
+}
+
+static const struct {
+	int width;
+	int height;
+} scaled_sizes[] = {
+	{240, 136},
+	{120, 68},
+	{360, 204},
+};
+
+/* Fused scale+convert kernels, timed per output frame and output pixel */
+static void bench_scaled(void)
+{
+	struct conversion_dispatch dispatch;
+	unsigned int i, j;
+
+	printf("\n%-18s %10s %12s %10s\n", "kernel", "size", "ns/frm", "cyc/px");
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		for (j = 0; j < sizeof(scaled_sizes) / sizeof(scaled_sizes[0]); j++) {
+			double ns, cpp;
+
+			format_conversion_select(&dispatch, CONVERSION_DST_YUY2,
+						 scaled_sizes[j].width, scaled_sizes[j].height);
+			measure(&dispatch, kernels[i].src_format, NULL, out, &ns, &cpp);
+			printf("%-18s %6dx%-3d %12.0f %10.2f\n", kernels[i].name,
+			       scaled_sizes[j].width, scaled_sizes[j].height, ns, cpp);
+		}
+	}
+}
+
+static const struct {
+	const char *name;
+	int dst_format;
+} dst_formats[] = {
+	{"nv12", CONVERSION_DST_NV12},
+	{"i420", CONVERSION_DST_I420},
+	{"rgb565", CONVERSION_DST_RGB565},
+	{"y800", CONVERSION_DST_Y800},
+};
+
+/* Kernels for the other output formats at the native size, against YUY2 */
+static void bench_dst_formats(void)
+{
+	struct conversion_dispatch dispatch;
+	unsigned int i, j;
+
+	printf("\n%-18s %6s %12s %10s %8s\n", "source", "dst", "ns/frm", "cyc/px", "vs yuy2");
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		double yuy2_ns, ns, cpp;
+
+		format_conversion_select(&dispatch, CONVERSION_DST_YUY2, FB_WIDTH, FB_HEIGHT);
+		measure(&dispatch, kernels[i].src_format, NULL, out, &yuy2_ns, &cpp);
+
+		for (j = 0; j < sizeof(dst_formats) / sizeof(dst_formats[0]); j++) {
+			format_conversion_select(&dispatch, dst_formats[j].dst_format,
+						 FB_WIDTH, FB_HEIGHT);
+			measure(&dispatch, kernels[i].src_format, NULL, out, &ns, &cpp);
+			printf("%-18.*s %6s %12.0f %10.2f %7.2fx\n",
+			       (int)(strstr(kernels[i].name, "_to_") - kernels[i].name), kernels[i].name,
+			       dst_formats[j].name, ns, cpp, yuy2_ns / ns);
+		}
+	}
+}
+
+static void flush_range(const void *addr, unsigned int size)
+{
+#if HAVE_RDTSC
+	const char *p = (const char *)((unsigned long)addr & ~63ul);
+	const char *end = (const char *)addr + size;
+
+	for (; p < end; p += 64)
+		_mm_clflush(p);
+#endif
+}
+
+static const int strip_heights[] = {1, 2, 4, 8, 16, 34, 68, 136, 0};
+
+static void bench_strips(const struct conversion_dispatch *dispatch)
+{
+	unsigned int i, h;
+
+	printf("%-18s", "kernel");
+	for (h = 0; h < sizeof(strip_heights) / sizeof(strip_heights[0]); h++)
+		printf(" %8d", strip_heights[h] ? strip_heights[h] : FB_HEIGHT);
+	printf(" %8s\n", "best");
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		const struct kernel *k = &kernels[i];
+		unsigned long long best_ns = ~0ull;
+		int best = 0;
+
+		printf("%-18s", k->name);
+
+		for (h = 0; h < sizeof(strip_heights) / sizeof(strip_heights[0]); h++) {
+			unsigned long long t0, t1;
+			int n;
+
+			t0 = now_ns();
+			for (n = 0; n < ITERATIONS; n++) {
+				format_conversion_convert_strips(dispatch, k->src_format, fb, out,
+								 FB_STRIDE, 0, FB_HEIGHT, strip_heights[h],
+								 flush_range, NULL, 0);
+			}
+			t1 = now_ns();
+
+			printf(" %8llu", (t1 - t0) / ITERATIONS);
+			if (t1 - t0 < best_ns) {
+				best_ns = t1 - t0;
+				best = strip_heights[h] ? strip_heights[h] : FB_HEIGHT;
+			}
+		}
+
+		printf(" %8d\n", best);
+	}
+}
+
+static unsigned char *seq_frames[SEQ_FRAMES];
+static int seq_len;
+
+/* Frame n of the loaded dumps, or the noise frame if there are none */
+static const unsigned char *bands_frame(int n)
+{
+	return seq_len ? seq_frames[n % seq_len] : fb;
+}
+
+static void bench_bands(const struct conversion_dispatch *dispatch, int max_workers)
+{
+	struct conversion_executor pools[MAX_WORKERS];
+	unsigned int i;
+	int w;
+
+	if (max_workers > MAX_WORKERS)
+		max_workers = MAX_WORKERS;
+	if (max_workers < 1)
+		max_workers = 1;
+
+	for (w = 1; w <= max_workers; w++)
+		thread_pool_init(&pools[w - 1], w);
+
+	printf("%-18s", "kernel");
+	for (w = 1; w <= max_workers; w++)
+		printf(" %7dw %6s", w, "x");
+	printf("\n");
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		const struct kernel *k = &kernels[i];
+		double base_ns = 0;
+
+		/* The last frame converted is the one checked */
+		conversion_engine_convert(&conversion_executor_inline, dispatch, k->src_format,
+					  bands_frame(ITERATIONS - 1), out_ref, FB_STRIDE, 1, 0,
+					  flush_range, NULL);
+
+		printf("%-18s", k->name);
+
+		for (w = 1; w <= max_workers; w++) {
+			unsigned long long t0, t1;
+			double ns;
+			int n;
+
+			memset(out, 0, sizeof(out));
+
+			t0 = now_ns();
+			for (n = 0; n < ITERATIONS; n++) {
+				conversion_engine_convert(&pools[w - 1], dispatch, k->src_format,
+							  bands_frame(n), out, FB_STRIDE, w, 0,
+							  flush_range, NULL);
+			}
+			t1 = now_ns();
+
+			ns = (double)(t1 - t0) / ITERATIONS;
+			if (w == 1)
+				base_ns = ns;
+
+			printf(" %8.0f %5.2f%s", ns, base_ns / ns,
+			       memcmp(out_ref, out, sizeof(out)) ? "!" : " ");
+		}
+
+		printf("\n");
+	}
+
+	for (w = 1; w <= max_workers; w++)
+		thread_pool_fini(&pools[w - 1]);
+}
+
+/* YUY2 converters feeding the JPEG encoder */
+static struct conversion_dispatch enc_dispatch;
+
+static int load_sequence(int count, char *files[])
+{
+	int i;
+
+	for (i = 0; i < count && i < SEQ_FRAMES; i++) {
+		FILE *f = fopen(files[i], "rb");
+
+		if (!f) {
+			perror(files[i]);
+			return -1;
+		}
+
+		seq_frames[i] = calloc(1, sizeof(fb));
+		if (fread(seq_frames[i], 1, sizeof(fb), f) == 0)
+			fprintf(stderr, "%s: empty dump\n", files[i]);
+		fclose(f);
+	}
+
+	seq_len = i;
+	return 0;
+}
+
+static void synth_sequence(void)
+{
+	int i, y;
+
+	for (i = 0; i < SEQ_FRAMES; i++) {
+		int band = (i * 7) % (FB_HEIGHT - SEQ_BAND_LINES);
+
+		seq_frames[i] = malloc(sizeof(fb));
+		memcpy(seq_frames[i], fb, sizeof(fb));
+		for (y = band; y < band + SEQ_BAND_LINES; y++) {
+			unsigned char *row = &seq_frames[i][y * FB_STRIDE * 4];
+			unsigned int x;
+
+			for (x = 0; x < FB_STRIDE * 4; x++)
+				row[x] ^= i + 1;
+		}
+	}
+
+	seq_len = SEQ_FRAMES;
+}
+
+static void bench_dirty(const struct conversion_dispatch *dispatch)
+{
+	static struct conversion_row_cache rows;
+	unsigned int i;
+
+	printf("%-18s %12s %12s %12s %8s\n", "kernel",
+	       "full ns/frm", "cache ns/frm", "rows skipped", "exact");
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		const struct kernel *k = &kernels[i];
+		unsigned long long full_ns = 0, cache_ns = 0, t0;
+		long skipped = 0;
+		int exact = 1;
+		int n;
+
+		conversion_row_cache_reset(&rows);
+
+		for (n = 0; n < seq_len; n++) {
+			t0 = now_ns();
+			conversion_engine_convert(&conversion_executor_inline, dispatch, k->src_format,
+						  seq_frames[n], out_ref, FB_STRIDE, 1, 0, flush_range, NULL);
+			full_ns += now_ns() - t0;
+
+			t0 = now_ns();
+			conversion_engine_convert(&conversion_executor_inline, dispatch, k->src_format,
+						  seq_frames[n], out, FB_STRIDE, 1, 0, flush_range, &rows);
+			cache_ns += now_ns() - t0;
+
+			skipped += rows.rows_skipped;
+			if (memcmp(out_ref, out, sizeof(out)))
+				exact = 0;
+		}
+
+		printf("%-18s %12llu %12llu %12.1f %8s\n", k->name, full_ns / seq_len,
+		       cache_ns / seq_len, (double)skipped / seq_len, exact ? "yes" : "NO");
+	}
+}
+
+static void free_sequence(void)
+{
+	int i;
+
+	for (i = 0; i < seq_len; i++)
+		free(seq_frames[i]);
+	seq_len = 0;
+}
+
+/*
+ * Gradient background with a box moving across it, in 8888 layout. With
+ * motion set the whole background scrolls too, so every MCU changes.
+ */
+static void synth_scene_sequence(int motion)
+{
+	int i, x, y;
+
+	for (i = 0; i < SEQ_FRAMES; i++) {
+		uint32_t *p = malloc(sizeof(fb));
+		int bx = (i * 5) % (FB_WIDTH - 64);
+		int scroll = motion ? i * 3 : 0;
+
+		for (y = 0; y < FB_HEIGHT; y++) {
+			for (x = 0; x < FB_STRIDE; x++) {
+				uint32_t c = (((x + scroll) * 255 / FB_WIDTH) & 0xFF) |
+					     ((y * 255 / FB_HEIGHT) << 8) | (0x40 << 16);
+
+				if (x >= bx && x < bx + 64 && y >= 100 && y < 164)
+					c = ((x ^ y) & 8) ? 0xFFFFFF : 0x2020C0;
+				p[y * FB_STRIDE + x] = c;
+			}
+		}
+		seq_frames[i] = (unsigned char *)p;
+	}
+
+	seq_len = SEQ_FRAMES;
+}
+
+static const int jpeg_qualities[] = {50, JPEG_DEFAULT_QUALITY, 95};
+
+struct jpeg_run {
+	unsigned long long ns;
+	long bytes;
+	long reused;
+	long segments;
+	int frames;
+};
+
+static void run_jpeg(struct jpeg_encoder *enc, int src_format, struct jpeg_run *run)
+{
+	unsigned long long t0;
+	int n, size;
+
+	memset(run, 0, sizeof(*run));
+
+	for (n = 0; n < seq_len; n++) {
+		t0 = now_ns();
+		size = jpeg_encoder_encode(enc, &enc_dispatch, src_format, seq_frames[n],
+					   FB_STRIDE, out, sizeof(out));
+		run->ns += now_ns() - t0;
+
+		if (size < 0)
+			continue;
+		run->bytes += size;
+		run->frames++;
+		if (enc->cache) {
+			run->reused += enc->cache->segments_reused;
+			run->segments += enc->cache->segments;
+		}
+	}
+}
+
+/*
+ * Every kernel and quality is encoded once without and once with the
+ * segment cache; the cached stream also carries restart markers.
+ */
+static void bench_jpeg(void)
+{
+	static struct jpeg_encoder enc;
+	static struct jpeg_segment_cache cache;
+	unsigned int i, q;
+
+	format_conversion_set_color(JPEG_COLOR);
+
+	printf("%-18s %4s %10s %10s %7s %8s %10s %10s %6s\n", "kernel", "q",
+	       "ns/frm", "cached ns", "x", "reused", "bytes", "cached", "bpp");
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		const struct kernel *k = &kernels[i];
+
+		for (q = 0; q < sizeof(jpeg_qualities) / sizeof(jpeg_qualities[0]); q++) {
+			struct jpeg_run plain, cached;
+
+			jpeg_encoder_setup(&enc, FB_WIDTH, FB_HEIGHT, jpeg_qualities[q]);
+			jpeg_encoder_set_cache(&enc, NULL);
+			run_jpeg(&enc, k->src_format, &plain);
+
+			jpeg_encoder_set_cache(&enc, &cache);
+			run_jpeg(&enc, k->src_format, &cached);
+
+			if (!plain.frames || !cached.frames) {
+				printf("%-18s %4d %10s\n", k->name, jpeg_qualities[q], "overflow");
+				continue;
+			}
+
+			printf("%-18s %4d %10llu %10llu %6.2fx %7.1f%% %10ld %10ld %6.2f%s\n", k->name,
+			       jpeg_qualities[q], plain.ns / seq_len, cached.ns / seq_len,
+			       (double)plain.ns / cached.ns,
+			       100.0 * cached.reused / (cached.segments ? cached.segments : 1),
+			       plain.bytes / plain.frames, cached.bytes / cached.frames,
+			       8.0 * plain.bytes / plain.frames / (FB_WIDTH * FB_HEIGHT),
+			       plain.frames < seq_len ? " (some overflowed)" : "");
+		}
+	}
+}
+
+static void bench_slices(int max_slices)
+{
+	static struct jpeg_encoder enc;
+	struct conversion_executor pools[JPEG_MAX_SLICES];
+	unsigned int i;
+	int w;
+
+	if (max_slices > JPEG_MAX_SLICES)
+		max_slices = JPEG_MAX_SLICES;
+	if (max_slices < 1)
+		max_slices = 1;
+
+	for (w = 1; w <= max_slices; w++)
+		thread_pool_init(&pools[w - 1], w);
+
+	printf("%-18s", "kernel");
+	for (w = 1; w <= max_slices; w++)
+		printf(" %7ds %6s %6s", w, "x", "bytes");
+	printf("\n");
+
+	jpeg_encoder_setup(&enc, FB_WIDTH, FB_HEIGHT, JPEG_DEFAULT_QUALITY);
+	format_conversion_set_color(JPEG_COLOR);
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		const struct kernel *k = &kernels[i];
+		double base_ns = 0;
+		long base_bytes = 0;
+
+		printf("%-18s", k->name);
+
+		for (w = 1; w <= max_slices; w++) {
+			unsigned long long t0, ns = 0;
+			long bytes = 0;
+			int mismatch = 0;
+			int n, size, ref_size;
+
+			for (n = 0; n < seq_len; n++) {
+				jpeg_encoder_set_slices(&enc, &conversion_executor_inline, w);
+				ref_size = jpeg_encoder_encode(&enc, &enc_dispatch, k->src_format,
+							       seq_frames[n], FB_STRIDE, out_ref,
+							       sizeof(out_ref));
+
+				jpeg_encoder_set_slices(&enc, &pools[w - 1], w);
+				t0 = now_ns();
+				size = jpeg_encoder_encode(&enc, &enc_dispatch, k->src_format,
+							   seq_frames[n], FB_STRIDE, out, sizeof(out));
+				ns += now_ns() - t0;
+
+				if (size != ref_size || (size > 0 && memcmp(out, out_ref, size)))
+					mismatch = 1;
+				bytes += size;
+			}
+
+			if (w == 1) {
+				base_ns = ns;
+				base_bytes = bytes;
+			}
+
+			printf(" %8llu %5.2f%s %6ld", ns / seq_len, base_ns / ns, mismatch ? "!" : " ",
+			       (bytes - base_bytes) / seq_len);
+		}
+
+		printf("\n");
+	}
+
+	jpeg_encoder_set_slices(&enc, NULL, 1);
+	for (w = 1; w <= max_slices; w++)
+		thread_pool_fini(&pools[w - 1]);
+}
+
+/*
+ * The 4:2:0 frame the H.264 encoder codes: its YUY2 input with the chroma
+ * of each row pair averaged.
+ */
+static void yuy2_to_i420(const unsigned char *yuy2, unsigned char *i420, int width, int height)
+{
+	unsigned char *cb = i420 + width * height;
+	unsigned char *cr = cb + (width / 2) * (height / 2);
+	int x, y;
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++)
+			i420[y * width + x] = yuy2[(y * width + x) * 2];
+	}
+
+	for (y = 0; y < height / 2; y++) {
+		for (x = 0; x < width / 2; x++) {
+			const unsigned char *p0 = yuy2 + (2 * y * width + 2 * x) * 2;
+			const unsigned char *p1 = p0 + width * 2;
+
+			cb[y * (width / 2) + x] = (p0[1] + p1[1] + 1) >> 1;
+			cr[y * (width / 2) + x] = (p0[3] + p1[3] + 1) >> 1;
+		}
+	}
+}
+
+/*
+ * Decodes path with the round-trip decoder and compares each frame with
+ * ref. Returns the number of bad or missing frames, or -1 if nothing
+ * could be decoded at all.
+ */
+static int h264_roundtrip(const char *path, const unsigned char *ref, int frames, int frame_size)
+{
+	const char *decoder = getenv("BENCH_H264_DECODER");
+	unsigned char *buf = malloc(frame_size);
+	char cmd[512];
+	FILE *p;
+	int n = 0, bad = 0;
+
+	snprintf(cmd, sizeof(cmd), decoder ? decoder : H264_DEFAULT_DECODER, path);
+	p = popen(cmd, "r");
+	if (!p) {
+		free(buf);
+		return -1;
+	}
+
+	while (n < frames && fread(buf, 1, frame_size, p) == frame_size) {
+		if (memcmp(buf, ref + (size_t)n * frame_size, frame_size))
+			bad++;
+		n++;
+	}
+
+	pclose(p);
+	free(buf);
+
+	return n ? bad + frames - n : -1;
+}
+
+static void bench_h264(const char *path)
+{
+	static struct h264_encoder enc;
+	int frame_size = FB_WIDTH * FB_HEIGHT * 3 / 2;
+	unsigned char *ref = malloc((size_t)seq_len * frame_size);
+	unsigned int i;
+
+	printf("%-18s %10s %10s %10s %8s %10s\n", "kernel", "ns/frm", "bytes", "IDR bytes",
+	       "coded", "roundtrip");
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		const struct kernel *k = &kernels[i];
+		unsigned long long t0, ns = 0;
+		long bytes = 0, idr_bytes = 0, coded = 0;
+		int n, size, idr, bad;
+		FILE *f = fopen(path, "wb");
+
+		if (!f) {
+			perror(path);
+			break;
+		}
+
+		h264_encoder_setup(&enc, FB_WIDTH, FB_HEIGHT, 60, BENCH_IDR_INTERVAL);
+
+		for (n = 0; n < seq_len; n++) {
+			/* A repeated frame is coded as unchanged, like a static one in the plugin */
+			int unchanged = n % 4 == 3 && !h264_encoder_idr_due(&enc);
+			int src = unchanged ? n - 1 : n;
+
+			idr = h264_encoder_idr_due(&enc);
+
+			t0 = now_ns();
+			if (unchanged)
+				size = h264_encoder_encode_unchanged(&enc, out, sizeof(out));
+			else
+				size = h264_encoder_encode(&enc, &enc_dispatch, k->src_format,
+							   seq_frames[src], FB_STRIDE, out, sizeof(out));
+			ns += now_ns() - t0;
+
+			if (size < 0) {
+				printf("%-18s overflow\n", k->name);
+				break;
+			}
+
+			fwrite(out, 1, size, f);
+			bytes += size;
+			coded += enc.mbs_coded;
+			if (idr)
+				idr_bytes = size;
+
+			enc_dispatch.convert[k->src_format](seq_frames[src], out_ref, FB_STRIDE,
+							    FB_WIDTH, FB_HEIGHT, 0, FB_HEIGHT);
+			yuy2_to_i420(out_ref, ref + (size_t)n * frame_size, FB_WIDTH, FB_HEIGHT);
+		}
+
+		fclose(f);
+		if (n < seq_len)
+			continue;
+
+		bad = h264_roundtrip(path, ref, seq_len, frame_size);
+
+		printf("%-18s %10llu %10ld %10ld %7.1f%% ", k->name, ns / seq_len, bytes / seq_len,
+		       idr_bytes, 100.0 * coded / ((long)seq_len * enc.mb_cols * enc.mb_rows));
+		if (bad < 0)
+			printf("%10s\n", "no decoder");
+		else if (bad)
+			printf("%6d bad\n", bad);
+		else
+			printf("%10s\n", "exact");
+	}
+
+	free(ref);
+}
+
+/* Largest stride the suite takes, in pixels */
+#define SUITE_MAX_STRIDE	2048
+#define SUITE_REPS		7
+#define SUITE_MAX_REPS		64
+/* Iterations per repetition are doubled until one takes this long */
+#define SUITE_REP_NS		5000000ull
+
+struct suite_options {
+	const char *label;
+	int reps;
+	int iterations;
+	int strides[8];
+	int num_strides;
+};
+
+struct suite_stats {
+	int iterations;
+	double ns_min;
+	double ns_median;
+	double ns_mean;
+	double ns_stddev;
+	double cpp;
+};
+
+/*
+ * The moving-box scene of synth_scene_sequence() rendered straight into a
+ * given layout and stride, so the 16-bit sources see a picture too.
+ */
+static void render_scene(unsigned char *dst, int stride, int src_format)
+{
+	int x, y;
+
+	for (y = 0; y < FB_HEIGHT; y++) {
+		for (x = 0; x < FB_WIDTH; x++) {
+			unsigned int r = x * 255 / FB_WIDTH, g = y * 255 / FB_HEIGHT, b = 0x40;
+			uint32_t p;
+
+			if (x >= 200 && x < 264 && y >= 100 && y < 164) {
+				int on = (x ^ y) & 8;
+
+				r = on ? 0xFF : 0x20;
+				g = on ? 0xFF : 0x20;
+				b = on ? 0xFF : 0xC0;
+			}
+
+			switch (src_format) {
+			case CONVERSION_SRC_RGB565:
+				p = (r >> 3) | ((g >> 2) << 5) | ((b >> 3) << 11);
+				memcpy(dst + (y * stride + x) * 2, &p, 2);
+				break;
+			case CONVERSION_SRC_RGBA5551:
+				p = (r >> 3) | ((g >> 3) << 5) | ((b >> 3) << 10) | 0x8000;
+				memcpy(dst + (y * stride + x) * 2, &p, 2);
+				break;
+			case CONVERSION_SRC_RGBA4444:
+				p = (r >> 4) | ((g >> 4) << 4) | ((b >> 4) << 8) | 0xF000;
+				memcpy(dst + (y * stride + x) * 2, &p, 2);
+				break;
+			default:
+				p = r | (g << 8) | (b << 16) | 0xFF000000;
+				memcpy(dst + (y * stride + x) * 4, &p, 4);
+				break;
+			}
+		}
+	}
+}
+
+/* Copies the visible part of a 512-stride dump into another stride */
+static void restride_frame(unsigned char *dst, int stride, const unsigned char *src, int src_format)
+{
+	int bpp = src_format == CONVERSION_SRC_RGBA8888 ? 4 : 2;
+	int y;
+
+	for (y = 0; y < FB_HEIGHT; y++)
+		memcpy(dst + y * stride * bpp, src + y * FB_STRIDE * bpp, FB_WIDTH * bpp);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void suite_measure(conversion_fn fn, const unsigned char *src, int stride, int w, int h,
+			  const struct suite_options *opt, struct suite_stats *st)
+{
+	double ns[SUITE_MAX_REPS], cycles[SUITE_MAX_REPS];
+	unsigned long long t0, t1, c0, c1;
+	int iterations = opt->iterations;
+	double sum = 0, var = 0;
+	int r, n;
+
+	/* Warm up, then find an iteration count long enough to time */
+	fn(src, out, stride, w, h, 0, h);
+	if (iterations <= 0) {
+		for (iterations = 1; iterations < (1 << 16); iterations *= 2) {
+			t0 = now_ns();
+			for (n = 0; n < iterations; n++)
+				fn(src, out, stride, w, h, 0, h);
+			if (now_ns() - t0 >= SUITE_REP_NS)
+				break;
+		}
+	}
+
+	for (r = 0; r < opt->reps; r++) {
+		t0 = now_ns();
+		c0 = now_cycles();
+		for (n = 0; n < iterations; n++)
+			fn(src, out, stride, w, h, 0, h);
+		c1 = now_cycles();
+		t1 = now_ns();
+
+		ns[r] = (double)(t1 - t0) / iterations;
+		cycles[r] = (double)(c1 - c0) / iterations;
+		sum += ns[r];
+	}
+
+	st->iterations = iterations;
+	st->ns_mean = sum / opt->reps;
+	for (r = 0; r < opt->reps; r++)
+		var += (ns[r] - st->ns_mean) * (ns[r] - st->ns_mean);
+	st->ns_stddev = opt->reps > 1 ? sqrt(var / (opt->reps - 1)) : 0;
+
+	qsort(ns, opt->reps, sizeof(ns[0]), compare_double);
+	qsort(cycles, opt->reps, sizeof(cycles[0]), compare_double);
+	st->ns_min = ns[0];
+	st->ns_median = ns[opt->reps / 2];
+	st->cpp = cycles[opt->reps / 2] / (w * h);
+}
+
+/*
+ * One CSV row per frame, stride, kernel and output size. Only YUY2 at the
+ * native size has a reference to check against; the others report "-".
+ */
+static void suite_frame(const char *frame, const unsigned char *dump, int stride,
+			const struct suite_options *opt, unsigned char *src)
+{
+	static const struct {
+		const char *name;
+		int dst_format;
+	} dsts[] = {
+		{"yuy2", CONVERSION_DST_YUY2},
+		{"nv12", CONVERSION_DST_NV12},
+		{"i420", CONVERSION_DST_I420},
+		{"rgb565", CONVERSION_DST_RGB565},
+		{"y800", CONVERSION_DST_Y800},
+	};
+	struct conversion_dispatch dispatch;
+	unsigned int i, d, s;
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		const struct kernel *k = &kernels[i];
+		int src_len = strstr(k->name, "_to_") - k->name;
+
+		if (dump)
+			restride_frame(src, stride, dump, k->src_format);
+		else
+			render_scene(src, stride, k->src_format);
+
+		for (d = 0; d < sizeof(dsts) / sizeof(dsts[0]); d++) {
+			for (s = 0; s <= sizeof(scaled_sizes) / sizeof(scaled_sizes[0]); s++) {
+				int w = s ? scaled_sizes[s - 1].width : FB_WIDTH;
+				int h = s ? scaled_sizes[s - 1].height : FB_HEIGHT;
+				const char *exact = "-";
+				struct suite_stats st;
+
+				format_conversion_select(&dispatch, dsts[d].dst_format, w, h);
+				suite_measure(dispatch.convert[k->src_format], src, stride, w, h, opt, &st);
+
+				if (dsts[d].dst_format == CONVERSION_DST_YUY2 && !s) {
+					k->ref(src, out_ref, stride, w, h);
+					exact = memcmp(out_ref, out, w * h * 2) ? "no" : "yes";
+				}
+
+				printf("%s,%s,%d,%.*s_to_%s,%d,%d,%d,%d,%.0f,%.0f,%.0f,%.0f,%.2f,%s\n",
+				       opt->label, frame, stride, src_len, k->name, dsts[d].name, w, h,
+				       opt->reps, st.iterations, st.ns_min, st.ns_median, st.ns_mean,
+				       st.ns_stddev, st.cpp, exact);
+				fflush(stdout);
+			}
+		}
+	}
+}
+
+static int parse_strides(struct suite_options *opt, const char *list)
+{
+	char *end;
+
+	opt->num_strides = 0;
+	while (*list && opt->num_strides < (int)(sizeof(opt->strides) / sizeof(opt->strides[0]))) {
+		int stride = strtol(list, &end, 10);
+
+		if (end == list || stride < FB_WIDTH || stride > SUITE_MAX_STRIDE) {
+			fprintf(stderr, "strides must be between %d and %d pixels\n",
+				FB_WIDTH, SUITE_MAX_STRIDE);
+			return -1;
+		}
+		opt->strides[opt->num_strides++] = stride;
+		list = *end == ',' ? end + 1 : end;
+	}
+
+	return 0;
+}
+
+static int bench_suite(int argc, char *argv[])
+{
+	struct suite_options opt = { "-", SUITE_REPS, 0, { FB_WIDTH, FB_STRIDE }, 2 };
+	unsigned char *src;
+	int c, i, s;
+
+	while ((c = getopt(argc, argv, "l:r:n:s:")) != -1) {
+		switch (c) {
+		case 'l':
+			opt.label = optarg;
+			break;
+		case 'r':
+			opt.reps = atoi(optarg);
+			break;
+		case 'n':
+			opt.iterations = atoi(optarg);
+			break;
+		case 's':
+			if (parse_strides(&opt, optarg) < 0)
+				return 1;
+			break;
+		default:
+			fprintf(stderr, "usage: bench suite [-l label] [-r reps] [-n iterations]"
+				" [-s stride,...] [dumps...]\n");
+			return 1;
+		}
+	}
+
+	if (opt.reps < 1 || opt.reps > SUITE_MAX_REPS) {
+		fprintf(stderr, "reps must be between 1 and %d\n", SUITE_MAX_REPS);
+		return 1;
+	}
+	if (load_sequence(argc - optind, &argv[optind]) < 0)
+		return 1;
+
+	src = aligned_alloc(64, SUITE_MAX_STRIDE * FB_HEIGHT * 4);
+
+	printf("label,frame,stride,kernel,width,height,reps,iterations,"
+	       "ns_min,ns_median,ns_mean,ns_stddev,cyc_per_px,exact\n");
+
+	for (s = 0; s < opt.num_strides; s++) {
+		suite_frame("noise", fb, opt.strides[s], &opt, src);
+		suite_frame("scene", NULL, opt.strides[s], &opt, src);
+		for (i = 0; i < seq_len; i++)
+			suite_frame(argv[optind + i], seq_frames[i], opt.strides[s], &opt, src);
+	}
+
+	free(src);
+	return 0;
+}
+
+struct suite_row {
+	char key[256];
+	double ns_median;
+	double ns_stddev;
+};
+
+/* Reads the rows of a suite CSV, keyed by everything that names the case */
+static int load_suite(const char *path, struct suite_row **rows)
+{
+	char line[512], frame[128], kernel[64];
+	FILE *f = fopen(path, "r");
+	int count = 0, size = 0;
+	int stride, w, h;
+	double median, stddev;
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	*rows = NULL;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%*[^,],%127[^,],%d,%63[^,],%d,%d,%*d,%*d,%*f,%lf,%*f,%lf",
+			   frame, &stride, kernel, &w, &h, &median, &stddev) != 7)
+			continue;
+
+		if (count == size) {
+			size = size ? size * 2 : 256;
+			*rows = realloc(*rows, size * sizeof(**rows));
+		}
+		snprintf((*rows)[count].key, sizeof((*rows)[count].key), "%s,%d,%s,%dx%d",
+			 frame, stride, kernel, w, h);
+		(*rows)[count].ns_median = median;
+		(*rows)[count].ns_stddev = stddev;
+		count++;
+	}
+
+	fclose(f);
+	return count;
+}
+
+/*
+ * Lines up two suite runs and prints the change in median time per case.
+ * A case regresses when it is slower by more than threshold percent and
+ * by more than the two runs' standard deviations combined; the exit
+ * status is 1 if any did.
+ */
+static int bench_compare(const char *old_path, const char *new_path, double threshold)
+{
+	struct suite_row *old_rows, *new_rows;
+	int old_count, new_count, i, j, regressions = 0;
+
+	old_count = load_suite(old_path, &old_rows);
+	new_count = load_suite(new_path, &new_rows);
+	if (old_count < 0 || new_count < 0)
+		return 2;
+
+	printf("%-48s %12s %12s %8s\n", "case", "old ns", "new ns", "change");
+
+	for (i = 0; i < new_count; i++) {
+		const struct suite_row *n = &new_rows[i];
+
+		for (j = 0; j < old_count; j++) {
+			const struct suite_row *o = &old_rows[j];
+			double change;
+			int slower;
+
+			if (strcmp(o->key, n->key))
+				continue;
+
+			change = 100.0 * (n->ns_median - o->ns_median) / o->ns_median;
+			slower = change > threshold &&
+				 n->ns_median - o->ns_median > o->ns_stddev + n->ns_stddev;
+			regressions += slower;
+
+			printf("%-48s %12.0f %12.0f %+7.1f%%%s\n", n->key, o->ns_median,
+			       n->ns_median, change, slower ? " !" : "");
+			break;
+		}
+	}
+
+	printf("%d regression%s over %.1f%%\n", regressions, regressions == 1 ? "" : "s", threshold);
+
+	free(old_rows);
+	free(new_rows);
+	return regressions ? 1 : 0;
+}
+
+/*
+ * Simulated USB backend for "bench pipeline": a sender thread plays the
+ * controller, holding each queued payload for as long as the link takes to
+ * move it, and the host, checking the payload headers and putting the
+ * frame back together. The last payload of a frame hands its buffer back
+ * like the plugin's completion callback does. Payloads are checksummed
+ * before and after, so one written to while on the wire shows up as torn.
+ */
+#define PIPE_MAX_BUFFERS	3
+#define PIPE_MAX_PAYLOADS	16
+#define PIPE_HEADER_SIZE	12
+/* The PSP's 59.94 Hz vblank */
+#define PIPE_VBLANK_NS		16683350ull
+#define PIPE_RUN_NS		2000000000ull
+#define PIPE_DEFAULT_MBPS	20.0
+#define PIPE_DEFAULT_CONVERT_US	6000
+#define PIPE_DEFAULT_PAYLOADS	8
+
+struct pipe_sim {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Payload k of buffer i starts at bufs[i] + k * stride */
+	unsigned char *bufs[PIPE_MAX_BUFFERS];
+	/* What each buffer should reassemble to */
+	unsigned char *expect[PIPE_MAX_BUFFERS];
+	unsigned long long capture_ns[PIPE_MAX_BUFFERS];
+	int frame_size;
+	int stride;
+	/* Queued payloads as buffer * PIPE_MAX_PAYLOADS + payload, and their data sizes */
+	int queue[PIPE_MAX_BUFFERS * PIPE_MAX_PAYLOADS];
+	int sizes[PIPE_MAX_BUFFERS][PIPE_MAX_PAYLOADS];
+	int head, count;
+	/* Bit i set while buffer i belongs to the CPU, like EVENT_TX_FREE */
+	unsigned int free_bits;
+	double bytes_per_ns;
+	/* When the link is done with what it was given so far */
+	unsigned long long wire_free_ns;
+	unsigned long long busy_ns;
+	unsigned long long latency_ns;
+	int frames;
+	int torn;
+	int bad;
+	int stop;
+	/* Host side */
+	unsigned char *host;
+	int host_fill;
+	int host_fid;
+};
+
+static uint32_t pipe_checksum(const unsigned char *buf, int size)
+{
+	uint32_t sum = 0;
+	int i;
+
+	for (i = 0; i < size; i += 4)
+		sum = sum * 31 + *(const uint32_t *)(buf + i);
+
+	return sum;
+}
+
+static void sleep_until_ns(unsigned long long t)
+{
+	struct timespec ts = { t / 1000000000ull, t % 1000000000ull };
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+		;
+}
+
+/* What uvcvideo checks of each payload, returns 1 at the end of a frame */
+static int pipe_receive(struct pipe_sim *sim, const unsigned char *payload, int size, int first)
+{
+	int fid = payload[1] & 0x01, eof = payload[1] & 0x02;
+
+	if (payload[0] != PIPE_HEADER_SIZE || !(payload[1] & 0x80) ||
+	    (first ? fid == sim->host_fid : fid != sim->host_fid) ||
+	    sim->host_fill + size - PIPE_HEADER_SIZE > sim->frame_size) {
+		sim->bad++;
+		sim->host_fill = 0;
+		return eof;
+	}
+
+	sim->host_fid = fid;
+	memcpy(sim->host + sim->host_fill, payload + PIPE_HEADER_SIZE, size - PIPE_HEADER_SIZE);
+	sim->host_fill += size - PIPE_HEADER_SIZE;
+
+	return eof;
+}
+
+static void *pipe_sender(void *arg)
+{
+	struct pipe_sim *sim = arg;
+
+	for (;;) {
+		unsigned long long t0, t1;
+		unsigned char *payload;
+		int i, k, size, eof;
+		uint32_t sum;
+
+		pthread_mutex_lock(&sim->lock);
+		while (!sim->count && !sim->stop)
+			pthread_cond_wait(&sim->cond, &sim->lock);
+		if (!sim->count) {
+			pthread_mutex_unlock(&sim->lock);
+			break;
+		}
+		i = sim->queue[sim->head] / PIPE_MAX_PAYLOADS;
+		k = sim->queue[sim->head] % PIPE_MAX_PAYLOADS;
+		size = PIPE_HEADER_SIZE + sim->sizes[i][k];
+		pthread_mutex_unlock(&sim->lock);
+
+		payload = sim->bufs[i] + k * sim->stride;
+
+		/* The link runs on its own, the checks below don't hold it up */
+		t0 = now_ns();
+		if (t0 < sim->wire_free_ns)
+			t0 = sim->wire_free_ns;
+		t1 = t0 + (unsigned long long)(size / sim->bytes_per_ns);
+
+		sum = pipe_checksum(payload, size);
+		sleep_until_ns(t1);
+
+		pthread_mutex_lock(&sim->lock);
+		sim->torn += pipe_checksum(payload, size) != sum;
+		sim->wire_free_ns = t1;
+		sim->busy_ns += t1 - t0;
+
+		eof = pipe_receive(sim, payload, size, k == 0);
+		if (eof) {
+			if (sim->host_fill != sim->frame_size ||
+			    memcmp(sim->host, sim->expect[i], sim->frame_size))
+				sim->bad++;
+			sim->host_fill = 0;
+			sim->latency_ns += now_ns() - sim->capture_ns[i];
+			sim->frames++;
+		}
+
+		sim->head = (sim->head + 1) % (PIPE_MAX_BUFFERS * PIPE_MAX_PAYLOADS);
+		sim->count--;
+		/* Completion of the last payload: the buffer goes back to the CPU */
+		if (eof)
+			sim->free_bits |= 1u << i;
+		pthread_cond_broadcast(&sim->cond);
+		pthread_mutex_unlock(&sim->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * The plugin's main loop at 480x272 YUY2: wait for vblank, take the next
+ * buffer once the sender gives it back, then convert it a payload's rows
+ * at a time (padded out to convert_us per frame to stand in for the PSP's
+ * CPU), queuing each payload as soon as its rows are done.
+ */
+static void run_pipeline(const struct conversion_dispatch *dispatch, int buffers, int payloads,
+			 int serial, double mbps, int convert_us)
+{
+	struct pipe_sim sim = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	int row_bytes = format_conversion_row_bytes(CONVERSION_DST_YUY2, FB_WIDTH);
+	int rows = (FB_HEIGHT + payloads - 1) / payloads;
+	unsigned long long t0, vblank, elapsed;
+	int frames = 0, next = 0, fid = 0, i;
+	pthread_t sender;
+
+	sim.frame_size = format_conversion_frame_size(CONVERSION_DST_YUY2, FB_WIDTH, FB_HEIGHT);
+	sim.stride = (PIPE_HEADER_SIZE + rows * row_bytes + 63) & ~63;
+	sim.bytes_per_ns = mbps / 1000;
+	sim.free_bits = (1u << buffers) - 1;
+	sim.host = malloc(sim.frame_size);
+	sim.host_fid = 1;
+	for (i = 0; i < buffers; i++) {
+		sim.bufs[i] = aligned_alloc(64, payloads * sim.stride);
+		sim.expect[i] = malloc(sim.frame_size);
+	}
+
+	pthread_create(&sender, NULL, pipe_sender, &sim);
+
+	t0 = vblank = now_ns();
+	while (now_ns() - t0 < PIPE_RUN_NS) {
+		unsigned long long c0;
+		int first, lines, k;
+
+		/* Like sceDisplayWaitVblankStart(), a missed vblank is skipped */
+		while (vblank <= now_ns())
+			vblank += PIPE_VBLANK_NS;
+		sleep_until_ns(vblank);
+
+		pthread_mutex_lock(&sim.lock);
+		while (!(sim.free_bits & (1u << next)))
+			pthread_cond_wait(&sim.cond, &sim.lock);
+		sim.free_bits &= ~(1u << next);
+		sim.capture_ns[next] = now_ns();
+		pthread_mutex_unlock(&sim.lock);
+
+		/* A new picture every frame */
+		memcpy(fb, &frames, sizeof(frames));
+		dispatch->convert[CONVERSION_SRC_RGBA8888](fb, sim.expect[next], FB_STRIDE,
+							   FB_WIDTH, FB_HEIGHT, 0, FB_HEIGHT);
+
+		c0 = now_ns();
+		for (first = 0, k = 0; first < FB_HEIGHT; first += lines, k++) {
+			unsigned char *payload = sim.bufs[next] + k * sim.stride;
+
+			lines = FB_HEIGHT - first < rows ? FB_HEIGHT - first : rows;
+
+			conversion_engine_convert_rows(dispatch, CONVERSION_SRC_RGBA8888, fb,
+						       payload + PIPE_HEADER_SIZE - first * row_bytes,
+						       FB_STRIDE, first, lines, 0, flush_range, NULL);
+			/* Sleeping rather than spinning leaves the CPU to the link on one-core hosts */
+			sleep_until_ns(c0 + convert_us * 1000ull * (first + lines) / FB_HEIGHT);
+
+			payload[0] = PIPE_HEADER_SIZE;
+			payload[1] = 0x80 | fid | (first + lines == FB_HEIGHT ? 0x02 : 0);
+
+			pthread_mutex_lock(&sim.lock);
+			sim.sizes[next][k] = lines * row_bytes;
+			sim.queue[(sim.head + sim.count) % (PIPE_MAX_BUFFERS * PIPE_MAX_PAYLOADS)] =
+				next * PIPE_MAX_PAYLOADS + k;
+			sim.count++;
+			pthread_cond_broadcast(&sim.cond);
+			pthread_mutex_unlock(&sim.lock);
+		}
+
+		/* The old loop: wait for the send before anything else */
+		if (serial) {
+			pthread_mutex_lock(&sim.lock);
+			while (!(sim.free_bits & (1u << next)))
+				pthread_cond_wait(&sim.cond, &sim.lock);
+			pthread_mutex_unlock(&sim.lock);
+		}
+
+		next = (next + 1) % buffers;
+		fid ^= 1;
+		frames++;
+	}
+
+	pthread_mutex_lock(&sim.lock);
+	sim.stop = 1;
+	pthread_cond_broadcast(&sim.cond);
+	pthread_mutex_unlock(&sim.lock);
+	pthread_join(sender, NULL);
+
+	elapsed = now_ns() - t0;
+
+	printf("%7d%s %8d %8.1f %10.1f %9.0f%% %6d %6d\n", buffers, serial ? "s" : " ", payloads,
+	       sim.frames * 1e9 / elapsed, sim.latency_ns / 1e6 / sim.frames,
+	       100.0 * sim.busy_ns / elapsed, sim.torn, sim.bad);
+
+	for (i = 0; i < buffers; i++) {
+		free(sim.bufs[i]);
+		free(sim.expect[i]);
+	}
+	free(sim.host);
+}
+
+static void bench_pipeline(const struct conversion_dispatch *dispatch, double mbps, int convert_us,
+			   int payloads)
+{
+	int size = format_conversion_frame_size(CONVERSION_DST_YUY2, FB_WIDTH, FB_HEIGHT);
+	int buffers;
+
+	if (payloads < 1 || payloads > PIPE_MAX_PAYLOADS)
+		payloads = PIPE_DEFAULT_PAYLOADS;
+
+	printf("%dx%d YUY2, %d bytes per frame, link %.1f MB/s (%.1f ms per frame),"
+	       " conversion %.1f ms\n", FB_WIDTH, FB_HEIGHT, size, mbps, size / mbps / 1000,
+	       convert_us / 1000.0);
+	printf("%8s %8s %8s %10s %10s %6s %6s\n", "buffers", "payloads", "fps", "latency ms",
+	       "link busy", "torn", "bad");
+
+	run_pipeline(dispatch, 1, 1, 1, mbps, convert_us);
+	for (buffers = 1; buffers <= PIPE_MAX_BUFFERS; buffers++)
+		run_pipeline(dispatch, buffers, 1, 0, mbps, convert_us);
+	for (buffers = 1; buffers <= 2; buffers++)
+		run_pipeline(dispatch, buffers, payloads, 0, mbps, convert_us);
+}
+
+int main(int argc, char *argv[])
+{
+	struct conversion_dispatch dispatch;
+	unsigned int i;
+	int ret = 0;
+
+	format_conversion_init();
+	jpeg_encoder_init();
+	format_conversion_select(&dispatch, CONVERSION_DST_YUY2, FB_WIDTH, FB_HEIGHT);
+
+	srand(1);
+	for (i = 0; i < sizeof(fb); i++)
+		fb[i] = rand();
+
+	if (argc > 1 && strcmp(argv[1], "suite") == 0)
+		return bench_suite(argc - 1, &argv[1]);
+
+	if (argc > 3 && strcmp(argv[1], "compare") == 0)
+		return bench_compare(argv[2], argv[3], argc > 4 ? atof(argv[4]) : 5.0);
+
+	if (argc > 1 && strcmp(argv[1], "pipeline") == 0) {
+		bench_pipeline(&dispatch, argc > 2 ? atof(argv[2]) : PIPE_DEFAULT_MBPS,
+			       argc > 3 ? atoi(argv[3]) : PIPE_DEFAULT_CONVERT_US,
+			       argc > 4 ? atoi(argv[4]) : PIPE_DEFAULT_PAYLOADS);
+		return 0;
+	}
+
+	if (argc > 1 && strcmp(argv[1], "strips") == 0) {
+		printf("ns per frame by strip height\n");
+		bench_strips(&dispatch);
+		return 0;
+	}
+
+	if (argc > 1 && strcmp(argv[1], "bands") == 0) {
+		if (argc > 3) {
+			if (load_sequence(argc - 3, &argv[3]) < 0)
+				return 1;
+			printf("cycling through %d frames\n", seq_len);
+		}
+		printf("ns per frame and speed-up by worker count (! = output mismatch)\n");
+		bench_bands(&dispatch, argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN));
+		return 0;
+	}
+
+	if (argc > 1 && strcmp(argv[1], "dirty") == 0) {
+		if (argc > 2) {
+			if (load_sequence(argc - 2, &argv[2]) < 0)
+				return 1;
+		} else {
+			synth_sequence();
+		}
+		printf("replaying %d frames\n", seq_len);
+		bench_dirty(&dispatch);
+		return 0;
+	}
+
+	if (argc > 1 && strcmp(argv[1], "slices") == 0) {
+		format_conversion_select(&enc_dispatch, CONVERSION_DST_YUY2, FB_WIDTH, FB_HEIGHT);
+		synth_scene_sequence(1);
+		printf("ns per frame, speed-up and extra bytes per frame by slice count"
+		       " (! = output mismatch)\n");
+		bench_slices(argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN));
+		return 0;
+	}
+
+	if (argc > 1 && strcmp(argv[1], "h264") == 0) {
+		const char *path = argc > 2 ? argv[2] : H264_DEFAULT_STREAM;
+
+		format_conversion_select(&enc_dispatch, CONVERSION_DST_YUY2, FB_WIDTH, FB_HEIGHT);
+
+		synth_scene_sequence(0);
+		printf("static scene, %d frames at %dx%d\n", seq_len, FB_WIDTH, FB_HEIGHT);
+		bench_h264(path);
+		free_sequence();
+
+		synth_scene_sequence(1);
+		printf("\nhigh-motion scene, %d frames at %dx%d\n", seq_len, FB_WIDTH, FB_HEIGHT);
+		bench_h264(path);
+		return 0;
+	}
+
+	if (argc > 1 && strcmp(argv[1], "jpeg") == 0) {
+		format_conversion_select(&enc_dispatch, CONVERSION_DST_YUY2, FB_WIDTH, FB_HEIGHT);
+
+		if (argc > 2) {
+			if (load_sequence(argc - 2, &argv[2]) < 0)
+				return 1;
+			printf("encoding %d frames at %dx%d\n", seq_len, FB_WIDTH, FB_HEIGHT);
+			bench_jpeg();
+			return 0;
+		}
+
+		synth_scene_sequence(0);
+		printf("static scene, %d frames at %dx%d\n", seq_len, FB_WIDTH, FB_HEIGHT);
+		bench_jpeg();
+		free_sequence();
+
+		synth_scene_sequence(1);
+		printf("\nhigh-motion scene, %d frames at %dx%d\n", seq_len, FB_WIDTH, FB_HEIGHT);
+		bench_jpeg();
+		return 0;
+	}
+
+	printf("%-18s %12s %10s %12s %10s %8s\n", "kernel",
+	       "ref ns/frm", "ref cyc/px", "ns/frm", "cyc/px", "exact");
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		const struct kernel *k = &kernels[i];
+		double ref_ns, ref_cpp, ns, cpp;
+		int exact;
+
+		measure(&dispatch, k->src_format, k->ref, out_ref, &ref_ns, &ref_cpp);
+		measure(&dispatch, k->src_format, NULL, out, &ns, &cpp);
+		exact = memcmp(out_ref, out, sizeof(out)) == 0;
+		if (!exact)
+			ret = 1;
+
+		printf("%-18s %12.0f %10.2f %12.0f %10.2f %8s\n", k->name,
+		       ref_ns, ref_cpp, ns, cpp, exact ? "yes" : "NO");
+	}
+
+	bench_scaled();
+	bench_dst_formats();
+
+	return ret;
+}
@@ -0,0 +1,9 @@
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+void ref_r8g8b8a8_to_yuy2(const unsigned char *rgba, unsigned char *yuy2, int in_stride, int width, int height);
+void ref_r5g6b5_to_yuy2(const unsigned char *rgb, unsigned char *yuy2, int in_stride, int width, int height);
+void ref_r5g5b5a1_to_yuy2(const unsigned char *rgba, unsigned char *yuy2, int in_stride, int width, int height);
+void ref_r4g4b4a4_to_yuy2(const unsigned char *rgba, unsigned char *yuy2, int in_stride, int width, int height);
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ * pthread pool implementing struct conversion_executor for host builds.
+ * The calling thread takes jobs too, so num_workers counts it.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include "thread_pool.h"
+
+struct thread_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	pthread_t *threads;
+	int num_threads;
+	unsigned int generation;
+	int quit;
+
+	conversion_job_fn job;
+	void *arg;
+	int num_jobs;
+	int next_job;
+	int pending;
+};
+
+/* Takes jobs until none are left; called with the lock held */
+static void drain(struct thread_pool *pool)
+{
+	while (pool->next_job < pool->num_jobs) {
+		int index = pool->next_job++;
+
+		pthread_mutex_unlock(&pool->lock);
+		pool->job(pool->arg, index);
+		pthread_mutex_lock(&pool->lock);
+
+		if (--pool->pending == 0)
+			pthread_cond_broadcast(&pool->done);
+	}
+}
+
+static void *worker(void *arg)
+{
+	struct thread_pool *pool = arg;
+	unsigned int seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->quit && pool->generation == seen)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->quit)
+			break;
+		seen = pool->generation;
+		drain(pool);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+static void pool_run(struct conversion_executor *executor, conversion_job_fn job,
+		     void *arg, int num_jobs)
+{
+	struct thread_pool *pool = executor->priv;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->job = job;
+	pool->arg = arg;
+	pool->num_jobs = num_jobs;
+	pool->next_job = 0;
+	pool->pending = num_jobs;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+
+	drain(pool);
+	while (pool->pending)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int thread_pool_init(struct conversion_executor *executor, int num_workers)
+{
+	struct thread_pool *pool;
+	int i;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return -1;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	pool->num_threads = num_workers - 1;
+	pool->threads = calloc(pool->num_threads + 1, sizeof(pthread_t));
+	for (i = 0; i < pool->num_threads; i++)
+		pthread_create(&pool->threads[i], NULL, worker, pool);
+
+	executor->run = pool_run;
+	executor->num_workers = num_workers;
+	executor->priv = pool;
+
+	return 0;
+}
+
+void thread_pool_fini(struct conversion_executor *executor)
+{
+	struct thread_pool *pool = executor->priv;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->num_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
@@ -0,0 +1,10 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "conversion_engine.h"
+
+/* Sets up a pthread-backed executor with num_workers threads */
+int thread_pool_init(struct conversion_executor *executor, int num_workers);
+void thread_pool_fini(struct conversion_executor *executor);
+
+#endif
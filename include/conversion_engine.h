@@ -0,0 +1,65 @@
+#ifndef CONVERSION_ENGINE_H
+#define CONVERSION_ENGINE_H
+
+#include "format_conversion.h"
+
+typedef void (*conversion_job_fn)(void *arg, int index);
+
+/*
+ * Runs job(arg, 0) ... job(arg, num_jobs - 1), in any order and on any
+ * number of workers, and returns once all of them have finished.
+ */
+struct conversion_executor {
+	void (*run)(struct conversion_executor *executor, conversion_job_fn job,
+		    void *arg, int num_jobs);
+	int num_workers;
+	void *priv;
+};
+
+/* Runs every job on the calling thread */
+extern struct conversion_executor conversion_executor_inline;
+
+#define CONVERSION_MAX_LINES	272
+
+/*
+ * Fingerprints of the source rows behind what is currently in the output
+ * buffer, used to skip converting rows that did not change.
+ */
+struct conversion_row_cache {
+	uint32_t hash[CONVERSION_MAX_LINES];
+	int src_format;
+	int valid;
+	/* Rows reused instead of converted in the last frame */
+	int rows_skipped;
+};
+
+/* Forgets the output buffer contents, e.g. after changing format or size */
+void conversion_row_cache_reset(struct conversion_row_cache *rows);
+
+/*
+ * Splits the frame into num_bands horizontal bands and converts them as
+ * independent jobs on the executor. Each band is converted strip by strip
+ * as in format_conversion_convert_strips(). Bands never overlap in the
+ * output, so the result does not depend on the band count.
+ *
+ * rows may be NULL; otherwise unchanged rows are left as they are in dst,
+ * which must still hold the previous frame converted by this function.
+ */
+void conversion_engine_convert(struct conversion_executor *executor,
+                               const struct conversion_dispatch *dispatch, int src_format,
+                               const unsigned char *src, unsigned char *dst, int in_stride,
+                               int num_bands, int strip_lines, conversion_flush_fn flush,
+                               struct conversion_row_cache *rows);
+
+/*
+ * Converts output rows [first, first + lines) only, on the calling thread,
+ * for callers that pass each part of the frame on as soon as it is ready.
+ * dst is where row 0 would go; rows is handled as above, with the frame
+ * counted as converted once its last row is.
+ */
+void conversion_engine_convert_rows(const struct conversion_dispatch *dispatch, int src_format,
+                                    const unsigned char *src, unsigned char *dst, int in_stride,
+                                    int first, int lines, int strip_lines,
+                                    conversion_flush_fn flush, struct conversion_row_cache *rows);
+
+#endif
@@ -3,9 +3,208 @@
 
 #include <inttypes.h>
 
+/* Source layouts, numbered like PSP_DISPLAY_PIXEL_FORMAT_* */
+enum conversion_src_format {
+	CONVERSION_SRC_RGB565,
+	CONVERSION_SRC_RGBA5551,
+	CONVERSION_SRC_RGBA4444,
+	CONVERSION_SRC_RGBA8888,
+	CONVERSION_SRC_COUNT
+};
+
+enum conversion_dst_format {
+	CONVERSION_DST_YUY2,
+	/* 4:2:0: luma plane, then interleaved CbCr (NV12) or Cb and Cr planes (I420) */
+	CONVERSION_DST_NV12,
+	CONVERSION_DST_I420,
+	/*
+	 * 16-bit RGB with blue in the low bits. A 565 source only has its red
+	 * and blue fields swapped; other sources are truncated to 565.
+	 */
+	CONVERSION_DST_RGB565,
+	/* Luma only, no chroma is computed */
+	CONVERSION_DST_Y800,
+	CONVERSION_DST_COUNT
+};
+
+/* Colour matrix and range of the YCbCr output */
+enum conversion_color {
+	CONVERSION_COLOR_BT601_LIMITED,
+	CONVERSION_COLOR_BT601_FULL,
+	CONVERSION_COLOR_BT709_LIMITED,
+	CONVERSION_COLOR_BT709_FULL,
+	CONVERSION_COLOR_COUNT
+};
+
+#define CONVERSION_COLOR_IS_BT709(color)	((color) >= CONVERSION_COLOR_BT709_LIMITED)
+#define CONVERSION_COLOR_IS_FULL(color)		((color) & 1)
+
+/* Size of the LCDC framebuffer every converter reads from */
+#define CONVERSION_SRC_WIDTH	480
+#define CONVERSION_SRC_HEIGHT	272
+
+/*
+ * Converts output rows [first, first + lines) of a width x height frame.
+ * src and dst point at the start of the source and output frames.
+ */
+typedef void (*conversion_fn)(const unsigned char *src, unsigned char *dst, int in_stride,
+			      int width, int height, int first, int lines);
+
+typedef void (*conversion_flush_fn)(const void *addr, unsigned int size);
+
+#define CONVERSION_MCU_WIDTH	16
+#define CONVERSION_MCU_HEIGHT	8
+
+/* One 16x8 block of 4:2:2 YCbCr samples, as a JPEG MCU is made of */
+struct conversion_mcu {
+	unsigned char y[CONVERSION_MCU_HEIGHT][CONVERSION_MCU_WIDTH];
+	unsigned char cb[CONVERSION_MCU_HEIGHT][CONVERSION_MCU_WIDTH / 2];
+	unsigned char cr[CONVERSION_MCU_HEIGHT][CONVERSION_MCU_WIDTH / 2];
+};
+
+/*
+ * Loads the block of output pixels starting at (x, y) of a width x height
+ * frame straight from the source, with the same values a YUY2 conversion
+ * gives: chroma from horizontal pixel pairs. Past the right and bottom
+ * edges the last pixel pair and row are repeated.
+ */
+typedef void (*conversion_mcu_fn)(const unsigned char *src, int in_stride, int width, int height,
+				  int x, int y, struct conversion_mcu *mcu);
+
+/* Converters for one output format and size, indexed by source layout */
+struct conversion_dispatch {
+	conversion_fn convert[CONVERSION_SRC_COUNT];
+	/* Block loaders for the same size, whatever the output format */
+	conversion_mcu_fn load_mcu[CONVERSION_SRC_COUNT];
+	int dst_format;
+	int width;
+	int height;
+	/* 1 for 1:1, 2 or 4 for box downscaling, 0 for arbitrary ratios */
+	int scale;
+};
+
+/*
+ * Picture controls, applied by rebuilding the lookup tables rather than
+ * per pixel. Brightness and contrast act on each RGB channel before the
+ * colour matrix, saturation and hue rotate and scale its chroma rows. RGB
+ * output is passed through untouched.
+ */
+struct conversion_adjust {
+	/* Added to each channel, -128 to 127 */
+	int brightness;
+	/* Percent, channels are scaled around mid-grey */
+	int contrast;
+	/* Percent; past the point where the chroma range is full, colours
+	 * at the edge of the RGB cube are limited rather than wrapped */
+	int saturation;
+	/* Degrees */
+	int hue;
+};
+
+#define CONVERSION_ADJUST_DEFAULT	{ 0, 100, 100, 0 }
+
+void format_conversion_init(void);
+
+/* Rebuilds the tables; must not race with a conversion */
+void format_conversion_set_adjust(const struct conversion_adjust *adjust);
+
+/*
+ * Switches the colour matrix and range, BT.601 limited range by default.
+ * Rebuilds the tables only if it changes; the same caveat applies.
+ */
+void format_conversion_set_color(int color);
+
+/*
+ * Picks the converters producing a width x height frame from the 480x272
+ * source: 1:1, half and quarter size get dedicated box-filtering kernels,
+ * any other size a 2x2-filtered arbitrary-ratio kernel.
+ */
+void format_conversion_select(struct conversion_dispatch *dispatch, int dst_format, int width, int height);
+
+/* Bytes in one output frame */
+int format_conversion_frame_size(int dst_format, int width, int height);
+
+/*
+ * Bytes in one output row of a packed layout, whose rows follow each other
+ * in the frame. 0 for the planar layouts, where they don't.
+ */
+int format_conversion_row_bytes(int dst_format, int width);
+
+/*
+ * Row ranges handed to the converters must start and end on a multiple
+ * of this: 2 for the 4:2:0 layouts, whose chroma spans a row pair.
+ */
+int format_conversion_row_align(int dst_format);
+
+/*
+ * Converts output rows [first, first + lines) strip_lines rows at a time,
+ * handing each converted strip to flush() while it is still in the data
+ * cache. strip_lines <= 0 converts them in one strip.
+ *
+ * If row_hashes is not NULL it gets a fingerprint of the source rows behind
+ * every output row, and with reuse_rows set, rows whose fingerprint matches
+ * the stored one are assumed to be converted in dst already and are neither
+ * converted nor flushed. Returns the number of rows skipped that way.
+ */
+int format_conversion_convert_strips(const struct conversion_dispatch *dispatch, int src_format,
+                                     const unsigned char *src, unsigned char *dst, int in_stride,
+                                     int first, int lines, int strip_lines, conversion_flush_fn flush,
+                                     uint32_t *row_hashes, int reuse_rows);
+
+/*
+ * Converts output rows [first, first + lines) into buf, which only holds
+ * those rows, for consumers working on a few rows at a time. Packed
+ * (non-planar) output formats only.
+ */
+void format_conversion_convert_into(const struct conversion_dispatch *dispatch, int src_format,
+                                    const unsigned char *src, int in_stride, int first, int lines,
+                                    unsigned char *buf);
+
+/*
+ * Cheap whole-frame fingerprint from every FRAME_SAMPLE_ROW_STEP-th source
+ * row. Changes confined to the rows in between are not seen.
+ */
+#define FRAME_SAMPLE_ROW_STEP	8
+
+uint32_t format_conversion_frame_sample(const unsigned char *src, int src_format, int in_stride,
+                                        int width, int height);
+
+/* The same over every source row, so any change is seen */
+uint32_t format_conversion_frame_fingerprint(const unsigned char *src, int src_format, int in_stride,
+                                             int width, int height);
+
+/*
+ * Fingerprint of every source pixel read to produce the w x h block of
+ * output pixels at (x, y), so an unchanged block can be told apart before
+ * it is converted. Table changes (colour, picture controls) are not seen.
+ */
+uint32_t format_conversion_block_fingerprint(const struct conversion_dispatch *dispatch, int src_format,
+                                             const unsigned char *src, int in_stride,
+                                             int x, int y, int w, int h);
+
 void r8g8b8a8_to_yuy2(const unsigned char *rgba, unsigned char *yuy2, int in_stride, int width, int height);
 void r5g6b5_to_yuy2(const unsigned char *rgb, unsigned char *yuy2, int in_stride, int width, int height);
 void r5g5b5a1_to_yuy2(const unsigned char *rgba, unsigned char *yuy2, int in_stride, int width, int height);
 void r4g4b4a4_to_yuy2(const unsigned char *rgba, unsigned char *yuy2, int in_stride, int width, int height);
 
+void r8g8b8a8_to_nv12(const unsigned char *rgba, unsigned char *nv12, int in_stride, int width, int height);
+void r5g6b5_to_nv12(const unsigned char *rgb, unsigned char *nv12, int in_stride, int width, int height);
+void r5g5b5a1_to_nv12(const unsigned char *rgba, unsigned char *nv12, int in_stride, int width, int height);
+void r4g4b4a4_to_nv12(const unsigned char *rgba, unsigned char *nv12, int in_stride, int width, int height);
+
+void r8g8b8a8_to_i420(const unsigned char *rgba, unsigned char *i420, int in_stride, int width, int height);
+void r5g6b5_to_i420(const unsigned char *rgb, unsigned char *i420, int in_stride, int width, int height);
+void r5g5b5a1_to_i420(const unsigned char *rgba, unsigned char *i420, int in_stride, int width, int height);
+void r4g4b4a4_to_i420(const unsigned char *rgba, unsigned char *i420, int in_stride, int width, int height);
+
+void r8g8b8a8_to_rgb565(const unsigned char *rgba, unsigned char *rgb565, int in_stride, int width, int height);
+void r5g6b5_to_rgb565(const unsigned char *rgb, unsigned char *rgb565, int in_stride, int width, int height);
+void r5g5b5a1_to_rgb565(const unsigned char *rgba, unsigned char *rgb565, int in_stride, int width, int height);
+void r4g4b4a4_to_rgb565(const unsigned char *rgba, unsigned char *rgb565, int in_stride, int width, int height);
+
+void r8g8b8a8_to_y800(const unsigned char *rgba, unsigned char *y800, int in_stride, int width, int height);
+void r5g6b5_to_y800(const unsigned char *rgb, unsigned char *y800, int in_stride, int width, int height);
+void r5g5b5a1_to_y800(const unsigned char *rgba, unsigned char *y800, int in_stride, int width, int height);
+void r4g4b4a4_to_y800(const unsigned char *rgba, unsigned char *y800, int in_stride, int width, int height);
+
 #endif
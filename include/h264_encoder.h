@@ -0,0 +1,86 @@
+#ifndef H264_ENCODER_H
+#define H264_ENCODER_H
+
+#include <inttypes.h>
+#include "format_conversion.h"
+
+/*
+ * Minimal H.264 (Constrained Baseline) encoder for the frame-based stream.
+ * Macroblocks that changed since the previous frame are sent as I_PCM,
+ * i.e. raw 4:2:0 samples, and unchanged ones as P_Skip, which every
+ * decoder copies from the reference frame. Static content costs a few
+ * bytes per frame, changed content 384 bytes per macroblock, and decoded
+ * frames match the encoder's input exactly.
+ *
+ * Frames are written as an Annex B byte stream. An IDR picture, preceded
+ * by the SPS and PPS, is sent first and then every idr_interval frames, so
+ * a host that joins late or a missed fingerprint change is repaired.
+ *
+ * Like the JPEG encoder, source rows are converted to YUY2 a macroblock
+ * row at a time; chroma is reduced to 4:2:0 by averaging row pairs.
+ */
+
+#define H264_MAX_WIDTH		CONVERSION_SRC_WIDTH
+#define H264_MB_SIZE		16
+
+#define H264_MAX_MBS		((H264_MAX_WIDTH / H264_MB_SIZE) * \
+				 ((CONVERSION_SRC_HEIGHT + H264_MB_SIZE - 1) / H264_MB_SIZE))
+
+#define H264_DEFAULT_IDR_INTERVAL	120
+
+struct h264_encoder {
+	int width;
+	int height;
+	int mb_cols;
+	int mb_rows;
+	/* Signalled in the SPS, from the size and frame rate */
+	int level_idc;
+	/* Frames from one IDR to the next, 0 to only send the first */
+	int idr_interval;
+	/* enum conversion_color, signalled in the SPS */
+	int color;
+	int frames_since_idr;
+	/* Set when the decoder's reference can't be trusted to match ours */
+	int force_idr;
+	int frame_num;
+	int idr_pic_id;
+	/* Macroblocks sent as I_PCM in the last frame */
+	int mbs_coded;
+	/* Fingerprints of the macroblocks in the reference frame */
+	uint32_t mb_hash[H264_MAX_MBS];
+	/* YUY2 rows of the macroblock row being encoded */
+	unsigned char strip[H264_MAX_WIDTH * 2 * H264_MB_SIZE];
+};
+
+/* fps is the highest frame rate the stream runs at, which sets the level */
+void h264_encoder_setup(struct h264_encoder *enc, int width, int height, int fps,
+                        int idr_interval);
+
+/*
+ * Sets the colour matrix and range the SPS announces, which should be the
+ * ones the conversion tables are built for. Takes effect at the next IDR.
+ */
+void h264_encoder_set_color(struct h264_encoder *enc, int color);
+
+/* Makes the next frame an IDR picture */
+void h264_encoder_request_idr(struct h264_encoder *enc);
+
+/* Whether the next frame will be an IDR picture */
+int h264_encoder_idr_due(const struct h264_encoder *enc);
+
+/*
+ * Encodes one frame into out. dispatch must convert to YUY2 at the
+ * encoder's size. Returns the number of bytes written, or -1 if the frame
+ * did not fit in out_size bytes, after which the next frame is an IDR.
+ */
+int h264_encoder_encode(struct h264_encoder *enc, const struct conversion_dispatch *dispatch,
+                        int src_format, const unsigned char *src, int in_stride,
+                        unsigned char *out, int out_size);
+
+/*
+ * Encodes a frame identical to the previous one, all P_Skip, without
+ * looking at the source. Must not be used while an IDR is due.
+ */
+int h264_encoder_encode_unchanged(struct h264_encoder *enc, unsigned char *out, int out_size);
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef JPEG_ENCODER_H
+#define JPEG_ENCODER_H
+
+#include <inttypes.h>
+#include "format_conversion.h"
+#include "conversion_engine.h"
+
+/*
+ * Baseline JPEG encoder for the MJPEG format: 4:2:2 sampling (16x8 MCUs of
+ * two luma and two chroma blocks), the Annex K Huffman tables, an integer
+ * DCT and quantization by reciprocal multiply.
+ *
+ * MCUs are loaded straight from the source frame, colour conversion and
+ * chroma subsampling included, so the only frame-sized buffer is the
+ * compressed output. JFIF decoders take the samples as full-range BT.601,
+ * so the conversion tables must be set to JPEG_COLOR while encoding.
+ *
+ * A frame can be split into slices of whole MCU rows that are encoded as
+ * independent jobs on a conversion executor. Each slice starts at a
+ * restart marker with fresh DC predictors and ends byte-aligned, so the
+ * slices are joined by copying alone into one ordinary baseline JPEG.
+ */
+
+#define JPEG_MAX_WIDTH		CONVERSION_SRC_WIDTH
+#define JPEG_MCU_WIDTH		16
+#define JPEG_MCU_HEIGHT		8
+
+#define JPEG_DEFAULT_QUALITY	80
+
+#define JPEG_COLOR		CONVERSION_COLOR_BT601_FULL
+
+#define JPEG_MAX_MCUS		((JPEG_MAX_WIDTH / JPEG_MCU_WIDTH) * \
+				 ((CONVERSION_SRC_HEIGHT + JPEG_MCU_HEIGHT - 1) / JPEG_MCU_HEIGHT))
+
+/*
+ * Upper bound on the MCUs per restart interval picked for the segment
+ * cache: the largest divisor of the MCU columns up to this, so intervals
+ * never straddle MCU rows. Smaller intervals reuse more of a partly
+ * changing row but cost a marker and some padding each.
+ */
+#define JPEG_SEGMENT_MCUS_MAX	6
+
+/* Slices per frame, each with its own MCU buffer */
+#define JPEG_MAX_SLICES		4
+
+/* Room for the coded bytes of one frame's cacheable segments */
+#define JPEG_CACHE_BYTES	(64 * 1024)
+
+/*
+ * Entropy-coded bytes of the last frame, one entry per restart interval,
+ * with a fingerprint of the source pixels each was coded from. Unchanged
+ * intervals are copied without being loaded or encoded; restart markers
+ * reset the DC predictors, so a copied interval decodes the same in any
+ * frame. The fingerprint does not see the colour tables, so whoever
+ * changes them clears valid.
+ *
+ * The bytes alternate between the two halves of data, the previous
+ * frame's half being read while the current one is written.
+ */
+struct jpeg_segment_cache {
+	uint32_t hash[JPEG_MAX_MCUS];
+	uint32_t offset[JPEG_MAX_MCUS];
+	/* 0 if the interval did not fit in the cache */
+	uint16_t size[JPEG_MAX_MCUS];
+	int valid;
+	int current;
+	/* Intervals copied from the cache in the last frame, and their count */
+	int segments_reused;
+	int segments;
+	unsigned char data[2][JPEG_CACHE_BYTES];
+};
+
+struct jpeg_encoder {
+	int width;
+	int height;
+	int quality;
+	/* MCUs per restart interval, 0 for none */
+	int restart_mcus;
+	struct jpeg_segment_cache *cache;
+	/* Runs the slices; 0 or 1 slices encodes on the calling thread */
+	struct conversion_executor *executor;
+	int slices;
+	/* Quantization tables in zigzag order, as written to the DQT segment */
+	unsigned char qt_luma[64];
+	unsigned char qt_chroma[64];
+	/* Fixed-point reciprocals of the scaled quantizers, in zigzag order */
+	uint16_t recip_luma[64];
+	uint16_t recip_chroma[64];
+	/* Samples of the MCU each slice is encoding */
+	struct conversion_mcu mcu[JPEG_MAX_SLICES];
+};
+
+/* Builds the Huffman code tables shared by all encoders */
+void jpeg_encoder_init(void);
+
+void jpeg_encoder_setup(struct jpeg_encoder *enc, int width, int height, int quality);
+
+/* quality goes from 1 (smallest) to 100 (best), as with the IJG scaling */
+void jpeg_encoder_set_quality(struct jpeg_encoder *enc, int quality);
+
+/*
+ * Reuses the coded bits of unchanged restart intervals from the previous
+ * frame, which turns on restart markers. NULL turns both off again.
+ */
+void jpeg_encoder_set_cache(struct jpeg_encoder *enc, struct jpeg_segment_cache *cache);
+
+/*
+ * Encodes frames as up to slices (at most JPEG_MAX_SLICES) jobs on
+ * executor. More than one slice needs restart markers, so without the
+ * segment cache this adds one at the end of every MCU row. The output
+ * buffer is shared out evenly between the slices while encoding, so a
+ * slice that does not fit its share fails the frame.
+ */
+void jpeg_encoder_set_slices(struct jpeg_encoder *enc, struct conversion_executor *executor,
+                             int slices);
+
+/*
+ * Encodes one frame into out. Only the MCU loaders of dispatch are used,
+ * so it may be selected for any output format at the encoder's size.
+ * Returns the number of bytes written, or -1 if the frame did not fit in
+ * out_size bytes.
+ */
+int jpeg_encoder_encode(struct jpeg_encoder *enc, const struct conversion_dispatch *dispatch,
+                        int src_format, const unsigned char *src, int in_stride,
+                        unsigned char *out, int out_size);
+
+#endif
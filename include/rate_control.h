@@ -0,0 +1,44 @@
+#ifndef RATE_CONTROL_H
+#define RATE_CONTROL_H
+
+/*
+ * Closed-loop quality control for compressed frames. After every encoded
+ * frame it is told the frame size and how long the USB send took, keeps a
+ * smoothed estimate of the link throughput and moves the quality so the
+ * frames fit a byte budget: the bitrate target, the bytes the link moves
+ * in the send-time target, or the smaller of the two.
+ *
+ * Quality drops quickly when over budget and creeps back up by one step
+ * at a time when well under it, so steady content settles on one quality
+ * instead of oscillating around it.
+ */
+struct rate_control {
+	int quality;
+	int min_quality;
+	int max_quality;
+	/* Bytes per frame allowed by the bitrate target, 0 if none */
+	int target_bytes;
+	/* USB send time allowed per frame in microseconds, 0 if none */
+	int target_us;
+	/* Smoothed link throughput in bytes per millisecond, 0 until measured */
+	int throughput;
+	/* Budget the last frame was measured against, in bytes */
+	int budget;
+};
+
+void rate_control_init(struct rate_control *rc, int quality, int min_quality, int max_quality);
+
+/* Either target may be 0 to ignore it; with both 0 the quality stays put */
+void rate_control_set_target(struct rate_control *rc, int target_bytes, int target_us);
+
+/*
+ * Feeds back one sent frame. send_us may be 0 if it was not measured, in
+ * which case only the size is used. Returns the quality to encode the next
+ * frame with.
+ */
+int rate_control_update(struct rate_control *rc, int frame_bytes, unsigned int send_us);
+
+/* For a frame that did not fit its buffer at all: drops quality a full step */
+int rate_control_overflow(struct rate_control *rc);
+
+#endif
@@ -10,6 +10,14 @@
 #define USB_DT_CS_INTERFACE		(USB_CTRLTYPE_TYPE_CLASS | USB_DT_INTERFACE)
 #define USB_DT_CS_ENDPOINT		(USB_CTRLTYPE_TYPE_CLASS | USB_DT_ENDPOINT)
 
+#define USB_ENDPOINT_SYNC_ASYNC		0x04	/* in bmAttributes */
+
+/* wMaxPacketSize of a periodic endpoint moving transactions packets per interval */
+#define ISOC_PACKET_SIZE(bytes, transactions)	((bytes) | (((transactions) - 1) << 11))
+/* Bytes such an endpoint moves per service interval */
+#define ISOC_INTERVAL_BYTES(max_packet) \
+	(((max_packet) & 0x7FF) * ((((max_packet) >> 11) & 3) + 1))
+
 /*
  * UVC Configurable options
  */
@@ -18,17 +26,56 @@
 #define CONTROL_INTERFACE 		1
 #define STREAM_INTERFACE		2
 
+/* Payload header timestamps count the system timer, in microseconds */
+#define UVC_CLOCK_FREQUENCY		1000000
+
+/*
+ * Stream on isochronous endpoints instead of the bulk one. The streaming
+ * interface then has no endpoint in alternate setting 0 and one per
+ * bandwidth tier in settings 1 to ISOC_ALT_SETTINGS, so the host reserves
+ * bus time for the stream in the tier it picks, and starts and stops it by
+ * selecting a setting. Frames keep their pace on a shared bus, but what
+ * doesn't arrive in its service interval is lost, not retried.
+ */
+#ifndef ENABLE_ISOC_STREAMING
+#define ENABLE_ISOC_STREAMING		0
+#endif
+
+#define ISOC_ALT_SETTINGS		4
+/* The largest high-speed tier: three 1024 byte packets per microframe */
+#define ISOC_MAX_INTERVAL_BYTES		(3 * 1024)
+
+#if ENABLE_ISOC_STREAMING
+#define STREAM_ALT_SETTINGS		(1 + ISOC_ALT_SETTINGS)
+#define STREAM_ENDPOINTS		ISOC_ALT_SETTINGS
+#else
+#define STREAM_ALT_SETTINGS		1
+#define STREAM_ENDPOINTS		1
+#endif
+
 #define INTERFACE_CTRL_ID		0
 #define INPUT_TERMINAL_ID		1
 #define OUTPUT_TERMINAL_ID		2
+#define PROCESSING_UNIT_ID		3
 
 #define FORMAT_INDEX_UNCOMPRESSED_YUY2	1
+#define FORMAT_INDEX_UNCOMPRESSED_NV12	2
+#define FORMAT_INDEX_UNCOMPRESSED_I420	3
+#define FORMAT_INDEX_UNCOMPRESSED_RGBP	4
+#define FORMAT_INDEX_UNCOMPRESSED_Y800	5
+#define FORMAT_INDEX_MJPEG		6
+#define FORMAT_INDEX_H264		7
 
 /*
  * Helper macros
  */
 
-#define VIDEO_FRAME_SIZE_YUY2(w, h)		((w) * (h) * 2)
+#define VIDEO_FRAME_SIZE(w, h, bpp)		((w) * (h) * (bpp) / 8)
+#define VIDEO_FRAME_SIZE_YUY2(w, h)		VIDEO_FRAME_SIZE(w, h, 16)
+/* The encoder gives up on frames that would not fit the YUY2 size */
+#define VIDEO_FRAME_SIZE_MJPEG(w, h)		VIDEO_FRAME_SIZE(w, h, 16)
+/* An all-I_PCM picture takes a little over 12 bits per (padded) pixel */
+#define VIDEO_FRAME_SIZE_H264(w, h)		VIDEO_FRAME_SIZE(w, h, 16)
 
 #define FRAME_BITRATE(w, h, bpp, interval)	(((w) * (h) * (bpp)) / ((interval) * 100 * 1E-9))
 #define FPS_TO_INTERVAL(fps)			((1E9 / 100) / (fps))
@@ -51,6 +98,7 @@ DECLARE_UVC_HEADER_DESCRIPTOR(1);
 static struct __attribute__((packed)) {
 	struct UVC_HEADER_DESCRIPTOR(1) header_descriptor;
 	struct uvc_input_terminal_descriptor input_terminal_descriptor;
+	struct uvc_processing_unit_descriptor_uvc_1_1 processing_unit_descriptor;
 	struct uvc_output_terminal_descriptor output_terminal_descriptor;
 } video_control_descriptors = {
 	.header_descriptor = {
@@ -59,7 +107,7 @@ static struct __attribute__((packed)) {
 		.bDescriptorSubType		= UVC_VC_HEADER,
 		.bcdUVC				= 0x0110,
 		.wTotalLength			= sizeof(video_control_descriptors),
-		.dwClockFrequency		= 48000000,
+		.dwClockFrequency		= UVC_CLOCK_FREQUENCY,
 		.bInCollection			= 1,
 		.baInterfaceNr			= {STREAM_INTERFACE},
 	},
@@ -72,6 +120,19 @@ static struct __attribute__((packed)) {
 		.bAssocTerminal			= 0,
 		.iTerminal			= 0,
 	},
+	.processing_unit_descriptor = {
+		.bLength			= UVC_DT_PROCESSING_UNIT_UVC_1_1_SIZE(2),
+		.bDescriptorType		= USB_DT_CS_INTERFACE,
+		.bDescriptorSubType		= UVC_VC_PROCESSING_UNIT,
+		.bUnitID			= PROCESSING_UNIT_ID,
+		.bSourceID			= INPUT_TERMINAL_ID,
+		.wMaxMultiplier			= 0,
+		.bControlSize			= 2,
+		/* Brightness, Contrast, Hue, Saturation */
+		.bmControls			= {0x0F, 0x00},
+		.iProcessing			= 0,
+		.bmVideoStandards		= 0,
+	},
 	.output_terminal_descriptor = {
 		.bLength			= sizeof(video_control_descriptors.output_terminal_descriptor),
 		.bDescriptorType		= USB_DT_CS_INTERFACE,
@@ -79,25 +140,129 @@ static struct __attribute__((packed)) {
 		.bTerminalID			= OUTPUT_TERMINAL_ID,
 		.wTerminalType			= UVC_TT_STREAMING,
 		.bAssocTerminal			= 0,
-		.bSourceID			= INPUT_TERMINAL_ID,
+		.bSourceID			= PROCESSING_UNIT_ID,
 		.iTerminal			= 0,
 	},
 };
 
-DECLARE_UVC_INPUT_HEADER_DESCRIPTOR(1, 1);
+DECLARE_UVC_INPUT_HEADER_DESCRIPTOR(1, 7);
 DECLARE_UVC_FRAME_UNCOMPRESSED(2);
+DECLARE_UVC_FRAME_MJPEG(2);
+DECLARE_UVC_FRAME_FRAME_BASED(2);
+
+#define UVC_FRAME_UNCOMPRESSED_DESC(index, w, h, bpp) \
+	(struct UVC_FRAME_UNCOMPRESSED(2)){ \
+		.bLength			= UVC_DT_FRAME_UNCOMPRESSED_SIZE(2), \
+		.bDescriptorType		= USB_DT_CS_INTERFACE, \
+		.bDescriptorSubType		= UVC_VS_FRAME_UNCOMPRESSED, \
+		.bFrameIndex			= (index), \
+		.bmCapabilities			= 0, \
+		.wWidth				= (w), \
+		.wHeight			= (h), \
+		.dwMinBitRate			= FRAME_BITRATE(w, h, bpp, FPS_TO_INTERVAL(30)), \
+		.dwMaxBitRate			= FRAME_BITRATE(w, h, bpp, FPS_TO_INTERVAL(60)), \
+		.dwMaxVideoFrameBufferSize	= VIDEO_FRAME_SIZE(w, h, bpp), \
+		.dwDefaultFrameInterval		= FPS_TO_INTERVAL(60), \
+		.bFrameIntervalType		= 2, \
+		.dwFrameInterval		= {FPS_TO_INTERVAL(60), FPS_TO_INTERVAL(30)}, \
+	}
+
+/*
+ * Every uncompressed format offers the same sizes: native, half and quarter
+ * size, and 3/4 size through the arbitrary-ratio scaler.
+ */
+#define UVC_FRAMES_UNCOMPRESSED(bpp) { \
+		UVC_FRAME_UNCOMPRESSED_DESC(1, 480, 272, bpp), \
+		UVC_FRAME_UNCOMPRESSED_DESC(2, 240, 136, bpp), \
+		UVC_FRAME_UNCOMPRESSED_DESC(3, 120, 68, bpp), \
+		UVC_FRAME_UNCOMPRESSED_DESC(4, 360, 204, bpp), \
+	}
+
+#define UVC_FORMAT_UNCOMPRESSED_DESC(field, index, guid, bpp) { \
+		.bLength			= sizeof(video_streaming_descriptors.field), \
+		.bDescriptorType		= USB_DT_CS_INTERFACE, \
+		.bDescriptorSubType		= UVC_VS_FORMAT_UNCOMPRESSED, \
+		.bFormatIndex			= (index), \
+		.bNumFrameDescriptors		= 4, \
+		.guidFormat			= guid, \
+		.bBitsPerPixel			= (bpp), \
+		.bDefaultFrameIndex		= 1, \
+		.bAspectRatioX			= 0, \
+		.bAspectRatioY			= 0, \
+		.bmInterfaceFlags		= 0, \
+		.bCopyProtect			= 0, \
+	}
+
+#define UVC_FRAME_MJPEG_DESC(index, w, h) \
+	(struct UVC_FRAME_MJPEG(2)){ \
+		.bLength			= UVC_DT_FRAME_MJPEG_SIZE(2), \
+		.bDescriptorType		= USB_DT_CS_INTERFACE, \
+		.bDescriptorSubType		= UVC_VS_FRAME_MJPEG, \
+		.bFrameIndex			= (index), \
+		.bmCapabilities			= 0, \
+		.wWidth				= (w), \
+		.wHeight			= (h), \
+		.dwMinBitRate			= FRAME_BITRATE(w, h, 1, FPS_TO_INTERVAL(30)), \
+		.dwMaxBitRate			= FRAME_BITRATE(w, h, 16, FPS_TO_INTERVAL(60)), \
+		.dwMaxVideoFrameBufferSize	= VIDEO_FRAME_SIZE_MJPEG(w, h), \
+		.dwDefaultFrameInterval		= FPS_TO_INTERVAL(60), \
+		.bFrameIntervalType		= 2, \
+		.dwFrameInterval		= {FPS_TO_INTERVAL(60), FPS_TO_INTERVAL(30)}, \
+	}
+
+#define UVC_FRAME_H264_DESC(index, w, h) \
+	(struct UVC_FRAME_FRAME_BASED(2)){ \
+		.bLength			= UVC_DT_FRAME_FRAME_BASED_SIZE(2), \
+		.bDescriptorType		= USB_DT_CS_INTERFACE, \
+		.bDescriptorSubType		= UVC_VS_FRAME_FRAME_BASED, \
+		.bFrameIndex			= (index), \
+		.bmCapabilities			= 0, \
+		.wWidth				= (w), \
+		.wHeight			= (h), \
+		.dwMinBitRate			= FRAME_BITRATE(w, h, 1, FPS_TO_INTERVAL(30)), \
+		.dwMaxBitRate			= FRAME_BITRATE(w, h, 16, FPS_TO_INTERVAL(60)), \
+		.dwDefaultFrameInterval		= FPS_TO_INTERVAL(60), \
+		.bFrameIntervalType		= 2, \
+		.dwBytesPerLine			= 0, \
+		.dwFrameInterval		= {FPS_TO_INTERVAL(60), FPS_TO_INTERVAL(30)}, \
+	}
+
+#define UVC_COLOR_MATCHING_DESC(field) { \
+		.bLength			= sizeof(video_streaming_descriptors.field), \
+		.bDescriptorType		= USB_DT_CS_INTERFACE, \
+		.bDescriptorSubType		= UVC_VS_COLORFORMAT, \
+		.bColorPrimaries		= 0, \
+		.bTransferCharacteristics	= 0, \
+		.bMatrixCoefficients		= 0, \
+	}
 
 static struct __attribute__((packed)) {
-	struct UVC_INPUT_HEADER_DESCRIPTOR(1, 1) input_header_descriptor;
+	struct UVC_INPUT_HEADER_DESCRIPTOR(1, 7) input_header_descriptor;
 	struct uvc_format_uncompressed format_uncompressed_yuy2;
-	struct UVC_FRAME_UNCOMPRESSED(2) frames_uncompressed_yuy2[1];
+	struct UVC_FRAME_UNCOMPRESSED(2) frames_uncompressed_yuy2[4];
 	struct uvc_color_matching_descriptor format_uncompressed_yuy2_color_matching;
+	struct uvc_format_uncompressed format_uncompressed_nv12;
+	struct UVC_FRAME_UNCOMPRESSED(2) frames_uncompressed_nv12[4];
+	struct uvc_color_matching_descriptor format_uncompressed_nv12_color_matching;
+	struct uvc_format_uncompressed format_uncompressed_i420;
+	struct UVC_FRAME_UNCOMPRESSED(2) frames_uncompressed_i420[4];
+	struct uvc_color_matching_descriptor format_uncompressed_i420_color_matching;
+	struct uvc_format_uncompressed format_uncompressed_rgbp;
+	struct UVC_FRAME_UNCOMPRESSED(2) frames_uncompressed_rgbp[4];
+	struct uvc_format_uncompressed format_uncompressed_y800;
+	struct UVC_FRAME_UNCOMPRESSED(2) frames_uncompressed_y800[4];
+	struct uvc_format_mjpeg format_mjpeg;
+	struct UVC_FRAME_MJPEG(2) frames_mjpeg[4];
+	struct uvc_color_matching_descriptor format_mjpeg_color_matching;
+	struct uvc_format_frame_based format_h264;
+	struct UVC_FRAME_FRAME_BASED(2) frames_h264[4];
+	struct uvc_color_matching_descriptor format_h264_color_matching;
 } video_streaming_descriptors = {
 	.input_header_descriptor = {
 		.bLength			= sizeof(video_streaming_descriptors.input_header_descriptor),
 		.bDescriptorType		= USB_DT_CS_INTERFACE,
 		.bDescriptorSubType		= UVC_VS_INPUT_HEADER,
-		.bNumFormats			= 1,
+		.bNumFormats			= 7,
 		.wTotalLength			= sizeof(video_streaming_descriptors),
 		.bEndpointAddress		= USB_ENDPOINT_IN | 0x01,
 		.bmInfo				= 0,
@@ -106,49 +271,105 @@ static struct __attribute__((packed)) {
 		.bTriggerSupport		= 0,
 		.bTriggerUsage			= 0,
 		.bControlSize			= 1,
-		.bmaControls			= {{0}, },
+		.bmaControls			= {{0}, {0}, {0}, {0}, {0}, {0}, {0}},
 	},
-	.format_uncompressed_yuy2 = {
-		.bLength			= sizeof(video_streaming_descriptors.format_uncompressed_yuy2),
+	.format_uncompressed_yuy2 = UVC_FORMAT_UNCOMPRESSED_DESC(format_uncompressed_yuy2,
+		FORMAT_INDEX_UNCOMPRESSED_YUY2, UVC_GUID_FORMAT_YUY2, 16),
+	.frames_uncompressed_yuy2 = UVC_FRAMES_UNCOMPRESSED(16),
+	.format_uncompressed_yuy2_color_matching =
+		UVC_COLOR_MATCHING_DESC(format_uncompressed_yuy2_color_matching),
+	.format_uncompressed_nv12 = UVC_FORMAT_UNCOMPRESSED_DESC(format_uncompressed_nv12,
+		FORMAT_INDEX_UNCOMPRESSED_NV12, UVC_GUID_FORMAT_NV12, 12),
+	.frames_uncompressed_nv12 = UVC_FRAMES_UNCOMPRESSED(12),
+	.format_uncompressed_nv12_color_matching =
+		UVC_COLOR_MATCHING_DESC(format_uncompressed_nv12_color_matching),
+	.format_uncompressed_i420 = UVC_FORMAT_UNCOMPRESSED_DESC(format_uncompressed_i420,
+		FORMAT_INDEX_UNCOMPRESSED_I420, UVC_GUID_FORMAT_I420, 12),
+	.frames_uncompressed_i420 = UVC_FRAMES_UNCOMPRESSED(12),
+	.format_uncompressed_i420_color_matching =
+		UVC_COLOR_MATCHING_DESC(format_uncompressed_i420_color_matching),
+	.format_uncompressed_rgbp = UVC_FORMAT_UNCOMPRESSED_DESC(format_uncompressed_rgbp,
+		FORMAT_INDEX_UNCOMPRESSED_RGBP, UVC_GUID_FORMAT_RGBP, 16),
+	.frames_uncompressed_rgbp = UVC_FRAMES_UNCOMPRESSED(16),
+	.format_uncompressed_y800 = UVC_FORMAT_UNCOMPRESSED_DESC(format_uncompressed_y800,
+		FORMAT_INDEX_UNCOMPRESSED_Y800, UVC_GUID_FORMAT_Y800, 8),
+	.frames_uncompressed_y800 = UVC_FRAMES_UNCOMPRESSED(8),
+	.format_mjpeg = {
+		.bLength			= sizeof(video_streaming_descriptors.format_mjpeg),
 		.bDescriptorType		= USB_DT_CS_INTERFACE,
-		.bDescriptorSubType		= UVC_VS_FORMAT_UNCOMPRESSED,
-		.bFormatIndex			= FORMAT_INDEX_UNCOMPRESSED_YUY2,
-		.bNumFrameDescriptors		= 1,
-		.guidFormat			= UVC_GUID_FORMAT_YUY2,
-		.bBitsPerPixel			= 16,
+		.bDescriptorSubType		= UVC_VS_FORMAT_MJPEG,
+		.bFormatIndex			= FORMAT_INDEX_MJPEG,
+		.bNumFrameDescriptors		= 4,
+		.bmFlags			= 0,
 		.bDefaultFrameIndex		= 1,
 		.bAspectRatioX			= 0,
 		.bAspectRatioY			= 0,
 		.bmInterfaceFlags		= 0,
 		.bCopyProtect			= 0,
 	},
-	.frames_uncompressed_yuy2 = {
-		(struct UVC_FRAME_UNCOMPRESSED(2)){
-			.bLength			= UVC_DT_FRAME_UNCOMPRESSED_SIZE(2),
-			.bDescriptorType		= USB_DT_CS_INTERFACE,
-			.bDescriptorSubType		= UVC_VS_FRAME_UNCOMPRESSED,
-			.bFrameIndex			= 4,
-			.bmCapabilities			= 0,
-			.wWidth				= 480,
-			.wHeight			= 272,
-			.dwMinBitRate			= FRAME_BITRATE(480, 272, 12, FPS_TO_INTERVAL(30)),
-			.dwMaxBitRate			= FRAME_BITRATE(480, 272, 12, FPS_TO_INTERVAL(60)),
-			.dwMaxVideoFrameBufferSize	= VIDEO_FRAME_SIZE_YUY2(480, 272),
-			.dwDefaultFrameInterval		= FPS_TO_INTERVAL(60),
-			.bFrameIntervalType		= 2,
-			.dwFrameInterval		= {FPS_TO_INTERVAL(60), FPS_TO_INTERVAL(30)},
-		},
+	.frames_mjpeg = {
+		UVC_FRAME_MJPEG_DESC(1, 480, 272),
+		UVC_FRAME_MJPEG_DESC(2, 240, 136),
+		UVC_FRAME_MJPEG_DESC(3, 120, 68),
+		UVC_FRAME_MJPEG_DESC(4, 360, 204),
 	},
-	.format_uncompressed_yuy2_color_matching = {
-		.bLength			= sizeof(video_streaming_descriptors.format_uncompressed_yuy2_color_matching),
+	.format_mjpeg_color_matching = UVC_COLOR_MATCHING_DESC(format_mjpeg_color_matching),
+	.format_h264 = {
+		.bLength			= sizeof(video_streaming_descriptors.format_h264),
 		.bDescriptorType		= USB_DT_CS_INTERFACE,
-		.bDescriptorSubType		= UVC_VS_COLORFORMAT,
-		.bColorPrimaries		= 0,
-		.bTransferCharacteristics	= 0,
-		.bMatrixCoefficients		= 0,
+		.bDescriptorSubType		= UVC_VS_FORMAT_FRAME_BASED,
+		.bFormatIndex			= FORMAT_INDEX_H264,
+		.bNumFrameDescriptors		= 4,
+		.guidFormat			= UVC_GUID_FORMAT_H264,
+		.bBitsPerPixel			= 16,
+		.bDefaultFrameIndex		= 1,
+		.bAspectRatioX			= 0,
+		.bAspectRatioY			= 0,
+		.bmInterfaceFlags		= 0,
+		.bCopyProtect			= 0,
+		.bVariableSize			= 1,
+	},
+	.frames_h264 = {
+		UVC_FRAME_H264_DESC(1, 480, 272),
+		UVC_FRAME_H264_DESC(2, 240, 136),
+		UVC_FRAME_H264_DESC(3, 120, 68),
+		UVC_FRAME_H264_DESC(4, 360, 204),
 	},
+	.format_h264_color_matching = UVC_COLOR_MATCHING_DESC(format_h264_color_matching),
 };
 
+#define ISOC_ENDPOINT_DESC(max_packet) \
+	{ \
+		USB_DT_ENDPOINT_SIZE, \
+		USB_DT_ENDPOINT, \
+		USB_ENDPOINT_IN | 0x01,		/* bEndpointAddress */ \
+		USB_ENDPOINT_TYPE_ISOCHRONOUS | \
+		USB_ENDPOINT_SYNC_ASYNC,	/* bmAttributes */ \
+		max_packet,			/* wMaxPacketSize */ \
+		0x01				/* bInterval */ \
+	}
+
+/*
+ * The endpoint tables list the tiers largest first, as the first entry is
+ * the one the configuration hands the bus driver, so setting alt uses the
+ * entry ISOC_ALT_SETTINGS - alt.
+ */
+#define STREAM_ISOC_INTERFACE_DESC(alt, endpdesc) \
+	{ \
+		USB_DT_INTERFACE_SIZE, \
+		USB_DT_INTERFACE, \
+		STREAM_INTERFACE,		/* bInterfaceNumber */ \
+		alt,				/* bAlternateSetting */ \
+		1,				/* bNumEndpoints */ \
+		USB_CLASS_VIDEO,		/* bInterfaceClass */ \
+		UVC_SC_VIDEOSTREAMING,		/* bInterfaceSubClass */ \
+		UVC_PC_PROTOCOL_UNDEFINED,	/* bInterfaceProtocol */ \
+		0,				/* iInterface */ \
+		&endpdesc[ISOC_ALT_SETTINGS - (alt)], \
+		NULL, \
+		0 \
+	}
+
 /* Endpoint blocks */
 static
 struct SceUdcdEndpoint endpoints[2] = {
@@ -202,8 +423,15 @@ struct SceUdcdDeviceDescriptor devdesc_hi = {
 
 /* Hi-Speed endpoint descriptors */
 static
-struct SceUdcdEndpointDescriptor endpdesc_hi[2] = {
+struct SceUdcdEndpointDescriptor endpdesc_hi[STREAM_ENDPOINTS + 1] = {
 	/* Video Streaming endpoints */
+#if ENABLE_ISOC_STREAMING
+	/* One per alternate setting, bytes per microframe (8000 per second) */
+	ISOC_ENDPOINT_DESC(ISOC_PACKET_SIZE(1024, 3)),
+	ISOC_ENDPOINT_DESC(ISOC_PACKET_SIZE(1024, 2)),
+	ISOC_ENDPOINT_DESC(ISOC_PACKET_SIZE(1024, 1)),
+	ISOC_ENDPOINT_DESC(ISOC_PACKET_SIZE(512, 1)),
+#else
 	{
 		USB_DT_ENDPOINT_SIZE,
 		USB_DT_ENDPOINT,
@@ -212,6 +440,7 @@ struct SceUdcdEndpointDescriptor endpdesc_hi[2] = {
 		0x200,				/* wMaxPacketSize */
 		0x00				/* bInterval */
 	},
+#endif
 	{
 		0,
 	}
@@ -219,7 +448,7 @@ struct SceUdcdEndpointDescriptor endpdesc_hi[2] = {
 
 /* Hi-Speed interface descriptor */
 static
-struct SceUdcdInterfaceDescriptor interdesc_hi[4] = {
+struct SceUdcdInterfaceDescriptor interdesc_hi[3 + STREAM_ALT_SETTINGS] = {
 	{	/* Dummy interface just to include the IAD */
 		USB_DT_INTERFACE_SIZE,
 		USB_DT_INTERFACE,
@@ -254,15 +483,30 @@ struct SceUdcdInterfaceDescriptor interdesc_hi[4] = {
 		USB_DT_INTERFACE,
 		STREAM_INTERFACE,		/* bInterfaceNumber */
 		0,				/* bAlternateSetting */
+#if ENABLE_ISOC_STREAMING
+		0,				/* bNumEndpoints */
+#else
 		1,				/* bNumEndpoints */
+#endif
 		USB_CLASS_VIDEO,		/* bInterfaceClass */
 		UVC_SC_VIDEOSTREAMING,		/* bInterfaceSubClass */
 		UVC_PC_PROTOCOL_UNDEFINED,	/* bInterfaceProtocol */
 		0,				/* iInterface */
+#if ENABLE_ISOC_STREAMING
+		NULL,				/* endpoints */
+#else
 		&endpdesc_hi[0],		/* endpoints */
+#endif
 		(void *)&video_streaming_descriptors,
 		sizeof(video_streaming_descriptors)
 	},
+#if ENABLE_ISOC_STREAMING
+	/* Alternate settings 1 and up = streaming, in bandwidth order */
+	STREAM_ISOC_INTERFACE_DESC(1, endpdesc_hi),
+	STREAM_ISOC_INTERFACE_DESC(2, endpdesc_hi),
+	STREAM_ISOC_INTERFACE_DESC(3, endpdesc_hi),
+	STREAM_ISOC_INTERFACE_DESC(4, endpdesc_hi),
+#endif
 	{
 		0
 	}
@@ -273,7 +517,7 @@ static
 struct SceUdcdInterfaceSettings settings_hi[3] = {
 	{&interdesc_hi[0], 0, 1},
 	{&interdesc_hi[1], 0, 1},
-	{&interdesc_hi[2], 0, 1}
+	{&interdesc_hi[2], 0, STREAM_ALT_SETTINGS}
 };
 
 /* Hi-Speed configuration descriptor */
@@ -281,7 +525,8 @@ static
 struct SceUdcdConfigDescriptor confdesc_hi = {
 	USB_DT_CONFIG_SIZE,
 	USB_DT_CONFIG,
-	(USB_DT_CONFIG_SIZE + 3 * USB_DT_INTERFACE_SIZE + 1 * USB_DT_ENDPOINT_SIZE +
+	(USB_DT_CONFIG_SIZE + (2 + STREAM_ALT_SETTINGS) * USB_DT_INTERFACE_SIZE +
+		STREAM_ENDPOINTS * USB_DT_ENDPOINT_SIZE +
 		sizeof(interface_association_descriptor) +
 		sizeof(video_control_descriptors) +
 		sizeof(video_streaming_descriptors)),	/* wTotalLength */
@@ -323,8 +568,15 @@ struct SceUdcdDeviceDescriptor devdesc_full = {
 
 /* Full-Speed endpoint descriptors */
 static
-struct SceUdcdEndpointDescriptor endpdesc_full[2] = {
+struct SceUdcdEndpointDescriptor endpdesc_full[STREAM_ENDPOINTS + 1] = {
 	/* Video Streaming endpoints */
+#if ENABLE_ISOC_STREAMING
+	/* One per alternate setting, bytes per frame (1000 per second) */
+	ISOC_ENDPOINT_DESC(1023),
+	ISOC_ENDPOINT_DESC(512),
+	ISOC_ENDPOINT_DESC(256),
+	ISOC_ENDPOINT_DESC(128),
+#else
 	{
 		USB_DT_ENDPOINT_SIZE,
 		USB_DT_ENDPOINT,
@@ -333,6 +585,7 @@ struct SceUdcdEndpointDescriptor endpdesc_full[2] = {
 		0x40,				/* wMaxPacketSize */
 		0x00				/* bInterval */
 	},
+#endif
 	{
 		0,
 	}
@@ -340,7 +593,7 @@ struct SceUdcdEndpointDescriptor endpdesc_full[2] = {
 
 /* Full-Speed interface descriptor */
 static
-struct SceUdcdInterfaceDescriptor interdesc_full[4] = {
+struct SceUdcdInterfaceDescriptor interdesc_full[3 + STREAM_ALT_SETTINGS] = {
 	{	/* Dummy interface just to include the IAD */
 		USB_DT_INTERFACE_SIZE,
 		USB_DT_INTERFACE,
@@ -375,15 +628,30 @@ struct SceUdcdInterfaceDescriptor interdesc_full[4] = {
 		USB_DT_INTERFACE,
 		STREAM_INTERFACE,		/* bInterfaceNumber */
 		0,				/* bAlternateSetting */
+#if ENABLE_ISOC_STREAMING
+		0,				/* bNumEndpoints */
+#else
 		1,				/* bNumEndpoints */
+#endif
 		USB_CLASS_VIDEO,		/* bInterfaceClass */
 		UVC_SC_VIDEOSTREAMING,		/* bInterfaceSubClass */
 		UVC_PC_PROTOCOL_UNDEFINED,	/* bInterfaceProtocol */
 		0,				/* iInterface */
+#if ENABLE_ISOC_STREAMING
+		NULL,				/* endpoints */
+#else
 		&endpdesc_full[0],		/* endpoints */
+#endif
 		(void *)&video_streaming_descriptors,
 		sizeof(video_streaming_descriptors)
 	},
+#if ENABLE_ISOC_STREAMING
+	/* Alternate settings 1 and up = streaming, in bandwidth order */
+	STREAM_ISOC_INTERFACE_DESC(1, endpdesc_full),
+	STREAM_ISOC_INTERFACE_DESC(2, endpdesc_full),
+	STREAM_ISOC_INTERFACE_DESC(3, endpdesc_full),
+	STREAM_ISOC_INTERFACE_DESC(4, endpdesc_full),
+#endif
 	{
 		0
 	}
@@ -394,7 +662,7 @@ static
 struct SceUdcdInterfaceSettings settings_full[3] = {
 	{&interdesc_full[0], 0, 1},
 	{&interdesc_full[1], 0, 1},
-	{&interdesc_full[2], 0, 1}
+	{&interdesc_full[2], 0, STREAM_ALT_SETTINGS}
 };
 
 /* Full-Speed configuration descriptor */
@@ -402,7 +670,8 @@ static
 struct SceUdcdConfigDescriptor confdesc_full = {
 	USB_DT_CONFIG_SIZE,
 	USB_DT_CONFIG,
-	(USB_DT_CONFIG_SIZE + 3 * USB_DT_INTERFACE_SIZE + 1 * USB_DT_ENDPOINT_SIZE +
+	(USB_DT_CONFIG_SIZE + (2 + STREAM_ALT_SETTINGS) * USB_DT_INTERFACE_SIZE +
+		STREAM_ENDPOINTS * USB_DT_ENDPOINT_SIZE +
 		sizeof(interface_association_descriptor) +
 		sizeof(video_control_descriptors) +
 		sizeof(video_streaming_descriptors)),	/* wTotalLength */
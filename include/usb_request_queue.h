@@ -0,0 +1,86 @@
+#ifndef USB_REQUEST_QUEUE_H
+#define USB_REQUEST_QUEUE_H
+
+#include <pspkernel.h>
+#include "usb.h"
+
+/*
+ * A preallocated pool of requests for one bulk IN endpoint, so several
+ * transfers are queued with the bus driver at once and the next one starts
+ * as soon as the previous one ends, rather than after the sender has seen
+ * the completion. The bus driver chains queued requests through their next
+ * field itself, so each one is handed to sceUsbbdReqSend() on its own.
+ *
+ * Waiting for a request to come back to the pool is done on an event flag
+ * the caller owns, next to its own bits, so that its stop bit ends it.
+ */
+
+#define USB_REQUEST_QUEUE_MAX_DEPTH	32
+
+/* returnCode of a cancelled request */
+#define USB_REQUEST_CANCELLED		(-3)
+/* usb_request_queue_send() was interrupted by the stop bit */
+#define USB_REQUEST_QUEUE_STOPPED	(-1)
+
+/* Called in completion context with the request's return code */
+typedef void (*usb_request_done_fn)(void *arg, int return_code);
+
+struct usb_queued_request {
+	/* First, so the completion callback can find the rest */
+	struct UsbbdDeviceRequest req;
+	struct usb_request_queue *queue;
+	usb_request_done_fn done;
+	void *arg;
+	/* Set while the bus driver has it */
+	int queued;
+};
+
+struct usb_request_queue {
+	struct UsbEndpoint *endpoint;
+	int depth;
+	SceUID evflag;
+	unsigned int free_bit;
+	unsigned int stop_bit;
+	/* Bit i set while requests[i] is in the pool */
+	unsigned int free_mask;
+	int in_flight;
+	/* Bus statistics since the last usb_request_queue_stats() */
+	unsigned int stats_start;
+	unsigned int busy_start;
+	unsigned int busy_us;
+	unsigned int bytes;
+	struct usb_queued_request requests[USB_REQUEST_QUEUE_MAX_DEPTH];
+};
+
+struct usb_request_queue_stats {
+	unsigned int elapsed_us;
+	/* Time with at least one request queued */
+	unsigned int busy_us;
+	/* Bytes the completed requests moved */
+	unsigned int bytes;
+};
+
+/* depth is clamped to 1..USB_REQUEST_QUEUE_MAX_DEPTH */
+void usb_request_queue_init(struct usb_request_queue *queue, struct UsbEndpoint *endpoint,
+			    int depth, SceUID evflag, unsigned int free_bit, unsigned int stop_bit);
+
+/*
+ * Queues size bytes at data, already written back from the data cache,
+ * first waiting for a request to come back if all of them are queued.
+ * Unless this returns an error, done(arg, return code) follows once the
+ * transfer completes or is cancelled.
+ */
+int usb_request_queue_send(struct usb_request_queue *queue, void *data, int size,
+			   usb_request_done_fn done, void *arg);
+
+/*
+ * Stops the endpoint and takes every request back into the pool. Those the
+ * bus driver did not complete while cancelling get done() called with
+ * USB_REQUEST_CANCELLED here, and their late completions are ignored.
+ */
+void usb_request_queue_cancel(struct usb_request_queue *queue);
+
+/* Fills in the bus statistics since the last call and starts over */
+void usb_request_queue_stats(struct usb_request_queue *queue, struct usb_request_queue_stats *stats);
+
+#endif
@@ -449,6 +449,12 @@ struct uvc_color_matching_descriptor {
 
 #define UVC_DT_COLOR_MATCHING_SIZE			6
 
+/* Color matching descriptor values (only those in use) */
+#define UVC_COLOR_PRIMARIES_BT709			0x01
+#define UVC_TRANSFER_BT709				0x01
+#define UVC_MATRIX_BT709				0x01
+#define UVC_MATRIX_SMPTE170M				0x04
+
 /* 4.3.1.1. Video Probe and Commit Controls */
 struct uvc_streaming_control {
 	__u16 bmHint;
@@ -582,6 +588,64 @@ struct UVC_FRAME_MJPEG(n) {				\
 	__u32 dwFrameInterval[n];			\
 } __attribute__((__packed__))
 
+/* Frame Based Payload - 3.1.1. Frame Based Video Format Descriptor */
+struct uvc_format_frame_based {
+	__u8  bLength;
+	__u8  bDescriptorType;
+	__u8  bDescriptorSubType;
+	__u8  bFormatIndex;
+	__u8  bNumFrameDescriptors;
+	__u8  guidFormat[16];
+	__u8  bBitsPerPixel;
+	__u8  bDefaultFrameIndex;
+	__u8  bAspectRatioX;
+	__u8  bAspectRatioY;
+	__u8  bmInterfaceFlags;
+	__u8  bCopyProtect;
+	__u8  bVariableSize;
+} __attribute__((__packed__));
+
+#define UVC_DT_FORMAT_FRAME_BASED_SIZE			28
+
+/* Frame Based Payload - 3.1.2. Frame Based Video Frame Descriptor */
+struct uvc_frame_frame_based {
+	__u8  bLength;
+	__u8  bDescriptorType;
+	__u8  bDescriptorSubType;
+	__u8  bFrameIndex;
+	__u8  bmCapabilities;
+	__u16 wWidth;
+	__u16 wHeight;
+	__u32 dwMinBitRate;
+	__u32 dwMaxBitRate;
+	__u32 dwDefaultFrameInterval;
+	__u8  bFrameIntervalType;
+	__u32 dwBytesPerLine;
+	__u32 dwFrameInterval[];
+} __attribute__((__packed__));
+
+#define UVC_DT_FRAME_FRAME_BASED_SIZE(n)		(26+4*(n))
+
+#define UVC_FRAME_FRAME_BASED(n) \
+	uvc_frame_frame_based_##n
+
+#define DECLARE_UVC_FRAME_FRAME_BASED(n)		\
+struct UVC_FRAME_FRAME_BASED(n) {			\
+	__u8  bLength;					\
+	__u8  bDescriptorType;				\
+	__u8  bDescriptorSubType;			\
+	__u8  bFrameIndex;				\
+	__u8  bmCapabilities;				\
+	__u16 wWidth;					\
+	__u16 wHeight;					\
+	__u32 dwMinBitRate;				\
+	__u32 dwMaxBitRate;				\
+	__u32 dwDefaultFrameInterval;			\
+	__u8  bFrameIntervalType;			\
+	__u32 dwBytesPerLine;				\
+	__u32 dwFrameInterval[n];			\
+} __attribute__((__packed__))
+
 /*
  * Copied from https://github.com/torvalds/linux/blob/master/drivers/media/usb/uvc/uvcvideo.h
  */
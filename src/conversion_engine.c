@@ -0,0 +1,133 @@
+#include <stddef.h>
+#include "conversion_engine.h"
+
+/* Band heights are kept a multiple of this many lines (and of any row pairing) */
+#define BAND_ALIGN	8
+#define MAX_BANDS	(CONVERSION_MAX_LINES / BAND_ALIGN)
+
+struct band_job {
+	const struct conversion_dispatch *dispatch;
+	int src_format;
+	const unsigned char *src;
+	unsigned char *dst;
+	int in_stride;
+	int band_lines;
+	int strip_lines;
+	conversion_flush_fn flush;
+	uint32_t *row_hashes;
+	int reuse_rows;
+	int skipped[MAX_BANDS];
+};
+
+static void inline_run(struct conversion_executor *executor, conversion_job_fn job,
+                       void *arg, int num_jobs)
+{
+	int i;
+
+	for (i = 0; i < num_jobs; i++)
+		job(arg, i);
+}
+
+struct conversion_executor conversion_executor_inline = {
+	.run		= inline_run,
+	.num_workers	= 1,
+	.priv		= NULL,
+};
+
+void conversion_row_cache_reset(struct conversion_row_cache *rows)
+{
+	rows->valid = 0;
+	rows->rows_skipped = 0;
+}
+
+static void convert_band(void *arg, int index)
+{
+	struct band_job *job = arg;
+	int first = index * job->band_lines;
+	int lines = job->band_lines;
+
+	if (first + lines > job->dispatch->height)
+		lines = job->dispatch->height - first;
+	if (lines <= 0)
+		return;
+
+	job->skipped[index] = format_conversion_convert_strips(job->dispatch, job->src_format,
+		job->src, job->dst, job->in_stride, first, lines, job->strip_lines, job->flush,
+		job->row_hashes, job->reuse_rows);
+}
+
+void conversion_engine_convert(struct conversion_executor *executor,
+                               const struct conversion_dispatch *dispatch, int src_format,
+                               const unsigned char *src, unsigned char *dst, int in_stride,
+                               int num_bands, int strip_lines, conversion_flush_fn flush,
+                               struct conversion_row_cache *rows)
+{
+	struct band_job job;
+	int band_lines;
+	int i;
+
+	if (rows && dispatch->height > CONVERSION_MAX_LINES)
+		rows = NULL;
+
+	if (num_bands < 1)
+		num_bands = 1;
+
+	band_lines = (dispatch->height + num_bands - 1) / num_bands;
+	band_lines = (band_lines + BAND_ALIGN - 1) & ~(BAND_ALIGN - 1);
+	if (band_lines * MAX_BANDS < dispatch->height)
+		band_lines = (dispatch->height + MAX_BANDS - 1) / MAX_BANDS;
+	num_bands = (dispatch->height + band_lines - 1) / band_lines;
+
+	job = (struct band_job){
+		.dispatch	= dispatch,
+		.src_format	= src_format,
+		.src		= src,
+		.dst		= dst,
+		.in_stride	= in_stride,
+		.band_lines	= band_lines,
+		.strip_lines	= strip_lines,
+		.flush		= flush,
+		.row_hashes	= rows ? rows->hash : NULL,
+		.reuse_rows	= rows && rows->valid && rows->src_format == src_format,
+	};
+
+	if (num_bands == 1)
+		convert_band(&job, 0);
+	else
+		executor->run(executor, convert_band, &job, num_bands);
+
+	if (rows) {
+		rows->src_format = src_format;
+		rows->valid = 1;
+		rows->rows_skipped = 0;
+		for (i = 0; i < num_bands; i++)
+			rows->rows_skipped += job.skipped[i];
+	}
+}
+
+void conversion_engine_convert_rows(const struct conversion_dispatch *dispatch, int src_format,
+                                    const unsigned char *src, unsigned char *dst, int in_stride,
+                                    int first, int lines, int strip_lines,
+                                    conversion_flush_fn flush, struct conversion_row_cache *rows)
+{
+	int skipped;
+
+	if (rows && dispatch->height > CONVERSION_MAX_LINES)
+		rows = NULL;
+
+	skipped = format_conversion_convert_strips(dispatch, src_format, src, dst, in_stride,
+		first, lines, strip_lines, flush, rows ? rows->hash : NULL,
+		rows && rows->valid && rows->src_format == src_format);
+
+	if (!rows)
+		return;
+
+	if (first == 0)
+		rows->rows_skipped = 0;
+	rows->rows_skipped += skipped;
+
+	if (first + lines >= dispatch->height) {
+		rows->src_format = src_format;
+		rows->valid = 1;
+	}
+}
@@ -7,159 +7,981 @@
 #define RGB2U(R, G, B) CLIP(( ( -38 * (R) -  74 * (G) + 112 * (B) + 128) >> 8) + 128)
 #define RGB2V(R, G, B) CLIP(( ( 112 * (R) -  94 * (G) -  18 * (B) + 128) >> 8) + 128)
 
-void r8g8b8a8_to_yuy2(const unsigned char *rgba, unsigned char *yuy2, int in_stride, int width, int height)
-{
-	int i, j;
-
-	for (i = 0; i < height; i++) {
-		for (j = 0; j < width; j+=2) {
-			const unsigned char *rgbap = &rgba[4 * (j + i * in_stride)];
-			unsigned char *yuy2p = &yuy2[2 * (j + i * width)];
-
-			unsigned char p0_r = rgbap[0 + 0],
-			              p0_g = rgbap[0 + 1],
-			              p0_b = rgbap[0 + 2];
-
-			unsigned char p1_r = rgbap[4 + 0],
-			              p1_g = rgbap[4 + 1],
-			              p1_b = rgbap[4 + 2];
-
-			unsigned char sub_r = AVERAGE(p0_r, p1_r);
-			unsigned char sub_g = AVERAGE(p0_g, p1_g);
-			unsigned char sub_b = AVERAGE(p0_b, p1_b);
-			unsigned char y0 = RGB2Y(p0_r, p0_g, p0_b);
-			unsigned char y1 = RGB2Y(p1_r, p1_g, p1_b);
-			unsigned char u = RGB2U(sub_r, sub_g, sub_b);
-			unsigned char v = RGB2V(sub_r, sub_g, sub_b);
-
-			yuy2p[0] = y0;
-			yuy2p[1] = u;
-			yuy2p[2] = y1;
-			yuy2p[3] = v;
+/*
+ * Lookup tables shared by all the converters, filled in once by
+ * format_conversion_init().
+ *
+ * expand5/expand6/expand4 widen a channel to 8 bits exactly like the
+ * multiply/shift expansion used to.
+ *
+ * y_lut[c][x] holds the contribution of the 8-bit channel value x to
+ * RGB2Y, with the rounding and the +16 offset of limited range folded into
+ * the red table, so the sum of the three entries shifted right by 8 is the
+ * final luma. RGB2Y and friends are BT.601 limited range; the tables may
+ * be built for any of color_matrices instead.
+ *
+ * uv_lut[c][s] holds the contribution of AVERAGE(a, b) to RGB2U (low half)
+ * and RGB2V (high half), indexed by s = a + b. Each half is biased so it
+ * never goes negative and the rounding and +128 offset are folded in, so
+ * bits 8-15 and 24-31 of the sum of the three entries are U and V.
+ * Indexing it with (a + b + c + d + 2) >> 1 gives the rounded average of
+ * four values instead, hence the extra entry past 510.
+ *
+ * Picture controls are folded into both: the channel value goes through
+ * the brightness/contrast curve first, and the U and V coefficients are
+ * those of the hue-rotated, saturation-scaled matrix.
+ */
+static unsigned char expand5[32];
+static unsigned char expand6[64];
+static unsigned char expand4[16];
+static unsigned short y_lut[3][256];
+static unsigned int uv_lut[3][512];
+
+/*
+ * RGB to YCbCr matrices in 8.8 fixed point. Full range ones map 0-255 to
+ * 0-255 for luma and +-128 for chroma, so their chroma needs the limiting
+ * of format_conversion_set_adjust() at the extremes. Chroma rows sum to 0.
+ */
+static const struct color_matrix {
+	int y[3];
+	int y_offset;
+	int u[3];
+	int v[3];
+} color_matrices[CONVERSION_COLOR_COUNT] = {
+	[CONVERSION_COLOR_BT601_LIMITED] = { {  66, 129,  25 }, 16, { -38, -74, 112 }, { 112,  -94, -18 } },
+	[CONVERSION_COLOR_BT601_FULL]    = { {  77, 150,  29 },  0, { -43, -85, 128 }, { 128, -107, -21 } },
+	[CONVERSION_COLOR_BT709_LIMITED] = { {  47, 157,  16 }, 16, { -26, -86, 112 }, { 112, -102, -10 } },
+	[CONVERSION_COLOR_BT709_FULL]    = { {  54, 183,  19 },  0, { -29, -99, 128 }, { 128, -116, -12 } },
+};
+
+/* What the tables are currently built for */
+static const struct color_matrix *matrix = &color_matrices[CONVERSION_COLOR_BT601_LIMITED];
+static struct conversion_adjust adjust = CONVERSION_ADJUST_DEFAULT;
+
+/* sin() of 0 to 90 degrees, 1.14 fixed point */
+static const unsigned short sin_table[91] = {
+	    0,   286,   572,   857,  1143,  1428,  1713,  1997,  2280,  2563,
+	 2845,  3126,  3406,  3686,  3964,  4240,  4516,  4790,  5063,  5334,
+	 5604,  5872,  6138,  6402,  6664,  6924,  7182,  7438,  7692,  7943,
+	 8192,  8438,  8682,  8923,  9162,  9397,  9630,  9860, 10087, 10311,
+	10531, 10749, 10963, 11174, 11381, 11585, 11786, 11982, 12176, 12365,
+	12551, 12733, 12911, 13085, 13255, 13421, 13583, 13741, 13894, 14044,
+	14189, 14330, 14466, 14598, 14726, 14849, 14968, 15082, 15191, 15296,
+	15396, 15491, 15582, 15668, 15749, 15826, 15897, 15964, 16026, 16083,
+	16135, 16182, 16225, 16262, 16294, 16322, 16344, 16362, 16374, 16382,
+	16384,
+};
+
+static int sin_deg(int deg)
+{
+	deg %= 360;
+	if (deg < 0)
+		deg += 360;
+
+	if (deg <= 90)
+		return sin_table[deg];
+	if (deg <= 180)
+		return sin_table[180 - deg];
+	if (deg <= 270)
+		return -sin_table[deg - 180];
+	return -sin_table[360 - deg];
+}
+
+/* Keeps a channel's contribution non-negative; red also carries the offsets */
+static int chroma_bias(const int coef[3], int c)
+{
+	int i, bias = 0;
+
+	if (c == 0) {
+		bias = (128 << 8) + 128;
+		for (i = 0; i < 3; i++) {
+			if (coef[i] < 0)
+				bias += coef[i] * 255;
 		}
 	}
+
+	if (coef[c] < 0)
+		bias -= coef[c] * 255;
+
+	return bias;
 }
 
-void r5g6b5_to_yuy2(const unsigned char *rgb, unsigned char *yuy2, int in_stride, int width, int height)
+/* n / d rounded to nearest, halves away from zero */
+static int div_round(long long n, int d)
 {
-	int i, j;
+	return n < 0 ? -((-n + d / 2) / d) : (n + d / 2) / d;
+}
+
+static int magnitude(int x)
+{
+	return x < 0 ? -x : x;
+}
+
+/*
+ * Rotates the chroma rows by hue and scales them by saturation. The rows
+ * sum to 0 like the originals, so grey stays grey after rounding.
+ */
+static void adjust_chroma(int u[3], int v[3])
+{
+	int s = sin_deg(adjust.hue);
+	int c = sin_deg(adjust.hue + 90);
+	int i, su = 0, sv = 0, big = 0;
+
+	for (i = 0; i < 3; i++) {
+		u[i] = div_round((long long)(matrix->u[i] * c - matrix->v[i] * s) * adjust.saturation,
+				 16384 * 100);
+		v[i] = div_round((long long)(matrix->u[i] * s + matrix->v[i] * c) * adjust.saturation,
+				 16384 * 100);
+		su += u[i];
+		sv += v[i];
+	}
+
+	/* Rounding errors go to the largest coefficient */
+	for (i = 1; i < 3; i++) {
+		if (magnitude(u[i]) + magnitude(v[i]) > magnitude(u[big]) + magnitude(v[big]))
+			big = i;
+	}
+	u[big] -= su;
+	v[big] -= sv;
+}
+
+/* Largest sum of positive coefficients whose chroma still fits in 8 bits */
+#define CHROMA_GAIN_MAX		127
+
+static int chroma_gain(const int coef[3])
+{
+	int i, gain = 0;
+
+	for (i = 0; i < 3; i++) {
+		if (coef[i] > 0)
+			gain += coef[i];
+	}
 
-	for (i = 0; i < height; i++) {
-		for (j = 0; j < width; j+=2) {
-			const unsigned short *rgbp = (unsigned short *)&rgb[2 * (j + i * in_stride)];
-			unsigned char *yuy2p = &yuy2[2 * (j + i * width)];
+	return gain;
+}
 
-			unsigned short p0 = rgbp[0];
-			unsigned short p1 = rgbp[1];
+static void build_tables(void)
+{
+	unsigned char curve[256];
+	int u[3], v[3];
+	int c, i, x, gain, limit;
 
-			unsigned char p0_r = p0 & 0x1F,
-			              p0_g = (p0 >> 5) & 0x3F,
-			              p0_b = (p0 >> 11) & 0x1F;
+	for (i = 0; i < 256; i++) {
+		x = 128 + (i - 128) * adjust.contrast / 100 + adjust.brightness;
+		curve[i] = CLIP(x);
+	}
 
-			unsigned char p1_r = p1 & 0x1F,
-			              p1_g = (p1 >> 5) & 0x3F,
-			              p1_b = (p1 >> 11) & 0x1F;
+	adjust_chroma(u, v);
 
-			p0_r = (p0_r * 527 + 23) >> 6;
-			p0_g = (p0_g * 259 + 33) >> 6;
-			p0_b = (p0_b * 527 + 23) >> 6;
+	/*
+	 * The tables can't clip a sum, so for gains that would push the
+	 * most saturated colours out of range the channels feeding chroma
+	 * are limited around mid-grey instead.
+	 */
+	gain = chroma_gain(u) > chroma_gain(v) ? chroma_gain(u) : chroma_gain(v);
+	limit = gain > CHROMA_GAIN_MAX ? (CHROMA_GAIN_MAX * 128) / gain : 128;
 
-			p1_r = (p1_r * 527 + 23) >> 6;
-			p1_g = (p1_g * 259 + 33) >> 6;
-			p1_b = (p1_b * 527 + 23) >> 6;
+	for (c = 0; c < 3; c++) {
+		for (i = 0; i < 256; i++)
+			y_lut[c][i] = matrix->y[c] * curve[i] + (c == 0 ? 128 + (matrix->y_offset << 8) : 0);
 
-			unsigned char sub_r = AVERAGE(p0_r, p1_r);
-			unsigned char sub_g = AVERAGE(p0_g, p1_g);
-			unsigned char sub_b = AVERAGE(p0_b, p1_b);
-			unsigned char y0 = RGB2Y(p0_r, p0_g, p0_b);
-			unsigned char y1 = RGB2Y(p1_r, p1_g, p1_b);
-			unsigned char u = RGB2U(sub_r, sub_g, sub_b);
-			unsigned char v = RGB2V(sub_r, sub_g, sub_b);
+		for (i = 0; i < 512; i++) {
+			x = curve[i >> 1] - 128;
+			x = 128 + (x < -limit ? -limit : (x > limit ? limit : x));
 
-			yuy2p[0] = y0;
-			yuy2p[1] = u;
-			yuy2p[2] = y1;
-			yuy2p[3] = v;
+			/* Halves may wrap with large gains; their sums come out in range */
+			uv_lut[c][i] = (unsigned int)(u[c] * x + chroma_bias(u, c)) +
+				       ((unsigned int)(v[c] * x + chroma_bias(v, c)) << 16);
 		}
 	}
 }
 
-void r5g5b5a1_to_yuy2(const unsigned char *rgba, unsigned char *yuy2, int in_stride, int width, int height)
+void format_conversion_set_adjust(const struct conversion_adjust *new_adjust)
+{
+	adjust = *new_adjust;
+	build_tables();
+}
+
+void format_conversion_set_color(int color)
+{
+	if (matrix == &color_matrices[color])
+		return;
+
+	matrix = &color_matrices[color];
+	build_tables();
+}
+
+void format_conversion_init(void)
+{
+	int i;
+
+	for (i = 0; i < 32; i++)
+		expand5[i] = (i * 527 + 23) >> 6;
+	for (i = 0; i < 64; i++)
+		expand6[i] = (i * 259 + 33) >> 6;
+	for (i = 0; i < 16; i++)
+		expand4[i] = i << 4;
+
+	build_tables();
+}
+
+/* Packs two pixels into one YUYV macropixel as laid out in memory */
+static inline uint32_t lut_pair_to_yuyv(unsigned int r0, unsigned int g0, unsigned int b0,
+                                        unsigned int r1, unsigned int g1, unsigned int b1)
+{
+	uint32_t uv = uv_lut[0][r0 + r1] + uv_lut[1][g0 + g1] + uv_lut[2][b0 + b1];
+	uint32_t y0 = (y_lut[0][r0] + y_lut[1][g0] + y_lut[2][b0]) >> 8;
+	uint32_t y1 = (y_lut[0][r1] + y_lut[1][g1] + y_lut[2][b1]) >> 8;
+
+	return y0 | (uv & 0x0000FF00) | (y1 << 16) | (uv & 0xFF000000);
+}
+
+static inline unsigned int lut_y(unsigned int r, unsigned int g, unsigned int b)
+{
+	return (y_lut[0][r] + y_lut[1][g] + y_lut[2][b]) >> 8;
+}
+
+/* U in bits 8-15 and V in bits 24-31 for the average of a 2x2 block */
+static inline uint32_t lut_uv4(unsigned int rs, unsigned int gs, unsigned int bs)
+{
+	return uv_lut[0][(rs + 2) >> 1] + uv_lut[1][(gs + 2) >> 1] + uv_lut[2][(bs + 2) >> 1];
+}
+
+/*
+ * The LCDC keeps red in the low bits of a 565 pixel, the RGBP format (like
+ * every other RGB565 consumer) blue, so both pixels of a pair get their
+ * outer fields swapped. Green stays put.
+ *
+ * This is why RGBP frames are always copied rather than sent straight from
+ * the framebuffer: no 565 framebuffer is in the order RGBP wants, and its
+ * 512-pixel stride leaves gaps between the 480-pixel rows of a frame.
+ */
+static inline uint32_t swap_rb565_pair(uint32_t p)
+{
+	return ((p & 0x001F001F) << 11) | ((p >> 11) & 0x001F001F) | (p & 0x07E007E0);
+}
+
+/* Truncates two 8-bit RGB pixels to a pair of blue-low RGB565 words */
+static inline uint32_t pack_rgb565_pair(unsigned int r0, unsigned int g0, unsigned int b0,
+                                        unsigned int r1, unsigned int g1, unsigned int b1)
+{
+	uint32_t p0 = ((r0 >> 3) << 11) | ((g0 >> 2) << 5) | (b0 >> 3);
+	uint32_t p1 = ((r1 >> 3) << 11) | ((g1 >> 2) << 5) | (b1 >> 3);
+
+	return p0 | (p1 << 16);
+}
+
+/* Widens one source pixel to 8-bit R, G and B */
+static inline __attribute__((always_inline))
+void unpack_pixel(int src_format, uint32_t p, unsigned int *r, unsigned int *g, unsigned int *b)
+{
+	switch (src_format) {
+	case CONVERSION_SRC_RGB565:
+		*r = expand5[p & 0x1F];
+		*g = expand6[(p >> 5) & 0x3F];
+		*b = expand5[(p >> 11) & 0x1F];
+		break;
+	case CONVERSION_SRC_RGBA5551:
+		*r = expand5[p & 0x1F];
+		*g = expand5[(p >> 5) & 0x1F];
+		*b = expand5[(p >> 10) & 0x1F];
+		break;
+	case CONVERSION_SRC_RGBA4444:
+		*r = expand4[p & 0xF];
+		*g = expand4[(p >> 4) & 0xF];
+		*b = expand4[(p >> 8) & 0xF];
+		break;
+	case CONVERSION_SRC_RGBA8888:
+		*r = p & 0xFF;
+		*g = (p >> 8) & 0xFF;
+		*b = (p >> 16) & 0xFF;
+		break;
+	}
+}
+
+static inline __attribute__((always_inline))
+uint32_t load_pixel(int src_format, const unsigned char *row, int x)
 {
-	int i, j;
+	if (src_format == CONVERSION_SRC_RGBA8888)
+		return ((const uint32_t *)row)[x];
+	else
+		return ((const uint16_t *)row)[x];
+}
 
-	for (i = 0; i < height; i++) {
-		for (j = 0; j < width; j+=2) {
-			const unsigned short *rgbap = (unsigned short *)&rgba[2 * (j + i * in_stride)];
-			unsigned char *yuy2p = &yuy2[2 * (j + i * width)];
+static inline int src_bytes_per_pixel(int src_format)
+{
+	return src_format == CONVERSION_SRC_RGBA8888 ? 4 : 2;
+}
+
+static inline int dst_is_planar(int dst_format)
+{
+	return dst_format == CONVERSION_DST_NV12 || dst_format == CONVERSION_DST_I420;
+}
 
-			unsigned short p0 = rgbap[0];
-			unsigned short p1 = rgbap[1];
+/* Bytes in one row of the first (packed or luma) plane */
+static inline int dst_row_bytes(int dst_format, int width)
+{
+	switch (dst_format) {
+	case CONVERSION_DST_NV12:
+	case CONVERSION_DST_I420:
+	case CONVERSION_DST_Y800:
+		return width;
+	case CONVERSION_DST_YUY2:
+	case CONVERSION_DST_RGB565:
+	default:
+		return width * 2;
+	}
+}
 
-			unsigned char p0_r = p0 & 0x1F,
-			              p0_g = (p0 >> 5) & 0x1F,
-			              p0_b = (p0 >> 10) & 0x1F;
+/* Stores the converted pixel pair starting at column x of output row y */
+static inline __attribute__((always_inline))
+void store_pair(int dst_format, unsigned char *dst, int width, int y, int x,
+                unsigned int r0, unsigned int g0, unsigned int b0,
+                unsigned int r1, unsigned int g1, unsigned int b1)
+{
+	switch (dst_format) {
+	case CONVERSION_DST_YUY2:
+		((uint32_t *)(dst + y * dst_row_bytes(dst_format, width)))[x / 2] =
+			lut_pair_to_yuyv(r0, g0, b0, r1, g1, b1);
+		break;
+	case CONVERSION_DST_RGB565:
+		((uint32_t *)(dst + y * dst_row_bytes(dst_format, width)))[x / 2] =
+			pack_rgb565_pair(r0, g0, b0, r1, g1, b1);
+		break;
+	case CONVERSION_DST_Y800:
+		((uint16_t *)(dst + y * dst_row_bytes(dst_format, width)))[x / 2] =
+			lut_y(r0, g0, b0) | (lut_y(r1, g1, b1) << 8);
+		break;
+	}
+}
 
-			unsigned char p1_r = p1 & 0x1F,
-			              p1_g = (p1 >> 5) & 0x1F,
-			              p1_b = (p1 >> 10) & 0x1F;
+/* Converts the source pixel pair starting at column x into output row y */
+static inline __attribute__((always_inline))
+void convert_pair(int src_format, int dst_format, const unsigned char *srow,
+                  unsigned char *dst, int width, int y, int x)
+{
+	unsigned int r0, g0, b0, r1, g1, b1;
+	uint32_t p0, p1;
+
+	/* Same bit depth: only the channel order changes, no colour math */
+	if (src_format == CONVERSION_SRC_RGB565 && dst_format == CONVERSION_DST_RGB565) {
+		((uint32_t *)(dst + y * dst_row_bytes(dst_format, width)))[x / 2] =
+			swap_rb565_pair(((const uint32_t *)srow)[x / 2]);
+		return;
+	}
 
-			p0_r = (p0_r * 527 + 23) >> 6;
-			p0_g = (p0_g * 527 + 23) >> 6;
-			p0_b = (p0_b * 527 + 23) >> 6;
+	if (src_format == CONVERSION_SRC_RGBA8888) {
+		p0 = ((const uint32_t *)srow)[x];
+		p1 = ((const uint32_t *)srow)[x + 1];
+	} else {
+		uint32_t p = ((const uint32_t *)srow)[x / 2];
+		p0 = p & 0xFFFF;
+		p1 = p >> 16;
+	}
 
-			p1_r = (p1_r * 527 + 23) >> 6;
-			p1_g = (p1_g * 527 + 23) >> 6;
-			p1_b = (p1_b * 527 + 23) >> 6;
+	unpack_pixel(src_format, p0, &r0, &g0, &b0);
+	unpack_pixel(src_format, p1, &r1, &g1, &b1);
 
-			unsigned char sub_r = AVERAGE(p0_r, p1_r);
-			unsigned char sub_g = AVERAGE(p0_g, p1_g);
-			unsigned char sub_b = AVERAGE(p0_b, p1_b);
-			unsigned char y0 = RGB2Y(p0_r, p0_g, p0_b);
-			unsigned char y1 = RGB2Y(p1_r, p1_g, p1_b);
-			unsigned char u = RGB2U(sub_r, sub_g, sub_b);
-			unsigned char v = RGB2V(sub_r, sub_g, sub_b);
+	store_pair(dst_format, dst, width, y, x, r0, g0, b0, r1, g1, b1);
+}
 
-			yuy2p[0] = y0;
-			yuy2p[1] = u;
-			yuy2p[2] = y1;
-			yuy2p[3] = v;
+/* Averages the scale x scale block of source pixels behind output column x */
+static inline __attribute__((always_inline))
+void box_pixel(int src_format, int scale, const unsigned char *srow, int src_pitch, int x,
+               unsigned int *r, unsigned int *g, unsigned int *b)
+{
+	unsigned int sr = 0, sg = 0, sb = 0;
+	unsigned int pr, pg, pb;
+	int dx, dy;
+
+	for (dy = 0; dy < scale; dy++) {
+		for (dx = 0; dx < scale; dx++) {
+			unpack_pixel(src_format, load_pixel(src_format, srow + dy * src_pitch, x * scale + dx),
+				     &pr, &pg, &pb);
+			sr += pr;
+			sg += pg;
+			sb += pb;
 		}
 	}
+
+	*r = (sr + scale * scale / 2) / (scale * scale);
+	*g = (sg + scale * scale / 2) / (scale * scale);
+	*b = (sb + scale * scale / 2) / (scale * scale);
 }
 
-void r4g4b4a4_to_yuy2(const unsigned char *rgba, unsigned char *yuy2, int in_stride, int width, int height)
+/* Averages the 2x2 source pixels at (sx, sy), clamped to the source frame */
+static inline __attribute__((always_inline))
+void sample_pixel(int src_format, const unsigned char *src, int src_pitch, int sx, int sy,
+                  unsigned int *r, unsigned int *g, unsigned int *b)
 {
-	int i, j;
+	const unsigned char *row0 = src + sy * src_pitch;
+	const unsigned char *row1 = sy + 1 < CONVERSION_SRC_HEIGHT ? row0 + src_pitch : row0;
+	int sx1 = sx + 1 < CONVERSION_SRC_WIDTH ? sx + 1 : sx;
+	unsigned int r0, g0, b0, r1, g1, b1, r2, g2, b2, r3, g3, b3;
+
+	unpack_pixel(src_format, load_pixel(src_format, row0, sx), &r0, &g0, &b0);
+	unpack_pixel(src_format, load_pixel(src_format, row0, sx1), &r1, &g1, &b1);
+	unpack_pixel(src_format, load_pixel(src_format, row1, sx), &r2, &g2, &b2);
+	unpack_pixel(src_format, load_pixel(src_format, row1, sx1), &r3, &g3, &b3);
+
+	*r = (r0 + r1 + r2 + r3 + 2) >> 2;
+	*g = (g0 + g1 + g2 + g3 + 2) >> 2;
+	*b = (b0 + b1 + b2 + b3 + 2) >> 2;
+}
 
-	for (i = 0; i < height; i++) {
-		for (j = 0; j < width; j+=2) {
-			const unsigned short *rgbap = (unsigned short *)&rgba[2 * (j + i * in_stride)];
-			unsigned char *yuy2p = &yuy2[2 * (j + i * width)];
+/* 16.16 fixed-point step through the source for an output dimension */
+static inline int scale_step(int src_size, int dst_size)
+{
+	return (src_size << 16) / dst_size;
+}
 
-			unsigned short p0 = rgbap[0];
-			unsigned short p1 = rgbap[1];
+/* The filtered source colour behind output pixel (x, y), for any scale */
+static inline __attribute__((always_inline))
+void fetch_pixel(int src_format, int scale, const unsigned char *src, int src_pitch,
+                 int x_step, int y_step, int x, int y,
+                 unsigned int *r, unsigned int *g, unsigned int *b)
+{
+	if (scale == 1)
+		unpack_pixel(src_format, load_pixel(src_format, src + y * src_pitch, x), r, g, b);
+	else if (scale > 1)
+		box_pixel(src_format, scale, src + y * scale * src_pitch, src_pitch, x, r, g, b);
+	else
+		sample_pixel(src_format, src, src_pitch, (x * x_step) >> 16, (y * y_step) >> 16,
+			     r, g, b);
+}
 
-			unsigned char p0_r = (p0 & 0xF) << 4,
-			              p0_g = ((p0 >> 4) & 0xF) << 4,
-			              p0_b = ((p0 >> 8) & 0xF) << 4;
+/*
+ * 4:2:0 kernel: converts output row pairs [first, first + lines), first
+ * and lines both even. Each 2x2 block yields four luma samples and one
+ * chroma pair averaged over all four pixels, written to the luma plane
+ * and to the interleaved (NV12) or separate (I420) chroma planes.
+ */
+static inline __attribute__((always_inline))
+void convert_rows_420(int src_format, int dst_format, int scale, const unsigned char *src,
+                      unsigned char *dst, int in_stride, int width, int height, int first, int lines)
+{
+	int src_pitch = in_stride * src_bytes_per_pixel(src_format);
+	int x_step = scale == 0 ? scale_step(CONVERSION_SRC_WIDTH, width) : 0;
+	int y_step = scale == 0 ? scale_step(CONVERSION_SRC_HEIGHT, height) : 0;
+	unsigned char *chroma = dst + width * height;
+	unsigned int r0, g0, b0, r1, g1, b1, r2, g2, b2, r3, g3, b3;
+	uint32_t uv;
+	int x, y;
+
+	for (y = first; y < first + lines; y += 2) {
+		unsigned char *y0row = dst + y * width;
+		unsigned char *y1row = y0row + width;
+
+		for (x = 0; x < width; x += 2) {
+			fetch_pixel(src_format, scale, src, src_pitch, x_step, y_step, x, y,
+				    &r0, &g0, &b0);
+			fetch_pixel(src_format, scale, src, src_pitch, x_step, y_step, x + 1, y,
+				    &r1, &g1, &b1);
+			fetch_pixel(src_format, scale, src, src_pitch, x_step, y_step, x, y + 1,
+				    &r2, &g2, &b2);
+			fetch_pixel(src_format, scale, src, src_pitch, x_step, y_step, x + 1, y + 1,
+				    &r3, &g3, &b3);
+
+			y0row[x] = lut_y(r0, g0, b0);
+			y0row[x + 1] = lut_y(r1, g1, b1);
+			y1row[x] = lut_y(r2, g2, b2);
+			y1row[x + 1] = lut_y(r3, g3, b3);
+
+			uv = lut_uv4(r0 + r1 + r2 + r3, g0 + g1 + g2 + g3, b0 + b1 + b2 + b3);
+
+			if (dst_format == CONVERSION_DST_NV12) {
+				unsigned char *c = chroma + (y / 2) * width + x;
+
+				c[0] = uv >> 8;
+				c[1] = uv >> 24;
+			} else {
+				int offset = (y / 2) * (width / 2) + x / 2;
+
+				chroma[offset] = uv >> 8;
+				chroma[(width / 2) * (height / 2) + offset] = uv >> 24;
+			}
+		}
+	}
+}
 
-			unsigned char p1_r = (p1 & 0xF) << 4,
-			              p1_g = ((p1 >> 4) & 0xF) << 4,
-			              p1_b = ((p1 >> 8) & 0xF) << 4;
+/*
+ * Generic kernel: converts output rows [first, first + lines) of a frame.
+ * src and dst always point at the start of the frame.
+ *
+ * 4:2:0 layouts are handed to convert_rows_420(), which needs first and
+ * lines to be even.
+ *
+ * scale is 1 for a 1:1 copy, 2 or 4 for box-filtered downscaling from the
+ * 480x272 source, or 0 for an arbitrary ratio, where every output pixel
+ * averages the 2x2 source pixels at its fixed-point source position.
+ *
+ * Every argument other than the buffers is expected to be a compile-time
+ * constant or to come straight from the caller, so each instantiation
+ * below collapses to a straight-line loop for its layout.
+ */
+static inline __attribute__((always_inline))
+void convert_rows(int src_format, int dst_format, int scale, const unsigned char *src,
+                  unsigned char *dst, int in_stride, int width, int height, int first, int lines)
+{
+	int src_pitch = in_stride * src_bytes_per_pixel(src_format);
+	int x_step = scale == 0 ? scale_step(CONVERSION_SRC_WIDTH, width) : 0;
+	int y_step = scale == 0 ? scale_step(CONVERSION_SRC_HEIGHT, height) : 0;
+	unsigned int r0, g0, b0, r1, g1, b1;
+	int x, y;
+
+	if (dst_is_planar(dst_format)) {
+		convert_rows_420(src_format, dst_format, scale, src, dst, in_stride, width, height,
+				 first, lines);
+		return;
+	}
 
-			unsigned char sub_r = AVERAGE(p0_r, p1_r);
-			unsigned char sub_g = AVERAGE(p0_g, p1_g);
-			unsigned char sub_b = AVERAGE(p0_b, p1_b);
-			unsigned char y0 = RGB2Y(p0_r, p0_g, p0_b);
-			unsigned char y1 = RGB2Y(p1_r, p1_g, p1_b);
-			unsigned char u = RGB2U(sub_r, sub_g, sub_b);
-			unsigned char v = RGB2V(sub_r, sub_g, sub_b);
+	for (y = first; y < first + lines; y++) {
+		if (scale == 1) {
+			const unsigned char *srow = src + y * src_pitch;
+
+			for (x = 0; x + 8 <= width; x += 8) {
+				convert_pair(src_format, dst_format, srow, dst, width, y, x + 0);
+				convert_pair(src_format, dst_format, srow, dst, width, y, x + 2);
+				convert_pair(src_format, dst_format, srow, dst, width, y, x + 4);
+				convert_pair(src_format, dst_format, srow, dst, width, y, x + 6);
+			}
+			for (; x < width; x += 2)
+				convert_pair(src_format, dst_format, srow, dst, width, y, x);
+		} else if (scale > 1) {
+			const unsigned char *srow = src + y * scale * src_pitch;
+
+			for (x = 0; x < width; x += 2) {
+				box_pixel(src_format, scale, srow, src_pitch, x, &r0, &g0, &b0);
+				box_pixel(src_format, scale, srow, src_pitch, x + 1, &r1, &g1, &b1);
+				store_pair(dst_format, dst, width, y, x, r0, g0, b0, r1, g1, b1);
+			}
+		} else {
+			int sy = (y * y_step) >> 16;
+
+			for (x = 0; x < width; x += 2) {
+				sample_pixel(src_format, src, src_pitch, (x * x_step) >> 16, sy,
+					     &r0, &g0, &b0);
+				sample_pixel(src_format, src, src_pitch, ((x + 1) * x_step) >> 16, sy,
+					     &r1, &g1, &b1);
+				store_pair(dst_format, dst, width, y, x, r0, g0, b0, r1, g1, b1);
+			}
+		}
+	}
+}
 
-			yuy2p[0] = y0;
-			yuy2p[1] = u;
-			yuy2p[2] = y1;
-			yuy2p[3] = v;
+/*
+ * Emits, for one source/destination pair:
+ *  - <src>_to_<dst>: whole-frame 1:1 converter of any size
+ *  - row converters for the native 480x272 size, half and quarter size and
+ *    arbitrary ratios, used through the dispatch table.
+ */
+#define DEFINE_CONVERTERS(src, SRC, dst, DST) \
+	void src##_to_##dst(const unsigned char *in, unsigned char *out, int in_stride, int width, int height) \
+	{ \
+		convert_rows(CONVERSION_SRC_##SRC, CONVERSION_DST_##DST, 1, in, out, in_stride, width, height, 0, height); \
+	} \
+	static void src##_to_##dst##_w480(const unsigned char *in, unsigned char *out, int in_stride, \
+					 int width, int height, int first, int lines) \
+	{ \
+		convert_rows(CONVERSION_SRC_##SRC, CONVERSION_DST_##DST, 1, in, out, in_stride, 480, height, first, lines); \
+	} \
+	static void src##_to_##dst##_half(const unsigned char *in, unsigned char *out, int in_stride, \
+					 int width, int height, int first, int lines) \
+	{ \
+		convert_rows(CONVERSION_SRC_##SRC, CONVERSION_DST_##DST, 2, in, out, in_stride, 240, 136, first, lines); \
+	} \
+	static void src##_to_##dst##_quarter(const unsigned char *in, unsigned char *out, int in_stride, \
+					    int width, int height, int first, int lines) \
+	{ \
+		convert_rows(CONVERSION_SRC_##SRC, CONVERSION_DST_##DST, 4, in, out, in_stride, 120, 68, first, lines); \
+	} \
+	static void src##_to_##dst##_scaled(const unsigned char *in, unsigned char *out, int in_stride, \
+					   int width, int height, int first, int lines) \
+	{ \
+		convert_rows(CONVERSION_SRC_##SRC, CONVERSION_DST_##DST, 0, in, out, in_stride, width, height, first, lines); \
+	}
+
+DEFINE_CONVERTERS(r5g6b5,   RGB565,   yuy2, YUY2)
+DEFINE_CONVERTERS(r5g5b5a1, RGBA5551, yuy2, YUY2)
+DEFINE_CONVERTERS(r4g4b4a4, RGBA4444, yuy2, YUY2)
+DEFINE_CONVERTERS(r8g8b8a8, RGBA8888, yuy2, YUY2)
+
+DEFINE_CONVERTERS(r5g6b5,   RGB565,   nv12, NV12)
+DEFINE_CONVERTERS(r5g5b5a1, RGBA5551, nv12, NV12)
+DEFINE_CONVERTERS(r4g4b4a4, RGBA4444, nv12, NV12)
+DEFINE_CONVERTERS(r8g8b8a8, RGBA8888, nv12, NV12)
+
+DEFINE_CONVERTERS(r5g6b5,   RGB565,   i420, I420)
+DEFINE_CONVERTERS(r5g5b5a1, RGBA5551, i420, I420)
+DEFINE_CONVERTERS(r4g4b4a4, RGBA4444, i420, I420)
+DEFINE_CONVERTERS(r8g8b8a8, RGBA8888, i420, I420)
+
+DEFINE_CONVERTERS(r5g6b5,   RGB565,   rgb565, RGB565)
+DEFINE_CONVERTERS(r5g5b5a1, RGBA5551, rgb565, RGB565)
+DEFINE_CONVERTERS(r4g4b4a4, RGBA4444, rgb565, RGB565)
+DEFINE_CONVERTERS(r8g8b8a8, RGBA8888, rgb565, RGB565)
+
+DEFINE_CONVERTERS(r5g6b5,   RGB565,   y800, Y800)
+DEFINE_CONVERTERS(r5g5b5a1, RGBA5551, y800, Y800)
+DEFINE_CONVERTERS(r4g4b4a4, RGBA4444, y800, Y800)
+DEFINE_CONVERTERS(r8g8b8a8, RGBA8888, y800, Y800)
+
+/* Generic MCU loader, specialized like convert_rows() */
+static inline __attribute__((always_inline))
+void load_mcu(int src_format, int scale, const unsigned char *src, int in_stride,
+              int width, int height, int x0, int y0, struct conversion_mcu *mcu)
+{
+	int src_pitch = in_stride * src_bytes_per_pixel(src_format);
+	int x_step = scale == 0 ? scale_step(CONVERSION_SRC_WIDTH, width) : 0;
+	int y_step = scale == 0 ? scale_step(CONVERSION_SRC_HEIGHT, height) : 0;
+	unsigned int r0, g0, b0, r1, g1, b1;
+	uint32_t uv;
+	int row, pair, x, y;
+
+	for (row = 0; row < CONVERSION_MCU_HEIGHT; row++) {
+		y = y0 + row < height ? y0 + row : height - 1;
+
+		for (pair = 0; pair < CONVERSION_MCU_WIDTH / 2; pair++) {
+			x = x0 + pair * 2 < width ? x0 + pair * 2 : width - 2;
+
+			fetch_pixel(src_format, scale, src, src_pitch, x_step, y_step, x, y,
+				    &r0, &g0, &b0);
+			fetch_pixel(src_format, scale, src, src_pitch, x_step, y_step, x + 1, y,
+				    &r1, &g1, &b1);
+
+			uv = uv_lut[0][r0 + r1] + uv_lut[1][g0 + g1] + uv_lut[2][b0 + b1];
+			mcu->y[row][pair * 2] = lut_y(r0, g0, b0);
+			mcu->y[row][pair * 2 + 1] = lut_y(r1, g1, b1);
+			mcu->cb[row][pair] = uv >> 8;
+			mcu->cr[row][pair] = uv >> 24;
 		}
 	}
 }
+
+#define DEFINE_MCU_LOADERS(src, SRC) \
+	static void src##_mcu_w480(const unsigned char *in, int in_stride, int width, int height, \
+				   int x, int y, struct conversion_mcu *mcu) \
+	{ \
+		load_mcu(CONVERSION_SRC_##SRC, 1, in, in_stride, 480, height, x, y, mcu); \
+	} \
+	static void src##_mcu_half(const unsigned char *in, int in_stride, int width, int height, \
+				   int x, int y, struct conversion_mcu *mcu) \
+	{ \
+		load_mcu(CONVERSION_SRC_##SRC, 2, in, in_stride, 240, 136, x, y, mcu); \
+	} \
+	static void src##_mcu_quarter(const unsigned char *in, int in_stride, int width, int height, \
+				      int x, int y, struct conversion_mcu *mcu) \
+	{ \
+		load_mcu(CONVERSION_SRC_##SRC, 4, in, in_stride, 120, 68, x, y, mcu); \
+	} \
+	static void src##_mcu_scaled(const unsigned char *in, int in_stride, int width, int height, \
+				     int x, int y, struct conversion_mcu *mcu) \
+	{ \
+		load_mcu(CONVERSION_SRC_##SRC, 0, in, in_stride, width, height, x, y, mcu); \
+	}
+
+DEFINE_MCU_LOADERS(r5g6b5,   RGB565)
+DEFINE_MCU_LOADERS(r5g5b5a1, RGBA5551)
+DEFINE_MCU_LOADERS(r4g4b4a4, RGBA4444)
+DEFINE_MCU_LOADERS(r8g8b8a8, RGBA8888)
+
+enum {
+	VARIANT_W480,
+	VARIANT_HALF,
+	VARIANT_QUARTER,
+	VARIANT_SCALED,
+	VARIANT_COUNT
+};
+
+#define CONVERTER_VARIANTS(src, dst) \
+	{ src##_to_##dst##_w480, src##_to_##dst##_half, \
+	  src##_to_##dst##_quarter, src##_to_##dst##_scaled }
+
+#define CONVERTER_ROW(dst) \
+	{ \
+		CONVERTER_VARIANTS(r5g6b5, dst), \
+		CONVERTER_VARIANTS(r5g5b5a1, dst), \
+		CONVERTER_VARIANTS(r4g4b4a4, dst), \
+		CONVERTER_VARIANTS(r8g8b8a8, dst), \
+	}
+
+#define MCU_LOADER_VARIANTS(src) \
+	{ src##_mcu_w480, src##_mcu_half, src##_mcu_quarter, src##_mcu_scaled }
+
+static const conversion_mcu_fn mcu_loaders[CONVERSION_SRC_COUNT][VARIANT_COUNT] = {
+	MCU_LOADER_VARIANTS(r5g6b5),
+	MCU_LOADER_VARIANTS(r5g5b5a1),
+	MCU_LOADER_VARIANTS(r4g4b4a4),
+	MCU_LOADER_VARIANTS(r8g8b8a8),
+};
+
+static const conversion_fn converters[CONVERSION_DST_COUNT][CONVERSION_SRC_COUNT][VARIANT_COUNT] = {
+	[CONVERSION_DST_YUY2] = CONVERTER_ROW(yuy2),
+	[CONVERSION_DST_NV12] = CONVERTER_ROW(nv12),
+	[CONVERSION_DST_I420] = CONVERTER_ROW(i420),
+	[CONVERSION_DST_RGB565] = CONVERTER_ROW(rgb565),
+	[CONVERSION_DST_Y800] = CONVERTER_ROW(y800),
+};
+
+void format_conversion_select(struct conversion_dispatch *dispatch, int dst_format, int width, int height)
+{
+	int variant, i;
+
+	if (width == CONVERSION_SRC_WIDTH && height == CONVERSION_SRC_HEIGHT) {
+		variant = VARIANT_W480;
+		dispatch->scale = 1;
+	} else if (width == CONVERSION_SRC_WIDTH / 2 && height == CONVERSION_SRC_HEIGHT / 2) {
+		variant = VARIANT_HALF;
+		dispatch->scale = 2;
+	} else if (width == CONVERSION_SRC_WIDTH / 4 && height == CONVERSION_SRC_HEIGHT / 4) {
+		variant = VARIANT_QUARTER;
+		dispatch->scale = 4;
+	} else {
+		variant = VARIANT_SCALED;
+		dispatch->scale = 0;
+	}
+
+	for (i = 0; i < CONVERSION_SRC_COUNT; i++) {
+		dispatch->convert[i] = converters[dst_format][i][variant];
+		dispatch->load_mcu[i] = mcu_loaders[i][variant];
+	}
+
+	dispatch->dst_format = dst_format;
+	dispatch->width = width;
+	dispatch->height = height;
+}
+
+int format_conversion_frame_size(int dst_format, int width, int height)
+{
+	if (dst_is_planar(dst_format))
+		return width * height * 3 / 2;
+
+	return dst_row_bytes(dst_format, width) * height;
+}
+
+int format_conversion_row_bytes(int dst_format, int width)
+{
+	if (dst_is_planar(dst_format))
+		return 0;
+
+	return dst_row_bytes(dst_format, width);
+}
+
+int format_conversion_row_align(int dst_format)
+{
+	return dst_is_planar(dst_format) ? 2 : 1;
+}
+
+/* Fletcher-style checksum of one source row: two adds per word */
+static uint32_t row_fingerprint(const unsigned char *row, int bytes)
+{
+	const uint32_t *p = (const uint32_t *)row;
+	const uint32_t *end = p + bytes / 4;
+	uint32_t a = 0, b = 0;
+
+	while (p < end) {
+		a += *p++;
+		b += a;
+	}
+
+	return a ^ ((b << 16) | (b >> 16));
+}
+
+/* Fingerprint of every source row read to produce output row y */
+static uint32_t output_row_fingerprint(const struct conversion_dispatch *dispatch, int src_format,
+                                       const unsigned char *src, int src_pitch, int y)
+{
+	int row_bytes = CONVERSION_SRC_WIDTH * src_bytes_per_pixel(src_format);
+	int first, count, i;
+	uint32_t hash = 0;
+
+	if (dispatch->scale == 0) {
+		first = (y * scale_step(CONVERSION_SRC_HEIGHT, dispatch->height)) >> 16;
+		count = first + 1 < CONVERSION_SRC_HEIGHT ? 2 : 1;
+	} else {
+		first = y * dispatch->scale;
+		count = dispatch->scale;
+	}
+
+	for (i = 0; i < count; i++) {
+		hash = (hash << 5) | (hash >> 27);
+		hash ^= row_fingerprint(src + (first + i) * src_pitch, row_bytes);
+	}
+
+	return hash;
+}
+
+/* Writes back every byte of dst produced from output rows [first, first + lines) */
+static void flush_rows(const struct conversion_dispatch *dispatch, unsigned char *dst,
+                       int first, int lines, conversion_flush_fn flush)
+{
+	int width = dispatch->width;
+	int luma_size = width * dispatch->height;
+
+	flush(dst + first * dst_row_bytes(dispatch->dst_format, width),
+	      lines * dst_row_bytes(dispatch->dst_format, width));
+
+	switch (dispatch->dst_format) {
+	case CONVERSION_DST_NV12:
+		flush(dst + luma_size + (first / 2) * width, (lines / 2) * width);
+		break;
+	case CONVERSION_DST_I420:
+		flush(dst + luma_size + (first / 2) * (width / 2), (lines / 2) * (width / 2));
+		flush(dst + luma_size + luma_size / 4 + (first / 2) * (width / 2),
+		      (lines / 2) * (width / 2));
+		break;
+	}
+}
+
+static void convert_and_flush(const struct conversion_dispatch *dispatch, int src_format,
+                              const unsigned char *src, unsigned char *dst, int in_stride,
+                              int first, int lines, conversion_flush_fn flush)
+{
+	dispatch->convert[src_format](src, dst, in_stride, dispatch->width, dispatch->height,
+				      first, lines);
+	flush_rows(dispatch, dst, first, lines, flush);
+}
+
+int format_conversion_convert_strips(const struct conversion_dispatch *dispatch, int src_format,
+                                     const unsigned char *src, unsigned char *dst, int in_stride,
+                                     int first, int lines, int strip_lines, conversion_flush_fn flush,
+                                     uint32_t *row_hashes, int reuse_rows)
+{
+	int src_pitch = in_stride * src_bytes_per_pixel(src_format);
+	int align = format_conversion_row_align(dispatch->dst_format);
+	int end = first + lines;
+	int skipped = 0;
+	int y, n, r, i, run;
+
+	if (strip_lines <= 0 || strip_lines > lines)
+		strip_lines = lines;
+	strip_lines = (strip_lines + align - 1) / align * align;
+
+	for (y = first; y < end; y += n) {
+		n = end - y < strip_lines ? end - y : strip_lines;
+
+		if (!row_hashes) {
+			convert_and_flush(dispatch, src_format, src, dst, in_stride, y, n, flush);
+			continue;
+		}
+
+		/*
+		 * Convert each run of changed rows, leave the rest untouched.
+		 * Rows sharing chroma are checked and converted as one unit.
+		 */
+		run = -1;
+		for (r = y; r <= y + n; r += align) {
+			int changed = 0;
+
+			if (r < y + n) {
+				for (i = r; i < r + align; i++) {
+					uint32_t hash = output_row_fingerprint(dispatch, src_format,
+									       src, src_pitch, i);
+
+					changed |= !reuse_rows || hash != row_hashes[i];
+					row_hashes[i] = hash;
+				}
+				if (!changed)
+					skipped += align;
+			}
+
+			if (changed && run < 0) {
+				run = r;
+			} else if (!changed && run >= 0) {
+				convert_and_flush(dispatch, src_format, src, dst, in_stride,
+						  run, r - run, flush);
+				run = -1;
+			}
+		}
+	}
+
+	return skipped;
+}
+
+void format_conversion_convert_into(const struct conversion_dispatch *dispatch, int src_format,
+                                    const unsigned char *src, int in_stride, int first, int lines,
+                                    unsigned char *buf)
+{
+	/* The converters address rows from the frame base, so rebase buf to it */
+	unsigned char *base = buf - first * dst_row_bytes(dispatch->dst_format, dispatch->width);
+
+	dispatch->convert[src_format](src, base, in_stride, dispatch->width, dispatch->height,
+				      first, lines);
+}
+
+static uint32_t frame_hash(const unsigned char *src, int src_format, int in_stride,
+                           int width, int height, int row_step)
+{
+	int src_pitch = in_stride * src_bytes_per_pixel(src_format);
+	int row_bytes = width * src_bytes_per_pixel(src_format);
+	uint32_t hash = 0;
+	int y;
+
+	for (y = 0; y < height; y += row_step) {
+		hash = (hash << 5) | (hash >> 27);
+		hash ^= row_fingerprint(src + y * src_pitch, row_bytes);
+	}
+
+	return hash;
+}
+
+uint32_t format_conversion_frame_sample(const unsigned char *src, int src_format, int in_stride,
+                                        int width, int height)
+{
+	return frame_hash(src, src_format, in_stride, width, height, FRAME_SAMPLE_ROW_STEP);
+}
+
+uint32_t format_conversion_frame_fingerprint(const unsigned char *src, int src_format, int in_stride,
+                                             int width, int height)
+{
+	return frame_hash(src, src_format, in_stride, width, height, 1);
+}
+
+uint32_t format_conversion_block_fingerprint(const struct conversion_dispatch *dispatch, int src_format,
+                                             const unsigned char *src, int in_stride,
+                                             int x, int y, int w, int h)
+{
+	int bpp = src_bytes_per_pixel(src_format);
+	int src_pitch = in_stride * bpp;
+	int x0, x1, y0, y1, first, bytes;
+	/* Seeded with the layout, so reading the same bytes as another is seen */
+	uint32_t hash = src_format;
+
+	/* Blocks past the edges repeat the last pixel pair and row */
+	if (x + w > dispatch->width)
+		w = dispatch->width - x;
+	if (y + h > dispatch->height)
+		h = dispatch->height - y;
+
+	if (dispatch->scale == 0) {
+		int x_step = scale_step(CONVERSION_SRC_WIDTH, dispatch->width);
+		int y_step = scale_step(CONVERSION_SRC_HEIGHT, dispatch->height);
+
+		/* sample_pixel() also reads the next pixel and row */
+		x0 = (x * x_step) >> 16;
+		x1 = (((x + w - 1) * x_step) >> 16) + 2;
+		y0 = (y * y_step) >> 16;
+		y1 = (((y + h - 1) * y_step) >> 16) + 2;
+	} else {
+		x0 = x * dispatch->scale;
+		x1 = (x + w) * dispatch->scale;
+		y0 = y * dispatch->scale;
+		y1 = (y + h) * dispatch->scale;
+	}
+
+	if (x1 > CONVERSION_SRC_WIDTH)
+		x1 = CONVERSION_SRC_WIDTH;
+	if (y1 > CONVERSION_SRC_HEIGHT)
+		y1 = CONVERSION_SRC_HEIGHT;
+
+	/* row_fingerprint() reads whole words */
+	first = (x0 * bpp) & ~3;
+	bytes = ((x1 * bpp + 3) & ~3) - first;
+
+	for (; y0 < y1; y0++) {
+		hash = (hash << 5) | (hash >> 27);
+		hash ^= row_fingerprint(src + y0 * src_pitch + first, bytes);
+	}
+
+	return hash;
+}
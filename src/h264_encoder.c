@@ -0,0 +1,473 @@
+#include <string.h>
+#include "h264_encoder.h"
+
+#define NAL_SLICE	1
+#define NAL_IDR		5
+#define NAL_SPS		7
+#define NAL_PPS		8
+
+#define SLICE_P		5	/* 0 + 5: every slice of the picture is P */
+#define SLICE_I		7	/* 2 + 5: every slice of the picture is I */
+
+#define MB_TYPE_I_PCM	25
+/* Intra macroblock types follow the five P types in P slices */
+#define MB_TYPE_P_I_PCM	(5 + MB_TYPE_I_PCM)
+
+#define PROFILE_BASELINE	66
+/* VUI colour description codes */
+#define COLOUR_PRIMARIES_BT709		1
+#define TRANSFER_BT709			1
+#define MATRIX_BT709			1
+#define MATRIX_SMPTE170M		6
+#define VIDEO_FORMAT_UNSPECIFIED	5
+
+/* frame_num runs modulo 16 */
+#define LOG2_MAX_FRAME_NUM	4
+
+/*
+ * Bytes of a macroblock sent as I_PCM: its mb_type, the alignment and the
+ * samples. Samples are kept above 0, so no emulation prevention byte is
+ * ever inserted between them.
+ */
+#define MB_PCM_MAX_BYTES	(384 + 4)
+
+/* Limits of the levels from table A-1, the bitrate for Baseline */
+static const struct {
+	int level_idc;
+	/* Macroblocks per second and per frame */
+	int max_mbps;
+	int max_fs;
+	/* kbit/s */
+	int max_br;
+} levels[] = {
+	{10,    1485,    99,     64},
+	{11,    3000,   396,    192},
+	{12,    6000,   396,    384},
+	{13,   11880,   396,    768},
+	{20,   11880,   396,   2000},
+	{21,   19800,   792,   4000},
+	{22,   20250,  1620,   4000},
+	{30,   40500,  1620,  10000},
+	{31,  108000,  3600,  14000},
+	{32,  216000,  5120,  20000},
+	{40,  245760,  8192,  20000},
+	{41,  245760,  8192,  50000},
+	{42,  522240,  8704,  50000},
+	{50,  589824, 22080, 135000},
+	{51,  983040, 36864, 240000},
+	{52, 2073600, 36864, 240000},
+};
+
+/*
+ * The lowest level whose limits hold with every macroblock of every frame
+ * sent as I_PCM, which is what a frame of changing content costs.
+ */
+static int pick_level(int mbs, int fps)
+{
+	long long kbps = (long long)mbs * MB_PCM_MAX_BYTES * 8 * fps / 1000;
+	int i;
+
+	for (i = 0; i < sizeof(levels) / sizeof(levels[0]) - 1; i++) {
+		if (mbs <= levels[i].max_fs && mbs * fps <= levels[i].max_mbps &&
+		    kbps <= levels[i].max_br)
+			break;
+	}
+
+	return levels[i].level_idc;
+}
+
+/*
+ * Bit writer for one NAL unit. Bytes go through emulation prevention,
+ * which inserts 0x03 after two zero bytes if the next one is 0 to 3.
+ * Running out of room sets overflow; the caller checks once per frame.
+ */
+struct nal_writer {
+	unsigned char *p;
+	unsigned char *end;
+	uint32_t acc;
+	int bits;
+	int zeros;
+	int overflow;
+};
+
+static inline void put_raw(struct nal_writer *w, unsigned char b)
+{
+	if (w->p < w->end)
+		*w->p++ = b;
+	else
+		w->overflow = 1;
+}
+
+static inline void put_byte(struct nal_writer *w, unsigned char b)
+{
+	if (w->zeros >= 2 && b <= 3) {
+		put_raw(w, 0x03);
+		w->zeros = 0;
+	}
+
+	put_raw(w, b);
+	w->zeros = b ? 0 : w->zeros + 1;
+}
+
+/* Writes the low size bits of value, size <= 24 */
+static inline void put_bits(struct nal_writer *w, uint32_t value, int size)
+{
+	w->acc = (w->acc << size) | (value & ((1u << size) - 1));
+	w->bits += size;
+
+	while (w->bits >= 8) {
+		put_byte(w, w->acc >> (w->bits - 8));
+		w->bits -= 8;
+	}
+}
+
+/* Exp-Golomb code: as many zero bits as v + 1 has bits after the first */
+static void put_ue(struct nal_writer *w, unsigned int v)
+{
+	unsigned int x = v + 1;
+	int n = 0;
+
+	while (x >> (n + 1))
+		n++;
+
+	put_bits(w, 0, n);
+	put_bits(w, x, n + 1);
+}
+
+static void put_se(struct nal_writer *w, int v)
+{
+	put_ue(w, v > 0 ? 2 * v - 1 : -2 * v);
+}
+
+static void align_zero(struct nal_writer *w)
+{
+	if (w->bits)
+		put_bits(w, 0, 8 - w->bits);
+}
+
+static void start_nal(struct nal_writer *w, int ref_idc, int type)
+{
+	/* Start code, not subject to emulation prevention */
+	put_raw(w, 0x00);
+	put_raw(w, 0x00);
+	put_raw(w, 0x00);
+	put_raw(w, 0x01);
+
+	w->acc = 0;
+	w->bits = 0;
+	w->zeros = 0;
+	put_byte(w, (ref_idc << 5) | type);
+}
+
+/* rbsp_trailing_bits(): a stop bit, then zeros up to the byte boundary */
+static void end_nal(struct nal_writer *w)
+{
+	put_bits(w, 1, 1);
+	align_zero(w);
+}
+
+static void write_sps(struct nal_writer *w, const struct h264_encoder *enc)
+{
+	int crop_right = enc->mb_cols * H264_MB_SIZE - enc->width;
+	int crop_bottom = enc->mb_rows * H264_MB_SIZE - enc->height;
+
+	start_nal(w, 3, NAL_SPS);
+	put_bits(w, PROFILE_BASELINE, 8);
+	put_bits(w, 0xC0, 8);		/* constraint_set0 and 1: Constrained Baseline */
+	put_bits(w, enc->level_idc, 8);
+	put_ue(w, 0);			/* seq_parameter_set_id */
+	put_ue(w, LOG2_MAX_FRAME_NUM - 4);
+	put_ue(w, 2);			/* pic_order_cnt_type: output order is decode order */
+	put_ue(w, 1);			/* max_num_ref_frames */
+	put_bits(w, 0, 1);		/* gaps_in_frame_num_value_allowed_flag */
+	put_ue(w, enc->mb_cols - 1);
+	put_ue(w, enc->mb_rows - 1);
+	put_bits(w, 1, 1);		/* frame_mbs_only_flag */
+	put_bits(w, 1, 1);		/* direct_8x8_inference_flag */
+
+	/* Cropping is in units of two 4:2:0 luma samples */
+	if (crop_right || crop_bottom) {
+		put_bits(w, 1, 1);
+		put_ue(w, 0);
+		put_ue(w, crop_right / 2);
+		put_ue(w, 0);
+		put_ue(w, crop_bottom / 2);
+	} else {
+		put_bits(w, 0, 1);
+	}
+
+	/* VUI with just the video signal type, so decoders get matrix and range right */
+	put_bits(w, 1, 1);		/* vui_parameters_present_flag */
+	put_bits(w, 0, 1);		/* aspect_ratio_info_present_flag */
+	put_bits(w, 0, 1);		/* overscan_info_present_flag */
+	put_bits(w, 1, 1);		/* video_signal_type_present_flag */
+	put_bits(w, VIDEO_FORMAT_UNSPECIFIED, 3);
+	put_bits(w, CONVERSION_COLOR_IS_FULL(enc->color) ? 1 : 0, 1);
+	put_bits(w, 1, 1);		/* colour_description_present_flag */
+	put_bits(w, COLOUR_PRIMARIES_BT709, 8);
+	put_bits(w, TRANSFER_BT709, 8);
+	put_bits(w, CONVERSION_COLOR_IS_BT709(enc->color) ? MATRIX_BT709 : MATRIX_SMPTE170M, 8);
+	put_bits(w, 0, 1);		/* chroma_loc_info_present_flag */
+	put_bits(w, 0, 1);		/* timing_info_present_flag */
+	put_bits(w, 0, 1);		/* nal_hrd_parameters_present_flag */
+	put_bits(w, 0, 1);		/* vcl_hrd_parameters_present_flag */
+	put_bits(w, 0, 1);		/* pic_struct_present_flag */
+	put_bits(w, 0, 1);		/* bitstream_restriction_flag */
+	end_nal(w);
+}
+
+static void write_pps(struct nal_writer *w)
+{
+	start_nal(w, 3, NAL_PPS);
+	put_ue(w, 0);			/* pic_parameter_set_id */
+	put_ue(w, 0);			/* seq_parameter_set_id */
+	put_bits(w, 0, 1);		/* entropy_coding_mode_flag: CAVLC */
+	put_bits(w, 0, 1);		/* bottom_field_pic_order_in_frame_present_flag */
+	put_ue(w, 0);			/* num_slice_groups_minus1 */
+	put_ue(w, 0);			/* num_ref_idx_l0_default_active_minus1 */
+	put_ue(w, 0);			/* num_ref_idx_l1_default_active_minus1 */
+	put_bits(w, 0, 1);		/* weighted_pred_flag */
+	put_bits(w, 0, 2);		/* weighted_bipred_idc */
+	put_se(w, 0);			/* pic_init_qp_minus26 */
+	put_se(w, 0);			/* pic_init_qs_minus26 */
+	put_se(w, 0);			/* chroma_qp_index_offset */
+	put_bits(w, 1, 1);		/* deblocking_filter_control_present_flag */
+	put_bits(w, 0, 1);		/* constrained_intra_pred_flag */
+	put_bits(w, 0, 1);		/* redundant_pic_cnt_present_flag */
+	end_nal(w);
+}
+
+static void write_slice_header(struct nal_writer *w, const struct h264_encoder *enc, int idr)
+{
+	start_nal(w, idr ? 3 : 2, idr ? NAL_IDR : NAL_SLICE);
+	put_ue(w, 0);			/* first_mb_in_slice */
+	put_ue(w, idr ? SLICE_I : SLICE_P);
+	put_ue(w, 0);			/* pic_parameter_set_id */
+	put_bits(w, enc->frame_num, LOG2_MAX_FRAME_NUM);
+
+	if (idr) {
+		put_ue(w, enc->idr_pic_id);
+		put_bits(w, 0, 1);	/* no_output_of_prior_pics_flag */
+		put_bits(w, 0, 1);	/* long_term_reference_flag */
+	} else {
+		put_bits(w, 0, 1);	/* num_ref_idx_active_override_flag */
+		put_bits(w, 0, 1);	/* ref_pic_list_modification_flag_l0 */
+		put_bits(w, 0, 1);	/* adaptive_ref_pic_marking_mode_flag */
+	}
+
+	put_se(w, 0);			/* slice_qp_delta */
+	/*
+	 * No deblocking: I_PCM edges would be left alone anyway, but edges
+	 * between I_PCM and P_Skip would be filtered, and decoded frames
+	 * would no longer match the source.
+	 */
+	put_ue(w, 1);			/* disable_deblocking_filter_idc */
+}
+
+/* Fingerprint of the YUY2 samples behind macroblock column mx */
+static uint32_t mb_fingerprint(const struct h264_encoder *enc, int mx)
+{
+	int pitch = enc->width * 2;
+	int start = mx * H264_MB_SIZE * 2;
+	int end = start + H264_MB_SIZE * 2;
+	uint32_t a = 0, b = 0;
+	int y;
+
+	if (end > pitch)
+		end = pitch;
+
+	for (y = 0; y < H264_MB_SIZE; y++) {
+		const uint32_t *p = (const uint32_t *)(enc->strip + y * pitch + start);
+		const uint32_t *e = (const uint32_t *)(enc->strip + y * pitch + end);
+
+		while (p < e) {
+			a += *p++;
+			b += a;
+		}
+	}
+
+	return a ^ ((b << 16) | (b >> 16));
+}
+
+/*
+ * Writes the samples of macroblock column mx from the YUY2 strip as
+ * pcm_sample_luma and pcm_sample_chroma, repeating the last column past
+ * the right edge of the frame. Samples are raised to at least 1: older
+ * decoders expect no 0 in PCM samples, and full-range ones could
+ * otherwise bring in emulation prevention bytes.
+ */
+static void put_pcm(struct nal_writer *w, const struct h264_encoder *enc, int mx)
+{
+	int pitch = enc->width * 2;
+	int last_pair = enc->width / 2 - 1;
+	int x, y, c;
+
+	align_zero(w);			/* pcm_alignment_zero_bit */
+
+	for (y = 0; y < H264_MB_SIZE; y++) {
+		const unsigned char *row = enc->strip + y * pitch;
+
+		for (x = 0; x < H264_MB_SIZE / 2; x++) {
+			int pair = mx * 8 + x;
+			const unsigned char *p;
+
+			if (pair > last_pair)
+				pair = last_pair;
+			p = row + pair * 4;
+
+			put_byte(w, p[0] ? p[0] : 1);
+			put_byte(w, p[2] ? p[2] : 1);
+		}
+	}
+
+	/* Cb (offset 1 in a YUY2 pair), then Cr (offset 3) */
+	for (c = 1; c <= 3; c += 2) {
+		for (y = 0; y < H264_MB_SIZE / 2; y++) {
+			const unsigned char *row0 = enc->strip + 2 * y * pitch;
+			const unsigned char *row1 = row0 + pitch;
+
+			for (x = 0; x < H264_MB_SIZE / 2; x++) {
+				int pair = mx * 8 + x;
+
+				if (pair > last_pair)
+					pair = last_pair;
+
+				int v = (row0[pair * 4 + c] + row1[pair * 4 + c] + 1) >> 1;
+
+				put_byte(w, v ? v : 1);
+			}
+		}
+	}
+}
+
+void h264_encoder_setup(struct h264_encoder *enc, int width, int height, int fps,
+                        int idr_interval)
+{
+	enc->width = width;
+	enc->height = height;
+	enc->mb_cols = (width + H264_MB_SIZE - 1) / H264_MB_SIZE;
+	enc->mb_rows = (height + H264_MB_SIZE - 1) / H264_MB_SIZE;
+	enc->level_idc = pick_level(enc->mb_cols * enc->mb_rows, fps);
+	enc->idr_interval = idr_interval;
+	enc->color = CONVERSION_COLOR_BT601_LIMITED;
+	enc->idr_pic_id = 0;
+	enc->mbs_coded = 0;
+	h264_encoder_request_idr(enc);
+}
+
+void h264_encoder_set_color(struct h264_encoder *enc, int color)
+{
+	if (enc->color == color)
+		return;
+
+	enc->color = color;
+	h264_encoder_request_idr(enc);
+}
+
+void h264_encoder_request_idr(struct h264_encoder *enc)
+{
+	enc->force_idr = 1;
+}
+
+int h264_encoder_idr_due(const struct h264_encoder *enc)
+{
+	return enc->force_idr || (enc->idr_interval && enc->frames_since_idr >= enc->idr_interval);
+}
+
+/* Moves on to the next frame once one has been written in full */
+static void frame_done(struct h264_encoder *enc, int idr)
+{
+	if (idr) {
+		enc->force_idr = 0;
+		enc->frames_since_idr = 0;
+		enc->idr_pic_id ^= 1;	/* Consecutive IDRs need different ids */
+	}
+
+	enc->frames_since_idr++;
+	enc->frame_num = (enc->frame_num + 1) & ((1 << LOG2_MAX_FRAME_NUM) - 1);
+}
+
+int h264_encoder_encode(struct h264_encoder *enc, const struct conversion_dispatch *dispatch,
+                        int src_format, const unsigned char *src, int in_stride,
+                        unsigned char *out, int out_size)
+{
+	struct nal_writer w = { out, out + out_size, 0, 0, 0, 0 };
+	int pitch = enc->width * 2;
+	int idr = h264_encoder_idr_due(enc);
+	int first, lines, mx, r;
+	int mb = 0, skip_run = 0;
+
+	if (idr) {
+		enc->frame_num = 0;
+		write_sps(&w, enc);
+		write_pps(&w);
+	}
+
+	write_slice_header(&w, enc, idr);
+	enc->mbs_coded = 0;
+
+	for (first = 0; first < enc->height; first += H264_MB_SIZE) {
+		lines = enc->height - first < H264_MB_SIZE ? enc->height - first : H264_MB_SIZE;
+
+		format_conversion_convert_into(dispatch, src_format, src, in_stride, first, lines,
+					       enc->strip);
+		/* Repeat the last row below the bottom edge of the frame */
+		for (r = lines; r < H264_MB_SIZE; r++)
+			memcpy(enc->strip + r * pitch, enc->strip + (lines - 1) * pitch, pitch);
+
+		for (mx = 0; mx < enc->mb_cols; mx++, mb++) {
+			uint32_t hash = mb_fingerprint(enc, mx);
+
+			if (!idr && hash == enc->mb_hash[mb]) {
+				skip_run++;
+				continue;
+			}
+
+			if (idr) {
+				put_ue(&w, MB_TYPE_I_PCM);
+			} else {
+				put_ue(&w, skip_run);
+				put_ue(&w, MB_TYPE_P_I_PCM);
+				skip_run = 0;
+			}
+
+			put_pcm(&w, enc, mx);
+			enc->mb_hash[mb] = hash;
+			enc->mbs_coded++;
+		}
+
+		if (w.overflow)
+			break;
+	}
+
+	if (skip_run)
+		put_ue(&w, skip_run);
+	end_nal(&w);
+
+	if (w.overflow) {
+		/* The hashes no longer describe what the decoder holds */
+		h264_encoder_request_idr(enc);
+		return -1;
+	}
+
+	frame_done(enc, idr);
+
+	return w.p - out;
+}
+
+int h264_encoder_encode_unchanged(struct h264_encoder *enc, unsigned char *out, int out_size)
+{
+	struct nal_writer w = { out, out + out_size, 0, 0, 0, 0 };
+
+	write_slice_header(&w, enc, 0);
+	put_ue(&w, enc->mb_cols * enc->mb_rows);	/* mb_skip_run */
+	end_nal(&w);
+
+	if (w.overflow)
+		return -1;
+
+	enc->mbs_coded = 0;
+	frame_done(enc, 0);
+
+	return w.p - out;
+}
@@ -0,0 +1,755 @@
+#include <string.h>
+#include "jpeg_encoder.h"
+
+/*
+ * Quantized coefficients are computed as (|c| * recip + round) >> RECIP_SHIFT
+ * with recip = 2^RECIP_SHIFT / (8 * q); the 8 undoes the gain of the DCT.
+ * |c| stays below 2^14 and recip below 2^15, so the product fits 32 bits.
+ */
+#define RECIP_SHIFT	18
+
+/* Integer DCT constants (13-bit fixed point), as in the IJG islow DCT */
+#define CONST_BITS	13
+#define PASS1_BITS	2
+
+#define FIX_0_298631336	2446
+#define FIX_0_390180644	3196
+#define FIX_0_541196100	4433
+#define FIX_0_765366865	6270
+#define FIX_0_899976223	7373
+#define FIX_1_175875602	9633
+#define FIX_1_501321110	12299
+#define FIX_1_847759065	15137
+#define FIX_1_961570560	16069
+#define FIX_2_053119869	16819
+#define FIX_2_562915447	20995
+#define FIX_3_072711026	25172
+
+#define DESCALE(x, n)	(((x) + (1 << ((n) - 1))) >> (n))
+
+static const unsigned char zigzag[64] = {
+	 0,  1,  8, 16,  9,  2,  3, 10,
+	17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34,
+	27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36,
+	29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46,
+	53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+/* Annex K quantization tables, in natural order */
+static const unsigned char std_qt_luma[64] = {
+	16,  11,  10,  16,  24,  40,  51,  61,
+	12,  12,  14,  19,  26,  58,  60,  55,
+	14,  13,  16,  24,  40,  57,  69,  56,
+	14,  17,  22,  29,  51,  87,  80,  62,
+	18,  22,  37,  56,  68, 109, 103,  77,
+	24,  35,  55,  64,  81, 104, 113,  92,
+	49,  64,  78,  87, 103, 121, 120, 101,
+	72,  92,  95,  98, 112, 100, 103,  99,
+};
+
+static const unsigned char std_qt_chroma[64] = {
+	17,  18,  24,  47,  99,  99,  99,  99,
+	18,  21,  26,  66,  99,  99,  99,  99,
+	24,  26,  56,  99,  99,  99,  99,  99,
+	47,  66,  99,  99,  99,  99,  99,  99,
+	99,  99,  99,  99,  99,  99,  99,  99,
+	99,  99,  99,  99,  99,  99,  99,  99,
+	99,  99,  99,  99,  99,  99,  99,  99,
+	99,  99,  99,  99,  99,  99,  99,  99,
+};
+
+/* Annex K Huffman tables: code counts per length, then the symbols */
+static const unsigned char dc_luma_bits[16] = {
+	0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0
+};
+static const unsigned char dc_chroma_bits[16] = {
+	0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0
+};
+static const unsigned char dc_vals[12] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
+};
+
+static const unsigned char ac_luma_bits[16] = {
+	0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d
+};
+static const unsigned char ac_luma_vals[162] = {
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+	0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+	0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+	0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+	0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa,
+};
+
+static const unsigned char ac_chroma_bits[16] = {
+	0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77
+};
+static const unsigned char ac_chroma_vals[162] = {
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+	0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+	0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+	0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+	0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+	0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+	0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa,
+};
+
+struct huff_table {
+	uint16_t code[256];
+	unsigned char size[256];
+};
+
+static struct huff_table dc_luma, dc_chroma, ac_luma, ac_chroma;
+
+/* Annex C: canonical codes from the per-length counts */
+static void build_huff_table(struct huff_table *t, const unsigned char bits[16],
+                             const unsigned char *vals)
+{
+	unsigned int code = 0;
+	int len, i, k = 0;
+
+	for (len = 1; len <= 16; len++) {
+		for (i = 0; i < bits[len - 1]; i++) {
+			t->code[vals[k]] = code++;
+			t->size[vals[k]] = len;
+			k++;
+		}
+		code <<= 1;
+	}
+}
+
+void jpeg_encoder_init(void)
+{
+	build_huff_table(&dc_luma, dc_luma_bits, dc_vals);
+	build_huff_table(&dc_chroma, dc_chroma_bits, dc_vals);
+	build_huff_table(&ac_luma, ac_luma_bits, ac_luma_vals);
+	build_huff_table(&ac_chroma, ac_chroma_bits, ac_chroma_vals);
+}
+
+static void scale_qt(unsigned char qt[64], uint16_t recip[64], const unsigned char std[64], int quality)
+{
+	int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+	int i;
+
+	for (i = 0; i < 64; i++) {
+		int q = (std[zigzag[i]] * scale + 50) / 100;
+
+		if (q < 1)
+			q = 1;
+		if (q > 255)
+			q = 255;
+
+		qt[i] = q;
+		recip[i] = ((1 << RECIP_SHIFT) + 4 * q) / (8 * q);
+	}
+}
+
+void jpeg_encoder_set_quality(struct jpeg_encoder *enc, int quality)
+{
+	if (quality < 1)
+		quality = 1;
+	if (quality > 100)
+		quality = 100;
+
+	enc->quality = quality;
+	scale_qt(enc->qt_luma, enc->recip_luma, std_qt_luma, quality);
+	scale_qt(enc->qt_chroma, enc->recip_chroma, std_qt_chroma, quality);
+
+	/* Cached bits were quantized with the old tables */
+	if (enc->cache)
+		enc->cache->valid = 0;
+}
+
+/* The largest divisor of the MCU columns up to JPEG_SEGMENT_MCUS_MAX */
+static int segment_mcus(int width)
+{
+	int cols = (width + JPEG_MCU_WIDTH - 1) / JPEG_MCU_WIDTH;
+	int n;
+
+	for (n = JPEG_SEGMENT_MCUS_MAX; n > 1; n--) {
+		if (cols % n == 0)
+			break;
+	}
+
+	return n;
+}
+
+/* The segment cache wants short intervals; slices only need one per MCU row */
+static void update_restart(struct jpeg_encoder *enc)
+{
+	if (enc->cache)
+		enc->restart_mcus = segment_mcus(enc->width);
+	else if (enc->slices > 1)
+		enc->restart_mcus = (enc->width + JPEG_MCU_WIDTH - 1) / JPEG_MCU_WIDTH;
+	else
+		enc->restart_mcus = 0;
+}
+
+void jpeg_encoder_set_cache(struct jpeg_encoder *enc, struct jpeg_segment_cache *cache)
+{
+	enc->cache = cache;
+	update_restart(enc);
+
+	if (cache) {
+		cache->valid = 0;
+		cache->segments_reused = 0;
+		cache->segments = 0;
+	}
+}
+
+void jpeg_encoder_set_slices(struct jpeg_encoder *enc, struct conversion_executor *executor,
+                             int slices)
+{
+	if (!executor || slices < 1)
+		slices = 1;
+	if (slices > JPEG_MAX_SLICES)
+		slices = JPEG_MAX_SLICES;
+
+	enc->executor = executor;
+	enc->slices = slices;
+	update_restart(enc);
+}
+
+void jpeg_encoder_setup(struct jpeg_encoder *enc, int width, int height, int quality)
+{
+	enc->width = width;
+	enc->height = height;
+	jpeg_encoder_set_quality(enc, quality);
+	jpeg_encoder_set_cache(enc, enc->cache);
+}
+
+/*
+ * Bit writer with 0xFF byte stuffing. Running out of room sets overflow
+ * and drops everything after it; the caller checks once per frame.
+ */
+struct bit_writer {
+	unsigned char *p;
+	unsigned char *end;
+	uint32_t acc;
+	int bits;
+	int overflow;
+};
+
+static inline void put_byte(struct bit_writer *bw, unsigned char b)
+{
+	if (bw->p < bw->end)
+		*bw->p++ = b;
+	else
+		bw->overflow = 1;
+}
+
+static inline void put_bits(struct bit_writer *bw, uint32_t code, int size)
+{
+	bw->acc = (bw->acc << size) | (code & ((1u << size) - 1));
+	bw->bits += size;
+
+	while (bw->bits >= 8) {
+		unsigned char b = bw->acc >> (bw->bits - 8);
+
+		put_byte(bw, b);
+		if (b == 0xFF)
+			put_byte(bw, 0x00);
+		bw->bits -= 8;
+	}
+}
+
+/* Pads the last byte with 1 bits, as the spec asks */
+static void flush_bits(struct bit_writer *bw)
+{
+	if (bw->bits > 0)
+		put_bits(bw, 0x7F, 8 - bw->bits);
+	bw->acc = 0;
+}
+
+static void put_marker(struct bit_writer *bw, unsigned char marker)
+{
+	put_byte(bw, 0xFF);
+	put_byte(bw, marker);
+}
+
+static void put_word(struct bit_writer *bw, unsigned int w)
+{
+	put_byte(bw, w >> 8);
+	put_byte(bw, w & 0xFF);
+}
+
+/* Appends already stuffed, byte-aligned entropy-coded data */
+static void put_bytes(struct bit_writer *bw, const unsigned char *data, int size)
+{
+	if (bw->end - bw->p < size) {
+		bw->overflow = 1;
+		return;
+	}
+
+	memcpy(bw->p, data, size);
+	bw->p += size;
+}
+
+static void put_dht(struct bit_writer *bw, int class_id, const unsigned char bits[16],
+                    const unsigned char *vals)
+{
+	int i, n = 0;
+
+	for (i = 0; i < 16; i++)
+		n += bits[i];
+
+	put_byte(bw, class_id);
+	for (i = 0; i < 16; i++)
+		put_byte(bw, bits[i]);
+	for (i = 0; i < n; i++)
+		put_byte(bw, vals[i]);
+}
+
+static void write_headers(struct bit_writer *bw, const struct jpeg_encoder *enc)
+{
+	int i;
+
+	put_marker(bw, 0xD8);			/* SOI */
+
+	put_marker(bw, 0xDB);			/* DQT: luma table 0, chroma table 1 */
+	put_word(bw, 2 + 2 * 65);
+	put_byte(bw, 0);
+	for (i = 0; i < 64; i++)
+		put_byte(bw, enc->qt_luma[i]);
+	put_byte(bw, 1);
+	for (i = 0; i < 64; i++)
+		put_byte(bw, enc->qt_chroma[i]);
+
+	put_marker(bw, 0xC0);			/* SOF0 */
+	put_word(bw, 8 + 3 * 3);
+	put_byte(bw, 8);
+	put_word(bw, enc->height);
+	put_word(bw, enc->width);
+	put_byte(bw, 3);
+	put_byte(bw, 1); put_byte(bw, 0x21); put_byte(bw, 0);	/* Y: 2x1 sampling */
+	put_byte(bw, 2); put_byte(bw, 0x11); put_byte(bw, 1);	/* Cb */
+	put_byte(bw, 3); put_byte(bw, 0x11); put_byte(bw, 1);	/* Cr */
+
+	put_marker(bw, 0xC4);			/* DHT */
+	put_word(bw, 2 + 4 * 17 + 2 * 12 + 2 * 162);
+	put_dht(bw, 0x00, dc_luma_bits, dc_vals);
+	put_dht(bw, 0x10, ac_luma_bits, ac_luma_vals);
+	put_dht(bw, 0x01, dc_chroma_bits, dc_vals);
+	put_dht(bw, 0x11, ac_chroma_bits, ac_chroma_vals);
+
+	if (enc->restart_mcus) {
+		put_marker(bw, 0xDD);		/* DRI */
+		put_word(bw, 4);
+		put_word(bw, enc->restart_mcus);
+	}
+
+	put_marker(bw, 0xDA);			/* SOS */
+	put_word(bw, 6 + 2 * 3);
+	put_byte(bw, 3);
+	put_byte(bw, 1); put_byte(bw, 0x00);
+	put_byte(bw, 2); put_byte(bw, 0x11);
+	put_byte(bw, 3); put_byte(bw, 0x11);
+	put_byte(bw, 0);
+	put_byte(bw, 63);
+	put_byte(bw, 0);
+}
+
+/* Forward DCT of a level-shifted block; outputs are 8 times the true DCT */
+static void fdct(int *data)
+{
+	int tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+	int tmp10, tmp11, tmp12, tmp13;
+	int z1, z2, z3, z4, z5;
+	int *d;
+	int i;
+
+	for (i = 0, d = data; i < 8; i++, d += 8) {
+		tmp0 = d[0] + d[7];
+		tmp7 = d[0] - d[7];
+		tmp1 = d[1] + d[6];
+		tmp6 = d[1] - d[6];
+		tmp2 = d[2] + d[5];
+		tmp5 = d[2] - d[5];
+		tmp3 = d[3] + d[4];
+		tmp4 = d[3] - d[4];
+
+		tmp10 = tmp0 + tmp3;
+		tmp13 = tmp0 - tmp3;
+		tmp11 = tmp1 + tmp2;
+		tmp12 = tmp1 - tmp2;
+
+		d[0] = (tmp10 + tmp11) << PASS1_BITS;
+		d[4] = (tmp10 - tmp11) << PASS1_BITS;
+
+		z1 = (tmp12 + tmp13) * FIX_0_541196100;
+		d[2] = DESCALE(z1 + tmp13 * FIX_0_765366865, CONST_BITS - PASS1_BITS);
+		d[6] = DESCALE(z1 - tmp12 * FIX_1_847759065, CONST_BITS - PASS1_BITS);
+
+		z1 = tmp4 + tmp7;
+		z2 = tmp5 + tmp6;
+		z3 = tmp4 + tmp6;
+		z4 = tmp5 + tmp7;
+		z5 = (z3 + z4) * FIX_1_175875602;
+
+		tmp4 *= FIX_0_298631336;
+		tmp5 *= FIX_2_053119869;
+		tmp6 *= FIX_3_072711026;
+		tmp7 *= FIX_1_501321110;
+		z1 *= -FIX_0_899976223;
+		z2 *= -FIX_2_562915447;
+		z3 *= -FIX_1_961570560;
+		z4 *= -FIX_0_390180644;
+
+		z3 += z5;
+		z4 += z5;
+
+		d[7] = DESCALE(tmp4 + z1 + z3, CONST_BITS - PASS1_BITS);
+		d[5] = DESCALE(tmp5 + z2 + z4, CONST_BITS - PASS1_BITS);
+		d[3] = DESCALE(tmp6 + z2 + z3, CONST_BITS - PASS1_BITS);
+		d[1] = DESCALE(tmp7 + z1 + z4, CONST_BITS - PASS1_BITS);
+	}
+
+	for (i = 0, d = data; i < 8; i++, d++) {
+		tmp0 = d[8 * 0] + d[8 * 7];
+		tmp7 = d[8 * 0] - d[8 * 7];
+		tmp1 = d[8 * 1] + d[8 * 6];
+		tmp6 = d[8 * 1] - d[8 * 6];
+		tmp2 = d[8 * 2] + d[8 * 5];
+		tmp5 = d[8 * 2] - d[8 * 5];
+		tmp3 = d[8 * 3] + d[8 * 4];
+		tmp4 = d[8 * 3] - d[8 * 4];
+
+		tmp10 = tmp0 + tmp3;
+		tmp13 = tmp0 - tmp3;
+		tmp11 = tmp1 + tmp2;
+		tmp12 = tmp1 - tmp2;
+
+		d[8 * 0] = DESCALE(tmp10 + tmp11, PASS1_BITS);
+		d[8 * 4] = DESCALE(tmp10 - tmp11, PASS1_BITS);
+
+		z1 = (tmp12 + tmp13) * FIX_0_541196100;
+		d[8 * 2] = DESCALE(z1 + tmp13 * FIX_0_765366865, CONST_BITS + PASS1_BITS);
+		d[8 * 6] = DESCALE(z1 - tmp12 * FIX_1_847759065, CONST_BITS + PASS1_BITS);
+
+		z1 = tmp4 + tmp7;
+		z2 = tmp5 + tmp6;
+		z3 = tmp4 + tmp6;
+		z4 = tmp5 + tmp7;
+		z5 = (z3 + z4) * FIX_1_175875602;
+
+		tmp4 *= FIX_0_298631336;
+		tmp5 *= FIX_2_053119869;
+		tmp6 *= FIX_3_072711026;
+		tmp7 *= FIX_1_501321110;
+		z1 *= -FIX_0_899976223;
+		z2 *= -FIX_2_562915447;
+		z3 *= -FIX_1_961570560;
+		z4 *= -FIX_0_390180644;
+
+		z3 += z5;
+		z4 += z5;
+
+		d[8 * 7] = DESCALE(tmp4 + z1 + z3, CONST_BITS + PASS1_BITS);
+		d[8 * 5] = DESCALE(tmp5 + z2 + z4, CONST_BITS + PASS1_BITS);
+		d[8 * 3] = DESCALE(tmp6 + z2 + z3, CONST_BITS + PASS1_BITS);
+		d[8 * 1] = DESCALE(tmp7 + z1 + z4, CONST_BITS + PASS1_BITS);
+	}
+}
+
+/* Number of bits needed for |v|, the JPEG magnitude category */
+static inline int magnitude_bits(int v)
+{
+	int n = 0;
+
+	if (v < 0)
+		v = -v;
+	while (v) {
+		n++;
+		v >>= 1;
+	}
+
+	return n;
+}
+
+static inline void put_value(struct bit_writer *bw, int v, int n)
+{
+	/* Negative values are sent as v - 1 in n bits (one's complement) */
+	put_bits(bw, v < 0 ? v - 1 : v, n);
+}
+
+/* Transforms, quantizes and entropy-codes one block, updating the DC predictor */
+static void encode_block(struct bit_writer *bw, int *block, const uint16_t recip[64],
+                         const struct huff_table *dc, const struct huff_table *ac, int *pred)
+{
+	int q[64];
+	int i, n, run, diff;
+
+	fdct(block);
+
+	for (i = 0; i < 64; i++) {
+		int c = block[zigzag[i]];
+		int m = ((c < 0 ? -c : c) * recip[i] + (1 << (RECIP_SHIFT - 1))) >> RECIP_SHIFT;
+
+		q[i] = c < 0 ? -m : m;
+	}
+
+	diff = q[0] - *pred;
+	*pred = q[0];
+	n = magnitude_bits(diff);
+	put_bits(bw, dc->code[n], dc->size[n]);
+	if (n)
+		put_value(bw, diff, n);
+
+	run = 0;
+	for (i = 1; i < 64; i++) {
+		if (q[i] == 0) {
+			run++;
+			continue;
+		}
+
+		while (run > 15) {
+			put_bits(bw, ac->code[0xF0], ac->size[0xF0]);
+			run -= 16;
+		}
+
+		n = magnitude_bits(q[i]);
+		put_bits(bw, ac->code[(run << 4) | n], ac->size[(run << 4) | n]);
+		put_value(bw, q[i], n);
+		run = 0;
+	}
+
+	if (run)
+		put_bits(bw, ac->code[0x00], ac->size[0x00]);
+}
+
+/* Level-shifts the samples of one MCU into its two luma and two chroma blocks */
+static void load_blocks(const struct conversion_mcu *mcu, int y0[64], int y1[64], int cb[64], int cr[64])
+{
+	int x, y;
+
+	for (y = 0; y < JPEG_MCU_HEIGHT; y++) {
+		for (x = 0; x < 8; x++) {
+			y0[y * 8 + x] = mcu->y[y][x] - 128;
+			y1[y * 8 + x] = mcu->y[y][x + 8] - 128;
+			cb[y * 8 + x] = mcu->cb[y][x] - 128;
+			cr[y * 8 + x] = mcu->cr[y][x] - 128;
+		}
+	}
+}
+
+/*
+ * Remembers the coded bytes of a segment in the current half of the cache,
+ * at *used and below limit (each slice has its own part of the half).
+ */
+static void cache_segment(struct jpeg_segment_cache *cache, int segment, uint32_t hash,
+                          const unsigned char *data, int size, int *used, int limit)
+{
+	cache->hash[segment] = hash;
+
+	if (*used + size > limit || size > 0xFFFF) {
+		cache->size[segment] = 0;
+		return;
+	}
+
+	memcpy(cache->data[cache->current ^ 1] + *used, data, size);
+	cache->offset[segment] = *used;
+	cache->size[segment] = size;
+	*used += size;
+}
+
+struct slice_job {
+	struct jpeg_encoder *enc;
+	const struct conversion_dispatch *dispatch;
+	int src_format;
+	const unsigned char *src;
+	int in_stride;
+	int slices;
+	int mcu_rows;
+	int rows_per_slice;
+	/* Slice i writes from body + i * out_part, the last one up to out_end */
+	unsigned char *body;
+	unsigned char *out_end;
+	int out_part;
+	int cache_part;
+	unsigned char *end[JPEG_MAX_SLICES];
+	int overflow[JPEG_MAX_SLICES];
+	int reused[JPEG_MAX_SLICES];
+};
+
+static void encode_slice(void *arg, int index)
+{
+	struct slice_job *job = arg;
+	struct jpeg_encoder *enc = job->enc;
+	struct jpeg_segment_cache *cache = enc->cache;
+	const unsigned char *prev = cache ? cache->data[cache->current] : NULL;
+	conversion_mcu_fn load_mcu = job->dispatch->load_mcu[job->src_format];
+	struct conversion_mcu *mcu = &enc->mcu[index];
+	unsigned char *start = job->body + index * job->out_part;
+	struct bit_writer bw = { start, job->out_end, 0, 0, 0 };
+	int mcu_cols = (enc->width + JPEG_MCU_WIDTH - 1) / JPEG_MCU_WIDTH;
+	int seg_mcus = enc->restart_mcus ? enc->restart_mcus : mcu_cols;
+	int row = index * job->rows_per_slice;
+	int last_row = row + job->rows_per_slice;
+	int segment = row * (mcu_cols / seg_mcus);
+	int used = index * job->cache_part;
+	int limit = used + job->cache_part;
+	int pred_y = 0, pred_cb = 0, pred_cr = 0;
+	int y0[64], y1[64], cb[64], cr[64];
+	int mx, x;
+
+	if (index < job->slices - 1)
+		bw.end = start + job->out_part;
+	if (last_row > job->mcu_rows)
+		last_row = job->mcu_rows;
+
+	job->reused[index] = 0;
+
+	for (; row < last_row; row++) {
+		for (mx = 0; mx < mcu_cols; mx += seg_mcus, segment++) {
+			unsigned char *seg_start;
+			uint32_t hash = 0;
+
+			if (enc->restart_mcus) {
+				if (segment > 0)
+					put_marker(&bw, 0xD0 + ((segment - 1) & 7));	/* RSTn */
+				pred_y = pred_cb = pred_cr = 0;
+			}
+
+			seg_start = bw.p;
+
+			if (cache) {
+				/* From the source pixels, so a copied interval is never loaded */
+				hash = format_conversion_block_fingerprint(job->dispatch, job->src_format,
+									   job->src, job->in_stride,
+									   mx * JPEG_MCU_WIDTH,
+									   row * JPEG_MCU_HEIGHT,
+									   seg_mcus * JPEG_MCU_WIDTH,
+									   JPEG_MCU_HEIGHT);
+
+				if (cache->valid && cache->size[segment] && cache->hash[segment] == hash) {
+					put_bytes(&bw, prev + cache->offset[segment], cache->size[segment]);
+					cache_segment(cache, segment, hash, seg_start, bw.p - seg_start,
+						      &used, limit);
+					job->reused[index]++;
+					continue;
+				}
+			}
+
+			for (x = 0; x < seg_mcus; x++) {
+				load_mcu(job->src, job->in_stride, enc->width, enc->height,
+					 (mx + x) * JPEG_MCU_WIDTH, row * JPEG_MCU_HEIGHT, mcu);
+				load_blocks(mcu, y0, y1, cb, cr);
+				encode_block(&bw, y0, enc->recip_luma, &dc_luma, &ac_luma, &pred_y);
+				encode_block(&bw, y1, enc->recip_luma, &dc_luma, &ac_luma, &pred_y);
+				encode_block(&bw, cb, enc->recip_chroma, &dc_chroma, &ac_chroma, &pred_cb);
+				encode_block(&bw, cr, enc->recip_chroma, &dc_chroma, &ac_chroma, &pred_cr);
+			}
+
+			if (enc->restart_mcus)
+				flush_bits(&bw);
+			if (cache && !bw.overflow)
+				cache_segment(cache, segment, hash, seg_start, bw.p - seg_start,
+					      &used, limit);
+		}
+
+		if (bw.overflow)
+			break;
+	}
+
+	flush_bits(&bw);
+
+	job->end[index] = bw.p;
+	job->overflow[index] = bw.overflow;
+}
+
+int jpeg_encoder_encode(struct jpeg_encoder *enc, const struct conversion_dispatch *dispatch,
+                        int src_format, const unsigned char *src, int in_stride,
+                        unsigned char *out, int out_size)
+{
+	/* Two bytes are kept back for the EOI marker */
+	struct bit_writer bw = { out, out + out_size - 2, 0, 0, 0 };
+	struct jpeg_segment_cache *cache = enc->cache;
+	int mcu_cols = (enc->width + JPEG_MCU_WIDTH - 1) / JPEG_MCU_WIDTH;
+	int mcu_rows = (enc->height + JPEG_MCU_HEIGHT - 1) / JPEG_MCU_HEIGHT;
+	int seg_mcus = enc->restart_mcus ? enc->restart_mcus : mcu_cols;
+	int slices = enc->slices > 1 ? enc->slices : 1;
+	struct slice_job job;
+	unsigned char *p;
+	int overflow = 0;
+	int i;
+
+	if (out_size < 2)
+		return -1;
+
+	write_headers(&bw, enc);
+	if (bw.overflow)
+		return -1;
+
+	if (slices > mcu_rows)
+		slices = mcu_rows;
+
+	job = (struct slice_job){
+		.enc		= enc,
+		.dispatch	= dispatch,
+		.src_format	= src_format,
+		.src		= src,
+		.in_stride	= in_stride,
+		.mcu_rows	= mcu_rows,
+		.rows_per_slice	= (mcu_rows + slices - 1) / slices,
+		.body		= bw.p,
+		.out_end	= bw.end,
+	};
+	slices = (mcu_rows + job.rows_per_slice - 1) / job.rows_per_slice;
+	job.slices = slices;
+	job.out_part = (bw.end - bw.p) / slices;
+	job.cache_part = JPEG_CACHE_BYTES / slices;
+
+	if (slices == 1)
+		encode_slice(&job, 0);
+	else
+		enc->executor->run(enc->executor, encode_slice, &job, slices);
+
+	/* Close the gaps between the slices' shares of the buffer */
+	p = job.body;
+	for (i = 0; i < slices; i++) {
+		unsigned char *start = job.body + i * job.out_part;
+		int size = job.end[i] - start;
+
+		overflow |= job.overflow[i];
+		if (p != start)
+			memmove(p, start, size);
+		p += size;
+	}
+
+	p[0] = 0xFF;				/* EOI */
+	p[1] = 0xD9;
+	p += 2;
+
+	if (cache) {
+		cache->segments_reused = 0;
+		for (i = 0; i < slices; i++)
+			cache->segments_reused += job.reused[i];
+	}
+
+	if (overflow) {
+		/* Part of the entries already point into the half being written */
+		if (cache)
+			cache->valid = 0;
+		return -1;
+	}
+
+	if (cache) {
+		cache->current ^= 1;
+		cache->valid = 1;
+		cache->segments = mcu_rows * (mcu_cols / seg_mcus);
+	}
+
+	return p - out;
+}
@@ -8,6 +8,11 @@
 #include "usb_descriptors.h"
 #include "utils.h"
 #include "format_conversion.h"
+#include "conversion_engine.h"
+#include "jpeg_encoder.h"
+#include "rate_control.h"
+#include "h264_encoder.h"
+#include "usb_request_queue.h"
 
 #define ENABLE_LOGGING 1
 
@@ -31,8 +36,174 @@ PSP_MAIN_THREAD_ATTR(0);
 #define UVC_PAYLOAD_SIZE(frame_size)	(UVC_PAYLOAD_HEADER_SIZE + (frame_size))
 #define MAX_UVC_PAYLOAD_TRANSFER_SIZE	UVC_PAYLOAD_SIZE(MAX_UVC_VIDEO_FRAME_SIZE)
 
+/*
+ * Source lines converted between data cache writebacks, so each converted
+ * strip is flushed while it is still cached. 0 converts the whole frame
+ * before writing it back. The host benchmark's strip-height sweep
+ * (bench/bench strips) helps pick a value.
+ */
+#ifndef CONVERSION_STRIP_LINES
+#define CONVERSION_STRIP_LINES		8
+#endif
+
+/*
+ * Horizontal bands each frame is split into for the conversion executor.
+ * The plugin only has the main CPU, so the executor runs the bands inline
+ * and a single band is the default.
+ */
+#ifndef CONVERSION_BANDS
+#define CONVERSION_BANDS		1
+#endif
+
+/*
+ * Payload buffers rotating between the CPU and the USB controller, so the
+ * next frame is converted while the previous one is on the wire. Each one
+ * costs TX_BUFFER_SIZE bytes; 1 converts and sends in turn.
+ * Use the host benchmark (bench pipeline) to see what more of them buy.
+ */
+#ifndef TX_BUFFERS
+#define TX_BUFFERS			2
+#endif
+
+/*
+ * Payloads an uncompressed frame in a packed layout (YUY2, RGBP, Y800) is
+ * split into. Each is queued as soon as its rows are converted, so the
+ * frame starts going out before the last row is done. 1 sends it as one
+ * payload, as planar and compressed frames, only complete at the end,
+ * always are. Split frames are converted on a single band.
+ */
+#ifndef FRAME_PAYLOADS
+#define FRAME_PAYLOADS			8
+#endif
+
+/*
+ * Requests the streaming endpoint may have queued with the bus driver at
+ * once, from a preallocated pool. With fewer than the buffers' payloads,
+ * queuing one waits for an earlier one to complete. Isochronous payloads
+ * last one service interval each, so they get the whole pool to ride out
+ * the main thread being busy elsewhere.
+ */
+#ifndef REQUEST_QUEUE_DEPTH
+#if ENABLE_ISOC_STREAMING
+#define REQUEST_QUEUE_DEPTH		USB_REQUEST_QUEUE_MAX_DEPTH
+#else
+#define REQUEST_QUEUE_DEPTH		(TX_BUFFERS * FRAME_PAYLOADS)
+#endif
+#endif
+
+/* Frames between two bus utilization reports */
+#define BUS_STATS_FRAMES		120
+
+/* Most payloads a frame is split into; isochronous ones may hold a row each */
+#if ENABLE_ISOC_STREAMING
+#define MAX_FRAME_PAYLOADS		CONVERSION_SRC_HEIGHT
+#else
+#define MAX_FRAME_PAYLOADS		FRAME_PAYLOADS
+#endif
+
+/* A frame, plus each payload's header and the padding keeping it aligned */
+#define TX_BUFFER_SIZE	(MAX_UVC_VIDEO_FRAME_SIZE + MAX_FRAME_PAYLOADS * (UVC_PAYLOAD_HEADER_SIZE + 64))
+
+/*
+ * Skip converting source rows whose fingerprint matches the previous frame.
+ * The cache is dropped every ROW_CACHE_REFRESH_FRAMES frames so a missed
+ * change (fingerprint collision) can't stay on screen for long.
+ */
+#define ENABLE_ROW_CACHE		1
+#define ROW_CACHE_REFRESH_FRAMES	60
+
+/*
+ * Resend the previous payload untouched (only the FID toggles) when the
+ * LCDC base address and a fingerprint of every framebuffer row are the
+ * same as last frame. A sampled fingerprint is taken first, so frames
+ * that changed on the sampled rows skip the full one.
+ *
+ * With STATIC_RATE_DROP_AFTER > 0, once the screen has been static for that
+ * many frames only every STATIC_RATE_DIVIDER-th frame is sent, until the
+ * first change brings it back to full rate.
+ */
+#define ENABLE_STATIC_FRAME_REUSE	1
+#define STATIC_RATE_DROP_AFTER		120
+#define STATIC_RATE_DIVIDER		4
+
+/*
+ * Copy the coded bits of restart intervals whose pixels did not change
+ * from the previous MJPEG frame instead of encoding them again. Dropped
+ * every MJPEG_CACHE_REFRESH_FRAMES frames like the row cache.
+ */
+#define ENABLE_MJPEG_SEGMENT_CACHE	1
+#define MJPEG_CACHE_REFRESH_FRAMES	60
+
+/*
+ * Slices each MJPEG frame is split into, joined at restart markers. Like
+ * the conversion bands they run on the inline executor, so one slice is
+ * the default until there is a second processor to hand them to.
+ */
+#ifndef MJPEG_SLICES
+#define MJPEG_SLICES			1
+#endif
+
+/*
+ * Adjust the MJPEG quality after every encoded frame so that sending it
+ * takes at most MJPEG_SEND_BUDGET_PERCENT of the frame interval and, when
+ * MJPEG_TARGET_BITRATE (bits per second) is non-zero, fits that bitrate.
+ * R + Up / R + Down move the send budget by MJPEG_SEND_BUDGET_STEP percent
+ * while streaming. A host that sets wCompQuality (and its bmHint bit) gets
+ * that quality fixed instead.
+ */
+#define ENABLE_MJPEG_RATE_CONTROL	1
+#define MJPEG_TARGET_BITRATE		0
+#define MJPEG_SEND_BUDGET_PERCENT	50
+#define MJPEG_SEND_BUDGET_STEP		10
+#define MJPEG_MIN_QUALITY		20
+#define MJPEG_MAX_QUALITY		95
+
+/*
+ * Frames between H.264 IDR pictures. Unchanged macroblocks are only
+ * compared by fingerprint, so this also bounds how long a missed change
+ * can stay on screen.
+ */
+#define H264_IDR_INTERVAL		H264_DEFAULT_IDR_INTERVAL
+
+/*
+ * Colour matrix and range of the YUV formats and H.264, one of enum
+ * conversion_color. The tables are switched to it when a stream starts.
+ * Hosts read the matrix from the colour matching descriptors (and H.264
+ * decoders from the SPS, range included) at enumeration, so it is fixed
+ * per build. UVC descriptors have no field for the range; hosts assume
+ * limited range for YUV. MJPEG is always JFIF's full-range BT.601.
+ */
+#define COLOR_SPACE			CONVERSION_COLOR_BT601_LIMITED
+
+#define RATE_UP_MASK	(PSP_CTRL_RTRIGGER | PSP_CTRL_UP)
+#define RATE_DOWN_MASK	(PSP_CTRL_RTRIGGER | PSP_CTRL_DOWN)
+
+/* bmHint bit asking for wCompQuality to be kept as set */
+#define UVC_HINT_COMP_QUALITY	(1 << 3)
+
+/*
+ * Processing Unit controls: minimum, maximum, resolution and default as
+ * reported to the host. Hue is in hundredths of a degree as UVC has it,
+ * the rest in the units of struct conversion_adjust.
+ */
+static const struct {
+	unsigned char selector;
+	short min, max, res, def;
+} pu_controls[] = {
+	{ UVC_PU_BRIGHTNESS_CONTROL, -128,   127,   1,   0 },
+	{ UVC_PU_CONTRAST_CONTROL,      0,   200,   1, 100 },
+	{ UVC_PU_HUE_CONTROL,      -18000, 18000, 100,   0 },
+	{ UVC_PU_SATURATION_CONTROL,    0,   200,   1, 100 },
+};
+
+#define PU_CONTROL_COUNT	(sizeof(pu_controls) / sizeof(pu_controls[0]))
+
 #define EVENT_STOP_STREAM	(1u << 0)
-#define EVENT_FRAME_SENT	(1u << 1)
+/* Set while transmit buffer i belongs to the CPU */
+#define EVENT_TX_FREE(i)	(1u << (1 + (i)))
+#define EVENT_TX_FREE_ALL	(((1u << TX_BUFFERS) - 1) << 1)
+/* Set when a request goes back to the frame_queue pool */
+#define EVENT_REQUEST_FREE	(1u << (1 + TX_BUFFERS))
 
 struct uvc_frame {
 	unsigned char header[UVC_PAYLOAD_HEADER_SIZE];
@@ -51,7 +222,7 @@ static const struct uvc_streaming_control uvc_probe_control_setting_default = {
 	.wDelay				= 0,
 	.dwMaxVideoFrameSize		= MAX_UVC_VIDEO_FRAME_SIZE,
 	.dwMaxPayloadTransferSize	= MAX_UVC_PAYLOAD_TRANSFER_SIZE,
-	.dwClockFrequency		= 0,
+	.dwClockFrequency		= UVC_CLOCK_FREQUENCY,
 	.bmFramingInfo			= 0,
 	.bPreferedVersion		= 1,
 	.bMinVersion			= 0,
@@ -59,6 +230,8 @@ static const struct uvc_streaming_control uvc_probe_control_setting_default = {
 };
 
 static struct uvc_streaming_control uvc_probe_control_setting;
+/* What the main thread is streaming, taken from the above between frames */
+static struct uvc_streaming_control uvc_commit_control;
 
 static struct {
 	unsigned char buffer[64];
@@ -70,7 +243,89 @@ static struct {
 //static int uvc_thread_run;
 static int stream;
 static SceUID uvc_frame_req_evflag;
-static unsigned char tx_buf[MAX_UVC_PAYLOAD_TRANSFER_SIZE] __attribute__((aligned(64)));
+/* Set when attached at high speed, which has 8 service intervals per ms */
+static int usb_high_speed;
+/* Streaming interface alternate setting, and the bytes its isochronous
+ * endpoint moves per service interval (0 in setting 0) */
+static int stream_alt;
+static int isoc_payload_bytes;
+
+/*
+ * A transmit buffer and the state of sending it. The buffer belongs to the
+ * USB side from the first sceUsbbdReqSend() until the last payload's
+ * request completes, which sets its EVENT_TX_FREE bit, and to the main
+ * thread otherwise.
+ */
+struct tx_slot {
+	/* Bytes of frame data in the buffer */
+	int data_size;
+	/* Format it was sent in and whether it was a resend */
+	int format_index;
+	int reused;
+	/* Set from the send until the main thread has looked at the outcome */
+	int pending;
+	/* Payloads queued for the frame */
+	int payloads;
+	/* Payloads on the wire, plus one while the main thread is queuing */
+	int outstanding;
+	/* First error a payload completed with */
+	int error;
+	/* When the frame was read from the framebuffer, for its payloads' PTS */
+	unsigned int pts;
+	unsigned int submit_time;
+	unsigned int send_us;
+};
+
+static struct tx_slot tx_slots[TX_BUFFERS];
+static struct usb_request_queue frame_queue;
+static unsigned char tx_bufs[TX_BUFFERS][TX_BUFFER_SIZE] __attribute__((aligned(64)));
+/* How the committed format is split: rows per payload (0 if it isn't),
+ * bytes per row and bytes from one payload header to the next */
+static int payload_rows;
+static int payload_row_bytes;
+static int payload_stride;
+#if ENABLE_ISOC_STREAMING
+/*
+ * Isochronous payloads copied out of a frame too large for one, used in
+ * turn. Requests complete in order and at most REQUEST_QUEUE_DEPTH are
+ * queued, so the one after those is always done with.
+ */
+static unsigned char isoc_packets[REQUEST_QUEUE_DEPTH + 1][ISOC_MAX_INTERVAL_BYTES]
+	__attribute__((aligned(64)));
+static int isoc_next;
+#endif
+/* Buffer the next new frame goes into */
+static int tx_next;
+/* Buffer holding the last payload sent, -1 if there is none to resend */
+static int tx_last = -1;
+static struct conversion_dispatch frame_conversion;
+/* One per buffer, describing what that buffer holds */
+static struct conversion_row_cache frame_rows[TX_BUFFERS];
+static struct jpeg_encoder frame_jpeg;
+static struct jpeg_segment_cache frame_jpeg_cache;
+static struct rate_control frame_rate;
+static struct h264_encoder frame_h264;
+static int mjpeg_send_budget_percent = MJPEG_SEND_BUDGET_PERCENT;
+/* Current Processing Unit values, indexed like pu_controls */
+static short pu_values[PU_CONTROL_COUNT];
+/* Set when pu_values changed and the tables have yet to follow */
+static int pu_values_changed;
+/* Set when a format was committed (or a setting selected) and the main
+ * thread has yet to switch to it */
+static int commit_pending;
+
+/* What the last payload sent was converted from */
+static struct {
+	int valid;
+	void *fbaddr;
+	int fbstride;
+	int fbpixelformat;
+	uint32_t sample;
+	int static_frames;
+	/* Every row's fingerprint, if the frame got past the sampled check */
+	int has_fingerprint;
+	uint32_t fingerprint;
+} last_frame;
 
 static int usb_ep0_req_send(const void *data, unsigned int size)
 {
@@ -122,11 +377,15 @@ static int usb_ep0_enqueue_recv_for_req(const struct DeviceRequest *ep0_req)
 
 static int uvc_frame_req_init(void)
 {
-	uvc_frame_req_evflag = sceKernelCreateEventFlag("uvc_frame_req_evflag", 0, 0, NULL);
+	uvc_frame_req_evflag = sceKernelCreateEventFlag("uvc_frame_req_evflag", 0,
+							EVENT_TX_FREE_ALL, NULL);
 	if (uvc_frame_req_evflag < 0) {
 		return uvc_frame_req_evflag;
 	}
 
+	usb_request_queue_init(&frame_queue, &endpoints[1], REQUEST_QUEUE_DEPTH,
+			       uvc_frame_req_evflag, EVENT_REQUEST_FREE, EVENT_STOP_STREAM);
+
 	return 0;
 }
 
@@ -135,6 +394,367 @@ static int uvc_frame_req_fini(void)
 	return sceKernelDeleteEventFlag(uvc_frame_req_evflag);
 }
 
+/*
+ * Drops what the transmit buffers hold, for when the next frame can't be
+ * built on what was sent before. Transfers still in flight are left to
+ * complete, but their outcome is no longer acted on.
+ */
+static void uvc_tx_forget(void)
+{
+	int i;
+
+	for (i = 0; i < TX_BUFFERS; i++) {
+		conversion_row_cache_reset(&frame_rows[i]);
+		tx_slots[i].pending = 0;
+	}
+
+	/* Its fingerprints don't cover the colour tables either */
+	frame_jpeg_cache.valid = 0;
+	tx_last = -1;
+}
+
+#define UVC_FORMAT_FRAMES(frames) \
+	video_streaming_descriptors.frames, \
+	sizeof(video_streaming_descriptors.frames) / sizeof(video_streaming_descriptors.frames[0])
+
+/* Uncompressed formats, their frame descriptors and the layout they convert to */
+static const struct uvc_uncompressed_format {
+	int format_index;
+	int dst_format;
+	const struct UVC_FRAME_UNCOMPRESSED(2) *frames;
+	int num_frames;
+} uvc_uncompressed_formats[] = {
+	{FORMAT_INDEX_UNCOMPRESSED_YUY2, CONVERSION_DST_YUY2, UVC_FORMAT_FRAMES(frames_uncompressed_yuy2)},
+	{FORMAT_INDEX_UNCOMPRESSED_NV12, CONVERSION_DST_NV12, UVC_FORMAT_FRAMES(frames_uncompressed_nv12)},
+	{FORMAT_INDEX_UNCOMPRESSED_I420, CONVERSION_DST_I420, UVC_FORMAT_FRAMES(frames_uncompressed_i420)},
+	{FORMAT_INDEX_UNCOMPRESSED_RGBP, CONVERSION_DST_RGB565, UVC_FORMAT_FRAMES(frames_uncompressed_rgbp)},
+	{FORMAT_INDEX_UNCOMPRESSED_Y800, CONVERSION_DST_Y800, UVC_FORMAT_FRAMES(frames_uncompressed_y800)},
+};
+
+static const struct uvc_uncompressed_format *uvc_find_uncompressed_format(int format_index)
+{
+	int i;
+
+	for (i = 0; i < sizeof(uvc_uncompressed_formats) / sizeof(uvc_uncompressed_formats[0]); i++) {
+		if (uvc_uncompressed_formats[i].format_index == format_index)
+			return &uvc_uncompressed_formats[i];
+	}
+
+	return NULL;
+}
+
+static const struct UVC_FRAME_MJPEG(2) *uvc_find_frame_mjpeg(int frame_index)
+{
+	const struct UVC_FRAME_MJPEG(2) *frames = video_streaming_descriptors.frames_mjpeg;
+	int num_frames = sizeof(video_streaming_descriptors.frames_mjpeg) /
+			 sizeof(video_streaming_descriptors.frames_mjpeg[0]);
+	int i;
+
+	for (i = 0; i < num_frames; i++) {
+		if (frames[i].bFrameIndex == frame_index)
+			return &frames[i];
+	}
+
+	return &frames[0];
+}
+
+static const struct UVC_FRAME_UNCOMPRESSED(2) *
+uvc_find_frame(const struct uvc_uncompressed_format *format, int frame_index)
+{
+	int i;
+
+	for (i = 0; i < format->num_frames; i++) {
+		if (format->frames[i].bFrameIndex == frame_index)
+			return &format->frames[i];
+	}
+
+	return &format->frames[0];
+}
+
+static const struct UVC_FRAME_FRAME_BASED(2) *uvc_find_frame_h264(int frame_index)
+{
+	const struct UVC_FRAME_FRAME_BASED(2) *frames = video_streaming_descriptors.frames_h264;
+	int num_frames = sizeof(video_streaming_descriptors.frames_h264) /
+			 sizeof(video_streaming_descriptors.frames_h264[0]);
+	int i;
+
+	for (i = 0; i < num_frames; i++) {
+		if (frames[i].bFrameIndex == frame_index)
+			return &frames[i];
+	}
+
+	return &frames[0];
+}
+
+/*
+ * Derives the per-frame targets of the MJPEG rate control from the frame
+ * interval (in 100 ns units).
+ */
+static void uvc_update_rate_target(void)
+{
+	unsigned int interval_us = uvc_commit_control.dwFrameInterval / 10;
+	int target_bytes = (long long)MJPEG_TARGET_BITRATE * interval_us / (8 * 1000000);
+
+	rate_control_set_target(&frame_rate, target_bytes,
+				interval_us * mjpeg_send_budget_percent / 100);
+}
+
+/*
+ * Rows of a width x height frame that go in each payload, 0 to send it as
+ * one. Payloads other than the last are dwMaxPayloadTransferSize long and
+ * end the host's transfer by filling it; the last must then end in a short
+ * packet, so enough rows go in each that it does.
+ *
+ * Isochronous payloads are as many rows as one service interval takes; a
+ * frame whose rows don't fit is sent as one and copied out in pieces.
+ */
+static int uvc_payload_rows(int dst_format, int width, int height)
+{
+	int row_bytes = format_conversion_row_bytes(dst_format, width);
+	int rows, last;
+
+	if (ENABLE_ISOC_STREAMING && row_bytes) {
+		rows = (isoc_payload_bytes - UVC_PAYLOAD_HEADER_SIZE) / row_bytes;
+		return rows > 0 && rows < height ? rows : 0;
+	}
+
+	if (FRAME_PAYLOADS <= 1 || !row_bytes)
+		return 0;
+
+	for (rows = (height + FRAME_PAYLOADS - 1) / FRAME_PAYLOADS; rows < height; rows++) {
+		last = height - (height - 1) / rows * rows;
+		if (last == rows || UVC_PAYLOAD_SIZE(last * row_bytes) % endpdesc_full[0].wMaxPacketSize)
+			return rows;
+	}
+
+	return 0;
+}
+
+/*
+ * Resolves the converters for the committed format and frame size, so that
+ * sending a frame only has to index them by the current source layout.
+ * Returns the conversion_color the tables have to be switched to for it.
+ */
+static int uvc_select_conversion(void)
+{
+	const struct uvc_uncompressed_format *format;
+	struct usb_request_queue_stats bus_stats;
+	int color = COLOR_SPACE;
+	int intr;
+
+	/* The host may probe again meanwhile */
+	intr = sceKernelCpuSuspendIntr();
+	uvc_commit_control = uvc_probe_control_setting;
+	sceKernelCpuResumeIntr(intr);
+
+	format = uvc_find_uncompressed_format(uvc_commit_control.bFormatIndex);
+	payload_rows = 0;
+
+	if (format) {
+		const struct UVC_FRAME_UNCOMPRESSED(2) *frame =
+			uvc_find_frame(format, uvc_commit_control.bFrameIndex);
+
+		format_conversion_select(&frame_conversion, format->dst_format,
+					 frame->wWidth, frame->wHeight);
+
+		payload_rows = uvc_payload_rows(format->dst_format, frame->wWidth, frame->wHeight);
+		payload_row_bytes = format_conversion_row_bytes(format->dst_format, frame->wWidth);
+		/* Payloads start on a cache line, like the buffer */
+		payload_stride = (UVC_PAYLOAD_SIZE(payload_rows * payload_row_bytes) + 63) & ~63;
+	} else if (uvc_commit_control.bFormatIndex == FORMAT_INDEX_MJPEG) {
+		const struct UVC_FRAME_MJPEG(2) *frame =
+			uvc_find_frame_mjpeg(uvc_commit_control.bFrameIndex);
+
+		/* The encoder pulls YUY2 rows at the output size */
+		format_conversion_select(&frame_conversion, CONVERSION_DST_YUY2,
+					 frame->wWidth, frame->wHeight);
+		color = JPEG_COLOR;
+
+		if (uvc_commit_control.bmHint & UVC_HINT_COMP_QUALITY) {
+			int quality = (uvc_commit_control.wCompQuality + 50) / 100;
+
+			if (quality < 1)
+				quality = 1;
+			rate_control_init(&frame_rate, quality, quality, quality);
+		} else if (ENABLE_MJPEG_RATE_CONTROL) {
+			rate_control_init(&frame_rate, JPEG_DEFAULT_QUALITY,
+					  MJPEG_MIN_QUALITY, MJPEG_MAX_QUALITY);
+			uvc_update_rate_target();
+		} else {
+			rate_control_init(&frame_rate, JPEG_DEFAULT_QUALITY,
+					  JPEG_DEFAULT_QUALITY, JPEG_DEFAULT_QUALITY);
+		}
+
+		jpeg_encoder_setup(&frame_jpeg, frame->wWidth, frame->wHeight, frame_rate.quality);
+		jpeg_encoder_set_cache(&frame_jpeg,
+				       ENABLE_MJPEG_SEGMENT_CACHE ? &frame_jpeg_cache : NULL);
+		jpeg_encoder_set_slices(&frame_jpeg, &conversion_executor_inline, MJPEG_SLICES);
+	} else if (uvc_commit_control.bFormatIndex == FORMAT_INDEX_H264) {
+		const struct UVC_FRAME_FRAME_BASED(2) *frame =
+			uvc_find_frame_h264(uvc_commit_control.bFrameIndex);
+
+		format_conversion_select(&frame_conversion, CONVERSION_DST_YUY2,
+					 frame->wWidth, frame->wHeight);
+		/* Frames go out at the display rate whatever the interval, so the fastest one sets the level */
+		h264_encoder_setup(&frame_h264, frame->wWidth, frame->wHeight,
+				   10000000 / frame->dwFrameInterval[0], H264_IDR_INTERVAL);
+		h264_encoder_set_color(&frame_h264, COLOR_SPACE);
+	}
+
+	uvc_tx_forget();
+	last_frame.valid = 0;
+
+	/* Bus statistics start over with the stream */
+	usb_request_queue_stats(&frame_queue, &bus_stats);
+
+	return color;
+}
+
+/* Bytes per service interval of the largest isochronous tier at this speed */
+static int uvc_isoc_max_payload(void)
+{
+	const struct EndpointDescriptor *endpdesc = usb_high_speed ? endpdesc_hi : endpdesc_full;
+
+	return ISOC_INTERVAL_BYTES(endpdesc[0].wMaxPacketSize);
+}
+
+/* Bytes per service interval of an isochronous alternate setting */
+static int uvc_isoc_alt_payload(int alt)
+{
+	const struct InterfaceDescriptor *interdesc = usb_high_speed ? interdesc_hi : interdesc_full;
+
+	if (alt < 1 || alt > ISOC_ALT_SETTINGS)
+		return 0;
+
+	return ISOC_INTERVAL_BYTES(interdesc[STREAM_INTERFACE + alt].endpoints->wMaxPacketSize);
+}
+
+/*
+ * Bandwidth the committed stream needs, as the payload it sends every
+ * service interval, for the host to pick a tier with: the frame spread
+ * over the intervals of one frame interval, in whole rows if it is split
+ * by rows. Compressed frames are sized by their buffer, so they ask for
+ * the largest tier.
+ */
+static int uvc_isoc_payload_size(int frame_size, int row_bytes)
+{
+	int per_second = usb_high_speed ? 8000 : 1000;
+	int intervals = (long long)uvc_probe_control_setting.dwFrameInterval * per_second / 10000000;
+	int size;
+
+	if (intervals < 1)
+		intervals = 1;
+
+	if (row_bytes) {
+		int rows = frame_size / row_bytes;
+
+		size = (rows + intervals - 1) / intervals * row_bytes;
+	} else {
+		size = (frame_size + intervals - 1) / intervals;
+	}
+
+	size = UVC_PAYLOAD_SIZE(size);
+
+	return size < uvc_isoc_max_payload() ? size : uvc_isoc_max_payload();
+}
+
+/* Longest wait for the transmit buffers before switching formats anyway */
+#define COMMIT_DRAIN_TIMEOUT_US		1000000
+
+/*
+ * Switches to the committed format in the main thread, between frames, so
+ * that the converters, payload layout and tables never change under a
+ * frame being converted. Buffers still on the bus were laid out for the
+ * old format, so they are waited for first.
+ */
+static void uvc_apply_commit(void)
+{
+	SceUInt timeout = COMMIT_DRAIN_TIMEOUT_US;
+	unsigned int event;
+
+	commit_pending = 0;
+
+	sceKernelWaitEventFlagCB(uvc_frame_req_evflag, EVENT_TX_FREE_ALL, PSP_EVENT_WAITAND,
+				 &event, &timeout);
+
+	if (ENABLE_ISOC_STREAMING)
+		isoc_payload_bytes = uvc_isoc_alt_payload(stream_alt);
+
+	/* Rebuilds the tables shared by every converter; nothing is converting now */
+	format_conversion_set_color(uvc_select_conversion());
+}
+
+/*
+ * Takes the format, frame and interval the host asked for and fills in the
+ * frame and payload sizes that go with them.
+ */
+static void uvc_update_probe_control_setting(const struct uvc_streaming_control *streaming_control)
+{
+	const struct uvc_uncompressed_format *format;
+	const struct UVC_FRAME_UNCOMPRESSED(2) *frame;
+	int payload_size = 0;
+	int row_bytes = 0;
+
+	uvc_probe_control_setting.bFormatIndex = streaming_control->bFormatIndex;
+	uvc_probe_control_setting.bFrameIndex = streaming_control->bFrameIndex;
+	uvc_probe_control_setting.dwFrameInterval = streaming_control->dwFrameInterval;
+
+	format = uvc_find_uncompressed_format(uvc_probe_control_setting.bFormatIndex);
+	if (format) {
+		frame = uvc_find_frame(format, uvc_probe_control_setting.bFrameIndex);
+		uvc_probe_control_setting.bFrameIndex = frame->bFrameIndex;
+		uvc_probe_control_setting.dwMaxVideoFrameSize =
+			format_conversion_frame_size(format->dst_format, frame->wWidth, frame->wHeight);
+		row_bytes = format_conversion_row_bytes(format->dst_format, frame->wWidth);
+		payload_size = uvc_payload_rows(format->dst_format, frame->wWidth, frame->wHeight) *
+			       row_bytes;
+	} else if (uvc_probe_control_setting.bFormatIndex == FORMAT_INDEX_MJPEG) {
+		const struct UVC_FRAME_MJPEG(2) *mjpeg_frame =
+			uvc_find_frame_mjpeg(uvc_probe_control_setting.bFrameIndex);
+
+		uvc_probe_control_setting.bFrameIndex = mjpeg_frame->bFrameIndex;
+		uvc_probe_control_setting.dwMaxVideoFrameSize = mjpeg_frame->dwMaxVideoFrameBufferSize;
+
+		/* wCompQuality is 0 to 10000; only a hinted one is kept */
+		uvc_probe_control_setting.bmHint = streaming_control->bmHint & UVC_HINT_COMP_QUALITY;
+		if (streaming_control->wCompQuality && streaming_control->wCompQuality <= 10000)
+			uvc_probe_control_setting.wCompQuality = streaming_control->wCompQuality;
+		else
+			uvc_probe_control_setting.bmHint = 0;
+	} else if (uvc_probe_control_setting.bFormatIndex == FORMAT_INDEX_H264) {
+		const struct UVC_FRAME_FRAME_BASED(2) *h264_frame =
+			uvc_find_frame_h264(uvc_probe_control_setting.bFrameIndex);
+
+		/* Frame-based frame descriptors carry no buffer size */
+		uvc_probe_control_setting.bFrameIndex = h264_frame->bFrameIndex;
+		uvc_probe_control_setting.dwMaxVideoFrameSize =
+			VIDEO_FRAME_SIZE_H264(h264_frame->wWidth, h264_frame->wHeight);
+	}
+
+	if (ENABLE_ISOC_STREAMING) {
+		uvc_probe_control_setting.dwMaxPayloadTransferSize =
+			uvc_isoc_payload_size(uvc_probe_control_setting.dwMaxVideoFrameSize, row_bytes);
+		return;
+	}
+
+	if (!payload_size)
+		payload_size = uvc_probe_control_setting.dwMaxVideoFrameSize;
+
+	uvc_probe_control_setting.dwMaxPayloadTransferSize = UVC_PAYLOAD_SIZE(payload_size);
+}
+
+/*
+ * Fills in wCompQuality for GET_CUR: the MJPEG quality the rate control is
+ * encoding at, unless the host fixed it.
+ */
+static void uvc_report_comp_quality(void)
+{
+	if (uvc_probe_control_setting.bFormatIndex != FORMAT_INDEX_MJPEG)
+		uvc_probe_control_setting.wCompQuality = 0;
+	else if (!(uvc_probe_control_setting.bmHint & UVC_HINT_COMP_QUALITY))
+		uvc_probe_control_setting.wCompQuality = frame_rate.quality * 100;
+}
+
 static void uvc_handle_video_streaming_req_recv(const struct DeviceRequest *req)
 {
 	struct uvc_streaming_control *streaming_control =
@@ -144,11 +764,10 @@ static void uvc_handle_video_streaming_req_recv(const struct DeviceRequest *req)
 	case UVC_VS_PROBE_CONTROL:
 		switch (req->bRequest) {
 		case UVC_SET_CUR:
-			uvc_probe_control_setting.bFormatIndex = streaming_control->bFormatIndex;
-			uvc_probe_control_setting.bFrameIndex = streaming_control->bFrameIndex;
-			uvc_probe_control_setting.dwFrameInterval = streaming_control->dwFrameInterval;
-			LOG("Probe SET_CUR, bFormatIndex: %d, bmFramingInfo: %x\n",
+			uvc_update_probe_control_setting(streaming_control);
+			LOG("Probe SET_CUR, bFormatIndex: %d, bFrameIndex: %d, bmFramingInfo: %x\n",
 			    uvc_probe_control_setting.bFormatIndex,
+			    uvc_probe_control_setting.bFrameIndex,
 			    uvc_probe_control_setting.bmFramingInfo);
 			break;
 		}
@@ -156,14 +775,18 @@ static void uvc_handle_video_streaming_req_recv(const struct DeviceRequest *req)
 	case UVC_VS_COMMIT_CONTROL:
 		switch (req->bRequest) {
 		case UVC_SET_CUR:
-			uvc_probe_control_setting.bFormatIndex = streaming_control->bFormatIndex;
-			uvc_probe_control_setting.bFrameIndex = streaming_control->bFrameIndex;
-			uvc_probe_control_setting.dwFrameInterval = streaming_control->dwFrameInterval;
-			LOG("Commit SET_CUR, bFormatIndex: %d, bmFramingInfo: %x\n",
+			uvc_update_probe_control_setting(streaming_control);
+			LOG("Commit SET_CUR, bFormatIndex: %d, bFrameIndex: %d, bmFramingInfo: %x\n",
 			    uvc_probe_control_setting.bFormatIndex,
+			    uvc_probe_control_setting.bFrameIndex,
 			    uvc_probe_control_setting.bmFramingInfo);
 
+			/* Isochronous streams start with their alternate setting */
+			if (ENABLE_ISOC_STREAMING)
+				break;
+
 			LOG("Start streaming!\n");
+			commit_pending = 1;
 			stream = 1;
 			//sceKernelSetEventFlag(uvc_event_flag_id, 1);
 			break;
@@ -172,9 +795,49 @@ static void uvc_handle_video_streaming_req_recv(const struct DeviceRequest *req)
 	}
 }
 
+static int uvc_find_pu_control(int selector)
+{
+	int i;
+
+	for (i = 0; i < PU_CONTROL_COUNT; i++) {
+		if (pu_controls[i].selector == selector)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Stores a SET_CUR value for the main loop to fold into the conversion
+ * tables between frames, so no frame is converted with half-built ones.
+ */
+static void uvc_handle_processing_unit_req_recv(const struct DeviceRequest *req)
+{
+	int i = uvc_find_pu_control(req->wValue >> 8);
+	int value;
+
+	if (i < 0 || req->wLength < 2)
+		return;
+
+	value = (short)(pending_recv.buffer[0] | (pending_recv.buffer[1] << 8));
+	if (value < pu_controls[i].min)
+		value = pu_controls[i].min;
+	if (value > pu_controls[i].max)
+		value = pu_controls[i].max;
+
+	LOG("PU SET_CUR, control: %d, value: %d\n", pu_controls[i].selector, value);
+
+	pu_values[i] = value;
+	pu_values_changed = 1;
+}
+
 void usb_ep0_req_recv_on_complete(struct UsbbdDeviceRequest *req)
 {
 	switch (pending_recv.ep0_req.wIndex & 0xFF) {
+	case CONTROL_INTERFACE:
+		if ((pending_recv.ep0_req.wIndex >> 8) == PROCESSING_UNIT_ID)
+			uvc_handle_processing_unit_req_recv(&pending_recv.ep0_req);
+		break;
 	case STREAM_INTERFACE:
 		uvc_handle_video_streaming_req_recv(&pending_recv.ep0_req);
 		break;
@@ -186,6 +849,46 @@ static void uvc_handle_interface_ctrl_req(const struct DeviceRequest *req)
 	LOG("  uvc_handle_interface_ctrl_req\n");
 }
 
+static void uvc_handle_processing_unit_req(const struct DeviceRequest *req)
+{
+	static short reply;
+	int i = uvc_find_pu_control(req->wValue >> 8);
+
+	LOG("  uvc_handle_processing_unit_req %x, %x\n", req->wValue, req->bRequest);
+
+	if (i < 0)
+		return;
+
+	switch (req->bRequest) {
+	case UVC_GET_INFO:
+		reply = UVC_CONTROL_CAP_GET | UVC_CONTROL_CAP_SET;
+		usb_ep0_req_send(&reply, 1);
+		return;
+	case UVC_GET_CUR:
+		reply = pu_values[i];
+		break;
+	case UVC_GET_MIN:
+		reply = pu_controls[i].min;
+		break;
+	case UVC_GET_MAX:
+		reply = pu_controls[i].max;
+		break;
+	case UVC_GET_RES:
+		reply = pu_controls[i].res;
+		break;
+	case UVC_GET_DEF:
+		reply = pu_controls[i].def;
+		break;
+	case UVC_SET_CUR:
+		usb_ep0_enqueue_recv_for_req(req);
+		return;
+	default:
+		return;
+	}
+
+	usb_ep0_req_send(&reply, sizeof(reply));
+}
+
 static void uvc_handle_input_terminal_req(const struct DeviceRequest *req)
 {
 	LOG("  uvc_handle_input_terminal_req %x, %x\n", req->wValue, req->bRequest);
@@ -217,6 +920,7 @@ static void uvc_handle_video_streaming_req(const struct DeviceRequest *req)
 					 sizeof(uvc_probe_control_setting_default));
 			break;
 		case UVC_GET_CUR:
+			uvc_report_comp_quality();
 			LOG("Probe GET_CUR, bFormatIndex: %d, bmFramingInfo: %x\n",
 			    uvc_probe_control_setting.bFormatIndex,
 			    uvc_probe_control_setting.bmFramingInfo);
@@ -235,6 +939,7 @@ static void uvc_handle_video_streaming_req(const struct DeviceRequest *req)
 		case UVC_GET_LEN:
 			break;
 		case UVC_GET_CUR:
+			uvc_report_comp_quality();
 			usb_ep0_req_send(&uvc_probe_control_setting,
 					 sizeof(uvc_probe_control_setting));
 			break;
@@ -253,19 +958,50 @@ static void uvc_handle_video_abort(void)
 	if (stream) {
 		stream = 0;
 
-		sceUsbbdClearFIFO(&endpoints[1]);
-		sceUsbbdReqCancelAll(&endpoints[1]);
+		/* Cancelled payloads complete with an error, handing their buffers back */
+		usb_request_queue_cancel(&frame_queue);
 	}
 }
 
+/*
+ * Setting 0 of the streaming interface stops the stream. With isochronous
+ * endpoints any other starts it with the committed format, on that
+ * setting's bandwidth tier. The bus driver's setting change callback and
+ * the SET_INTERFACE request may both report it, so a repeat is ignored.
+ */
+static void uvc_select_stream_alt(int alt)
+{
+	LOG("uvc_select_stream_alt %d\n", alt);
+
+	if (alt == 0 || !ENABLE_ISOC_STREAMING) {
+		if (alt == 0)
+			uvc_handle_video_abort();
+		return;
+	}
+
+	if (stream && alt == stream_alt)
+		return;
+
+	uvc_handle_video_abort();
+
+	if (!uvc_isoc_alt_payload(alt))
+		return;
+	stream_alt = alt;
+
+	/* Payloads are cut to the tier once the main thread switches */
+	LOG("Start streaming, %d bytes per interval!\n", uvc_isoc_alt_payload(alt));
+	commit_pending = 1;
+	stream = 1;
+}
+
 static void usb_handle_set_interface(const struct DeviceRequest *req)
 {
 	LOG("usb_handle_set_interface %x %x\n", req->wIndex, req->wValue);
 
 	/* MAC OS sends Set Interface Alternate Setting 0 command after
 	 * stopping to stream. This application needs to stop streaming. */
-	if ((req->wIndex == STREAM_INTERFACE) && (req->wValue == 0))
-		uvc_handle_video_abort();
+	if (req->wIndex == STREAM_INTERFACE)
+		uvc_select_stream_alt(req->wValue);
 }
 
 static void usb_handle_clear_feature(const struct DeviceRequest *req)
@@ -314,6 +1050,9 @@ static int usb_process_request(int recipient, int arg, struct DeviceRequest *req
 			case OUTPUT_TERMINAL_ID:
 				uvc_handle_output_terminal_req(req);
 				break;
+			case PROCESSING_UNIT_ID:
+				uvc_handle_processing_unit_req(req);
+				break;
 			}
 			break;
 		case STREAM_INTERFACE:
@@ -357,12 +1096,20 @@ static int usb_process_request(int recipient, int arg, struct DeviceRequest *req
 static int usb_change_setting(int interfaceNumber, int alternateSetting)
 {
 	LOG("usb_change %d %d\n", interfaceNumber, alternateSetting);
+
+	if (ENABLE_ISOC_STREAMING && interfaceNumber == STREAM_INTERFACE)
+		uvc_select_stream_alt(alternateSetting);
+
 	return 0;
 }
 
 static int usb_attach(int usb_version)
 {
 	LOG("usb_attach %d\n", usb_version);
+
+	/* 2 is high speed, 1 full speed */
+	usb_high_speed = usb_version == 2;
+
 	return 0;
 }
 
@@ -410,73 +1157,474 @@ static struct UsbDriver usb_driver = {
 	.link				= NULL
 };
 
-static void uvc_frame_send_req_on_complete(struct UsbbdDeviceRequest *req)
+/*
+ * Hands the buffer back to the main thread. The send time counts from when
+ * the link could start on the frame: its queuing, or the end of the frame
+ * queued before it if that was still going out, so that waiting behind it
+ * doesn't read as a slow link.
+ */
+static void uvc_tx_complete(struct tx_slot *slot)
 {
-	sceKernelSetEventFlag(uvc_frame_req_evflag, EVENT_FRAME_SENT);
+	static unsigned int last_done;
+	unsigned int now = sceKernelGetSystemTimeLow();
+	unsigned int start = slot->submit_time;
+
+	if (slot->payloads) {
+		if ((int)(last_done - start) > 0)
+			start = last_done;
+		last_done = now;
+	}
+
+	slot->send_us = now - start;
+	sceKernelSetEventFlag(uvc_frame_req_evflag, EVENT_TX_FREE(slot - tx_slots));
 }
 
-int convert_and_send_frame_yuy2(int fid, void *fbaddr, int fbstride, int fbpixelformat)
+static void uvc_tx_payload_done(void *arg, int return_code)
 {
-	static struct UsbbdDeviceRequest req;
-	static const int eof = 1;
+	struct tx_slot *slot = arg;
+
+	if (return_code < 0 && !slot->error)
+		slot->error = return_code;
+
+	if (--slot->outstanding == 0)
+		uvc_tx_complete(slot);
+}
+
+/* Acts on how a transfer went, once its buffer is back */
+static void uvc_tx_feedback(const struct tx_slot *slot)
+{
+	int ret = slot->error;
+
+	LOG("USB send: %dus, %d bytes in %d payload%s%s\n", slot->send_us, slot->data_size,
+	    slot->payloads, slot->payloads == 1 ? "" : "s", ret < 0 ? ", failed" : "");
+
+	switch (slot->format_index) {
+	case FORMAT_INDEX_MJPEG:
+		/*
+		 * A resent frame says nothing new about the encoder, and changing the
+		 * quality throws away the segment cache, so only fresh frames count.
+		 */
+		if (!slot->reused && ret >= 0) {
+			int quality = rate_control_update(&frame_rate, slot->data_size, slot->send_us);
+
+			if (quality != frame_jpeg.quality)
+				jpeg_encoder_set_quality(&frame_jpeg, quality);
+		}
+		break;
+	case FORMAT_INDEX_H264:
+		/* The host may have missed a reference picture */
+		if (ret < 0)
+			h264_encoder_request_idr(&frame_h264);
+		break;
+	}
+}
+
+/*
+ * Takes a buffer for this frame: the last one sent again if reuse is set
+ * and it holds a frame, the next in turn otherwise. Waits for the USB side
+ * to give it back first. Returns NULL if streaming is being stopped;
+ * otherwise uvc_tx_finish() must follow, whether anything was sent or not.
+ */
+static struct tx_slot *uvc_tx_acquire(int reuse)
+{
+	struct tx_slot *slot;
 	unsigned int event;
-	unsigned int t0, t1, t2, t3;
-	int ret;
+	int i, ret;
+
+	if (reuse && tx_last >= 0) {
+		i = tx_last;
+	} else {
+		i = tx_next;
+		tx_next = (tx_next + 1) % TX_BUFFERS;
+		/* About to be overwritten */
+		if (tx_last == i)
+			tx_last = -1;
+	}
 
-	req = (struct UsbbdDeviceRequest){
-		.endpoint = &endpoints[1],
-		.data = tx_buf,
-		.size = sizeof(tx_buf),
-		.isControlRequest = 0,
-		.onComplete = uvc_frame_send_req_on_complete,
-		.transmitted = 0,
-		.returnCode = 0,
-		.next = NULL,
-		.unused = NULL,
-		.physicalAddress = NULL
-	};
+	ret = sceKernelWaitEventFlagCB(uvc_frame_req_evflag, EVENT_STOP_STREAM | EVENT_TX_FREE(i),
+	                               PSP_EVENT_WAITOR, &event, NULL);
+	if (ret < 0 || (event & EVENT_STOP_STREAM)) {
+		LOG("Received stream stop!\n");
+		return NULL;
+	}
+
+	sceKernelClearEventFlag(uvc_frame_req_evflag, ~EVENT_TX_FREE(i));
+
+	slot = &tx_slots[i];
+	if (slot->pending) {
+		slot->pending = 0;
+		uvc_tx_feedback(slot);
+	}
+
+	slot->format_index = uvc_commit_control.bFormatIndex;
+	slot->reused = reuse;
+	slot->payloads = 0;
+	slot->outstanding = 1;
+	slot->error = 0;
+	/* The frame is read from the framebuffer from here on */
+	slot->pts = sceKernelGetSystemTimeLow();
+
+	return slot;
+}
+
+/* Header of payload index in the slot's buffer, followed by its data */
+static unsigned char *uvc_tx_payload(const struct tx_slot *slot, int index)
+{
+	return &tx_bufs[slot - tx_slots][index * payload_stride];
+}
+
+static unsigned char *uvc_tx_data(const struct tx_slot *slot)
+{
+	return uvc_tx_payload(slot, 0) + UVC_PAYLOAD_HEADER_SIZE;
+}
+
+static void uvc_put_le32(unsigned char *p, unsigned int value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+}
+
+/*
+ * Fills in a payload header's SCR with the time it is queued. The bus
+ * driver doesn't expose the USB frame number, so the SOF count is taken
+ * from the same timer at the 1 kHz full-speed frames run at.
+ */
+static void uvc_stamp_scr(unsigned char *header)
+{
+	unsigned int stc = sceKernelGetSystemTimeLow();
+	unsigned int sof = stc / 1000;
+
+	uvc_put_le32(&header[6], stc);
+	header[10] = sof;
+	header[11] = (sof >> 8) & 0x07;
+}
+
+/* Queues size bytes at buf as one of the slot's transfers */
+static int uvc_tx_send(struct tx_slot *slot, void *buf, int size)
+{
+	int intr, ret;
+
+	/* Completions of earlier payloads decrement it meanwhile */
+	intr = sceKernelCpuSuspendIntr();
+	slot->outstanding++;
+	sceKernelCpuResumeIntr(intr);
+
+	ret = usb_request_queue_send(&frame_queue, buf, size, uvc_tx_payload_done, slot);
+	if (ret < 0) {
+		intr = sceKernelCpuSuspendIntr();
+		slot->outstanding--;
+		sceKernelCpuResumeIntr(intr);
+	}
+
+	return ret;
+}
+
+#if ENABLE_ISOC_STREAMING
+/*
+ * Sends the payload at buf, longer than one service interval takes, as
+ * several: each a copy of the header and as much of the data as fits, with
+ * EOF only on the last.
+ */
+static int uvc_tx_send_packets(struct tx_slot *slot, const unsigned char *buf, int data_size)
+{
+	int chunk = isoc_payload_bytes - UVC_PAYLOAD_HEADER_SIZE;
+	int offset, size, ret = 0;
+
+	for (offset = 0; offset < data_size && ret >= 0; offset += size) {
+		unsigned char *packet = isoc_packets[isoc_next];
+
+		isoc_next = (isoc_next + 1) % (REQUEST_QUEUE_DEPTH + 1);
+		size = data_size - offset < chunk ? data_size - offset : chunk;
+
+		memcpy(packet, buf, UVC_PAYLOAD_HEADER_SIZE);
+		if (offset + size < data_size)
+			packet[1] &= ~UVC_STREAM_EOF;
+		uvc_stamp_scr(packet);
+		memcpy(packet + UVC_PAYLOAD_HEADER_SIZE, buf + UVC_PAYLOAD_HEADER_SIZE + offset, size);
+
+		sceKernelDcacheWritebackRange(packet, UVC_PAYLOAD_SIZE(size));
+
+		ret = uvc_tx_send(slot, packet, UVC_PAYLOAD_SIZE(size));
+	}
 
-	tx_buf[0] = UVC_PAYLOAD_HEADER_SIZE;
-	tx_buf[1] = UVC_STREAM_EOH;
+	return ret;
+}
+#endif
+
+/*
+ * Queues the slot's next payload: a header plus data_size bytes of frame
+ * data (already written back from the data cache), without waiting for it
+ * to go out. eof marks the last payload of the frame. Every payload of a
+ * frame carries its capture time as PTS, and its own queuing time as SCR.
+ */
+static int uvc_tx_queue(struct tx_slot *slot, int fid, int data_size, int eof)
+{
+	unsigned char *buf = uvc_tx_payload(slot, slot->payloads);
+	int ret;
+
+	buf[0] = UVC_PAYLOAD_HEADER_SIZE;
+	buf[1] = UVC_STREAM_EOH | UVC_STREAM_PTS | UVC_STREAM_SCR;
 	if (fid)
-		tx_buf[1] |= UVC_STREAM_FID;
+		buf[1] |= UVC_STREAM_FID;
 	if (eof)
-		tx_buf[1] |= UVC_STREAM_EOF;
+		buf[1] |= UVC_STREAM_EOF;
+	uvc_put_le32(&buf[2], slot->pts);
+	uvc_stamp_scr(buf);
+
+	if (!slot->payloads) {
+		slot->data_size = 0;
+		slot->submit_time = sceKernelGetSystemTimeLow();
+	}
+
+#if ENABLE_ISOC_STREAMING
+	if (UVC_PAYLOAD_SIZE(data_size) > isoc_payload_bytes)
+		ret = uvc_tx_send_packets(slot, buf, data_size);
+	else
+#endif
+	{
+		sceKernelDcacheWritebackRange(buf, UVC_PAYLOAD_HEADER_SIZE);
+		ret = uvc_tx_send(slot, buf, UVC_PAYLOAD_SIZE(data_size));
+	}
+	if (ret < 0)
+		return ret;
+
+	slot->payloads++;
+	slot->data_size += data_size;
+
+	return ret;
+}
+
+/*
+ * Done queuing: the buffer goes back once the last payload completes, or
+ * right away if nothing was queued or everything already went out.
+ */
+static void uvc_tx_finish(struct tx_slot *slot)
+{
+	int intr, done;
+
+	if (slot->payloads) {
+		slot->pending = 1;
+		tx_last = slot - tx_slots;
+	}
+
+	intr = sceKernelCpuSuspendIntr();
+	done = --slot->outstanding == 0;
+	sceKernelCpuResumeIntr(intr);
+
+	if (done)
+		uvc_tx_complete(slot);
+}
+
+int convert_and_send_frame_uncompressed(int fid, void *fbaddr, int fbstride, int fbpixelformat, int reuse)
+{
+	static int frames_since_refresh;
+	struct conversion_row_cache *rows = NULL;
+	int height = frame_conversion.height;
+	struct tx_slot *slot;
+	unsigned int t0, t1;
+	int i, first, lines, ret;
+
+	reuse = reuse && tx_last >= 0;
+
+	slot = uvc_tx_acquire(reuse);
+	if (!slot)
+		return 0;
+
+	if (ENABLE_ROW_CACHE) {
+		rows = &frame_rows[slot - tx_slots];
+		if (++frames_since_refresh >= ROW_CACHE_REFRESH_FRAMES) {
+			for (i = 0; i < TX_BUFFERS; i++)
+				conversion_row_cache_reset(&frame_rows[i]);
+			frames_since_refresh = 0;
+		}
+	}
 
 	t0 = sceKernelGetSystemTimeLow();
 
-	if (fbpixelformat == PSP_DISPLAY_PIXEL_FORMAT_8888)
-		r8g8b8a8_to_yuy2(fbaddr, &tx_buf[UVC_PAYLOAD_HEADER_SIZE], fbstride, 480, 272);
-	else if (fbpixelformat == PSP_DISPLAY_PIXEL_FORMAT_565)
-		r5g6b5_to_yuy2(fbaddr, &tx_buf[UVC_PAYLOAD_HEADER_SIZE], fbstride, 480, 272);
-	else if (fbpixelformat == PSP_DISPLAY_PIXEL_FORMAT_5551)
-		r5g5b5a1_to_yuy2(fbaddr, &tx_buf[UVC_PAYLOAD_HEADER_SIZE], fbstride, 480, 272);
-	else if (fbpixelformat == PSP_DISPLAY_PIXEL_FORMAT_4444)
-		r4g4b4a4_to_yuy2(fbaddr, &tx_buf[UVC_PAYLOAD_HEADER_SIZE], fbstride, 480, 272);
+	if (!payload_rows) {
+		if (!reuse) {
+			conversion_engine_convert(&conversion_executor_inline, &frame_conversion,
+						  fbpixelformat, fbaddr, uvc_tx_data(slot), fbstride,
+						  CONVERSION_BANDS, CONVERSION_STRIP_LINES,
+						  sceKernelDcacheWritebackRange, rows);
+		}
+
+		ret = uvc_tx_queue(slot, fid, format_conversion_frame_size(frame_conversion.dst_format,
+									   frame_conversion.width,
+									   height), 1);
+	} else {
+		/* Each payload's rows go right after its header */
+		for (first = 0, ret = 0; first < height && ret >= 0; first += lines) {
+			unsigned char *data = uvc_tx_payload(slot, slot->payloads) +
+					      UVC_PAYLOAD_HEADER_SIZE;
+
+			lines = height - first < payload_rows ? height - first : payload_rows;
+
+			if (!reuse) {
+				conversion_engine_convert_rows(&frame_conversion, fbpixelformat, fbaddr,
+							       data - first * payload_row_bytes, fbstride,
+							       first, lines, CONVERSION_STRIP_LINES,
+							       sceKernelDcacheWritebackRange, rows);
+			}
 
-	sceKernelDcacheWritebackRange(tx_buf, sizeof(tx_buf));
+			ret = uvc_tx_queue(slot, fid, lines * payload_row_bytes, first + lines == height);
+		}
+	}
 
 	t1 = sceKernelGetSystemTimeLow();
 
-	LOG("Sending frame...\n");
+	uvc_tx_finish(slot);
 
-	t2 = sceKernelGetSystemTimeLow();
+	LOG("CSC: %dus, rows skipped: %d%s\n", t1 - t0,
+	    rows ? rows->rows_skipped : 0, reuse ? " (reused)" : "");
 
-	ret = sceUsbbdReqSend(&req);
-	if (ret < 0)
-		return ret;
+	return ret;
+}
 
-	ret = sceKernelWaitEventFlagCB(uvc_frame_req_evflag, EVENT_STOP_STREAM | EVENT_FRAME_SENT,
-	                               PSP_EVENT_WAITOR | PSP_EVENT_WAITCLEAR, &event, NULL);
+/*
+ * A bulk transfer that is a whole number of max-size packets and shorter
+ * than what the host asked for is only terminated by a zero-length packet.
+ * Rather than rely on one, such a frame gets a 0xFF fill byte before its
+ * EOI marker, which JPEG allows in front of any marker. The full-speed
+ * packet size divides the high-speed one, so it covers both.
+ */
+static int mjpeg_pad_payload(unsigned char *jpeg, int size)
+{
+	if ((UVC_PAYLOAD_SIZE(size) % endpdesc_full[0].wMaxPacketSize) != 0)
+		return size;
 
-	t3 = sceKernelGetSystemTimeLow();
+	jpeg[size] = jpeg[size - 1];
+	jpeg[size - 1] = jpeg[size - 2];
+	jpeg[size - 2] = 0xFF;
 
-	if (event & EVENT_STOP_STREAM)
-		LOG("Received stream stop!\n");
-	else if (event & EVENT_FRAME_SENT)
-		LOG("Frame sent!\n");
+	return size + 1;
+}
+
+int convert_and_send_frame_mjpeg(int fid, void *fbaddr, int fbstride, int fbpixelformat, int reuse)
+{
+	static int frames_since_refresh;
+	int capacity = uvc_commit_control.dwMaxVideoFrameSize;
+	struct tx_slot *slot;
+	unsigned char *jpeg;
+	unsigned int t0, t1;
+	int size, ret;
+
+	if (capacity > TX_BUFFER_SIZE - UVC_PAYLOAD_HEADER_SIZE)
+		capacity = TX_BUFFER_SIZE - UVC_PAYLOAD_HEADER_SIZE;
+
+	reuse = reuse && tx_last >= 0;
 
-	LOG("CSC: %dus, USB send: %dus\n", t1 - t0, t3 - t2);
+	slot = uvc_tx_acquire(reuse);
+	if (!slot)
+		return 0;
+
+	jpeg = uvc_tx_data(slot);
+
+	t0 = sceKernelGetSystemTimeLow();
+
+	if (reuse) {
+		size = slot->data_size;
+	} else {
+		if (ENABLE_MJPEG_SEGMENT_CACHE &&
+		    ++frames_since_refresh >= MJPEG_CACHE_REFRESH_FRAMES) {
+			frame_jpeg_cache.valid = 0;
+			frames_since_refresh = 0;
+		}
+
+		/* Keep a byte for mjpeg_pad_payload() */
+		size = jpeg_encoder_encode(&frame_jpeg, &frame_conversion, fbpixelformat,
+					   fbaddr, fbstride, jpeg, capacity - 1);
+		if (size < 0) {
+			LOG("JPEG frame over %d bytes at quality %d, dropped\n", capacity,
+			    frame_jpeg.quality);
+			jpeg_encoder_set_quality(&frame_jpeg, rate_control_overflow(&frame_rate));
+			uvc_tx_finish(slot);
+			return 0;
+		}
+
+		size = mjpeg_pad_payload(jpeg, size);
+		sceKernelDcacheWritebackRange(jpeg, size);
+	}
+
+	t1 = sceKernelGetSystemTimeLow();
+
+	ret = uvc_tx_queue(slot, fid, size, 1);
+	uvc_tx_finish(slot);
+
+	LOG("JPEG: %dus, %d bytes, quality %d, segments reused: %d/%d%s\n",
+	    t1 - t0, size, frame_jpeg.quality, frame_jpeg_cache.segments_reused,
+	    frame_jpeg_cache.segments, reuse ? " (reused)" : "");
+
+	return ret;
+}
+
+/*
+ * Same problem as mjpeg_pad_payload(); an Annex B stream may end in
+ * trailing zero bytes, so one is appended.
+ */
+static int h264_pad_payload(unsigned char *stream, int size)
+{
+	if ((UVC_PAYLOAD_SIZE(size) % endpdesc_full[0].wMaxPacketSize) != 0)
+		return size;
+
+	stream[size] = 0x00;
+
+	return size + 1;
+}
+
+/*
+ * A static frame becomes an all-P_Skip picture of a few bytes instead of
+ * a resend, since every H.264 picture has to be a new one.
+ */
+int convert_and_send_frame_h264(int fid, void *fbaddr, int fbstride, int fbpixelformat, int reuse)
+{
+	int capacity = uvc_commit_control.dwMaxVideoFrameSize;
+	struct tx_slot *slot;
+	unsigned char *stream;
+	unsigned int t0, t1;
+	int idr, size, ret;
+
+	if (capacity > TX_BUFFER_SIZE - UVC_PAYLOAD_HEADER_SIZE)
+		capacity = TX_BUFFER_SIZE - UVC_PAYLOAD_HEADER_SIZE;
+
+	slot = uvc_tx_acquire(0);
+	if (!slot)
+		return 0;
+
+	/* A failed send in the meantime may have made this an IDR */
+	idr = h264_encoder_idr_due(&frame_h264);
+	stream = uvc_tx_data(slot);
+
+	t0 = sceKernelGetSystemTimeLow();
+
+	/* Keep a byte for h264_pad_payload() */
+	if (reuse && !idr)
+		size = h264_encoder_encode_unchanged(&frame_h264, stream, capacity - 1);
+	else
+		size = h264_encoder_encode(&frame_h264, &frame_conversion, fbpixelformat,
+					   fbaddr, fbstride, stream, capacity - 1);
+	if (size < 0) {
+		LOG("H.264 frame over %d bytes, dropped\n", capacity);
+		uvc_tx_finish(slot);
+		return 0;
+	}
+
+	size = h264_pad_payload(stream, size);
+	sceKernelDcacheWritebackRange(stream, size);
+
+	t1 = sceKernelGetSystemTimeLow();
+
+	ret = uvc_tx_queue(slot, fid, size, 1);
+	uvc_tx_finish(slot);
+
+	LOG("H.264: %dus, %d bytes, %s, MBs coded: %d\n", t1 - t0, size,
+	    idr ? "IDR" : "P", frame_h264.mbs_coded);
+
+	/* The host may have missed a reference picture */
+	if (ret < 0)
+		h264_encoder_request_idr(&frame_h264);
 
 	return ret;
 }
@@ -498,9 +1646,68 @@ static void get_display_params_lcdc(void **addr, int *pixelformat, int *width, i
 		*pixelformat = PSP_DISPLAY_PIXEL_FORMAT_4444;
 }
 
+/*
+ * Returns 1 if the last payload sent can be sent again as is, 0 if the frame
+ * has to be converted, and -1 if this frame should not be sent at all.
+ */
+static int check_static_frame(void *fbaddr, int fbstride, int fbpixelformat)
+{
+	static unsigned int frame_count;
+	uint32_t sample, fingerprint;
+	int same;
+
+	if (!ENABLE_STATIC_FRAME_REUSE)
+		return 0;
+
+	frame_count++;
+
+	sample = format_conversion_frame_sample(fbaddr, fbpixelformat, fbstride,
+						CONVERSION_SRC_WIDTH, CONVERSION_SRC_HEIGHT);
+
+	same = last_frame.valid &&
+	       last_frame.fbaddr == fbaddr &&
+	       last_frame.fbstride == fbstride &&
+	       last_frame.fbpixelformat == fbpixelformat &&
+	       last_frame.sample == sample;
+
+	last_frame.valid = 1;
+	last_frame.fbaddr = fbaddr;
+	last_frame.fbstride = fbstride;
+	last_frame.fbpixelformat = fbpixelformat;
+	last_frame.sample = sample;
+
+	if (!same) {
+		last_frame.static_frames = 0;
+		last_frame.has_fingerprint = 0;
+		return 0;
+	}
+
+	/* Changes between the sampled rows only show up here, so no frame skips it */
+	fingerprint = format_conversion_frame_fingerprint(fbaddr, fbpixelformat, fbstride,
+							  CONVERSION_SRC_WIDTH, CONVERSION_SRC_HEIGHT);
+	same = last_frame.has_fingerprint && last_frame.fingerprint == fingerprint;
+	last_frame.has_fingerprint = 1;
+	last_frame.fingerprint = fingerprint;
+
+	if (!same) {
+		last_frame.static_frames = 0;
+		return 0;
+	}
+
+	last_frame.static_frames++;
+
+	if (STATIC_RATE_DROP_AFTER > 0 &&
+	    last_frame.static_frames >= STATIC_RATE_DROP_AFTER &&
+	    (frame_count % STATIC_RATE_DIVIDER) != 0)
+		return -1;
+
+	return 1;
+}
+
 static int send_frame(void)
 {
 	static int fid = 0;
+	static int frames_since_stats;
 
 	int ret;
 	void *fbaddr;
@@ -517,16 +1724,45 @@ static int send_frame(void)
 
 	LOG("FB addr: %p, w: %d, stride: %d, pxlfmt: %d\n", fbaddr, fbwidth, fbstride, fbpixelformat);
 
-	switch (uvc_probe_control_setting.bFormatIndex) {
-	case FORMAT_INDEX_UNCOMPRESSED_YUY2: {
-		//const struct UVC_FRAME_UNCOMPRESSED(2) *frames =
-		//	video_streaming_descriptors.frames_uncompressed_yuy2;
-		//int dst_width = frames[uvc_probe_control_setting.bFrameIndex - 1].wWidth;
-		//int dst_height = frames[uvc_probe_control_setting.bFrameIndex - 1].wHeight;
+	switch (uvc_commit_control.bFormatIndex) {
+	case FORMAT_INDEX_UNCOMPRESSED_YUY2:
+	case FORMAT_INDEX_UNCOMPRESSED_NV12:
+	case FORMAT_INDEX_UNCOMPRESSED_I420:
+	case FORMAT_INDEX_UNCOMPRESSED_RGBP:
+	case FORMAT_INDEX_UNCOMPRESSED_Y800: {
+		int reuse = check_static_frame(fbaddr, fbstride, fbpixelformat);
+		if (reuse < 0)
+			return 0;
+
+		ret = convert_and_send_frame_uncompressed(fid, fbaddr, fbstride, fbpixelformat, reuse);
+		if (ret < 0) {
+			LOG("Error sending uncompressed frame: 0x%08X\n", ret);
+			return ret;
+		}
+
+		break;
+	}
+	case FORMAT_INDEX_MJPEG: {
+		int reuse = check_static_frame(fbaddr, fbstride, fbpixelformat);
+		if (reuse < 0)
+			return 0;
 
-		ret = convert_and_send_frame_yuy2(fid, fbaddr, fbstride, fbpixelformat);
+		ret = convert_and_send_frame_mjpeg(fid, fbaddr, fbstride, fbpixelformat, reuse);
 		if (ret < 0) {
-			LOG("Error sending YUY2 frame: 0x%08X\n", ret);
+			LOG("Error sending MJPEG frame: 0x%08X\n", ret);
+			return ret;
+		}
+
+		break;
+	}
+	case FORMAT_INDEX_H264: {
+		int reuse = check_static_frame(fbaddr, fbstride, fbpixelformat);
+		if (reuse < 0)
+			return 0;
+
+		ret = convert_and_send_frame_h264(fid, fbaddr, fbstride, fbpixelformat, reuse);
+		if (ret < 0) {
+			LOG("Error sending H.264 frame: 0x%08X\n", ret);
 			return ret;
 		}
 
@@ -541,11 +1777,92 @@ static int send_frame(void)
 
 	fid ^= 1;
 
+	if (++frames_since_stats >= BUS_STATS_FRAMES) {
+		struct usb_request_queue_stats stats;
+
+		usb_request_queue_stats(&frame_queue, &stats);
+		if (stats.elapsed_us) {
+			LOG("USB bus: %d%% busy, %d KB/s\n",
+			    (int)((unsigned long long)stats.busy_us * 100 / stats.elapsed_us),
+			    (int)((unsigned long long)stats.bytes * 1000 / 1024 / stats.elapsed_us));
+		}
+		frames_since_stats = 0;
+	}
+
 	return 0;
 }
 
+/* Advertises color's matrix in the colour matching descriptor of a format */
+static void uvc_set_color_matching(struct uvc_color_matching_descriptor *desc, int color)
+{
+	desc->bColorPrimaries = UVC_COLOR_PRIMARIES_BT709;
+	desc->bTransferCharacteristics = UVC_TRANSFER_BT709;
+	desc->bMatrixCoefficients = CONVERSION_COLOR_IS_BT709(color) ?
+				    UVC_MATRIX_BT709 : UVC_MATRIX_SMPTE170M;
+}
+
+/*
+ * Rebuilds the conversion tables from the Processing Unit values. Rows and
+ * payloads converted with the old tables can't be reused after that.
+ */
+static void uvc_apply_pu_values(void)
+{
+	struct conversion_adjust adjust;
+	int i;
+
+	pu_values_changed = 0;
+
+	for (i = 0; i < PU_CONTROL_COUNT; i++) {
+		switch (pu_controls[i].selector) {
+		case UVC_PU_BRIGHTNESS_CONTROL:
+			adjust.brightness = pu_values[i];
+			break;
+		case UVC_PU_CONTRAST_CONTROL:
+			adjust.contrast = pu_values[i];
+			break;
+		case UVC_PU_HUE_CONTROL:
+			adjust.hue = pu_values[i] / 100;
+			break;
+		case UVC_PU_SATURATION_CONTROL:
+			adjust.saturation = pu_values[i];
+			break;
+		}
+	}
+
+	format_conversion_set_adjust(&adjust);
+
+	uvc_tx_forget();
+	last_frame.valid = 0;
+}
+
+/* Moves the MJPEG send budget on R + Up / R + Down presses */
+static void handle_rate_buttons(unsigned int buttons)
+{
+	static unsigned int old_buttons;
+	unsigned int pressed = buttons & ~old_buttons;
+	int percent = mjpeg_send_budget_percent;
+
+	old_buttons = buttons;
+
+	if ((buttons & RATE_UP_MASK) == RATE_UP_MASK && (pressed & RATE_UP_MASK))
+		percent += MJPEG_SEND_BUDGET_STEP;
+	else if ((buttons & RATE_DOWN_MASK) == RATE_DOWN_MASK && (pressed & RATE_DOWN_MASK))
+		percent -= MJPEG_SEND_BUDGET_STEP;
+
+	if (percent < MJPEG_SEND_BUDGET_STEP || percent > 100 || percent == mjpeg_send_budget_percent)
+		return;
+
+	mjpeg_send_budget_percent = percent;
+	if (frame_rate.min_quality != frame_rate.max_quality)
+		uvc_update_rate_target();
+
+	LOG("MJPEG send budget: %d%% of the frame interval\n", percent);
+}
+
 int main(int argc, char *argv[])
 {
+	int i;
+
 #if ENABLE_LOGGING == 1
 	pspDebugScreenInit();
 #endif
@@ -553,6 +1870,13 @@ int main(int argc, char *argv[])
 
 	LOG("UVC. USB Video Class\n");
 
+	format_conversion_init();
+	for (i = 0; i < PU_CONTROL_COUNT; i++)
+		pu_values[i] = pu_controls[i].def;
+	jpeg_encoder_init();
+	rate_control_init(&frame_rate, JPEG_DEFAULT_QUALITY, JPEG_DEFAULT_QUALITY,
+			  JPEG_DEFAULT_QUALITY);
+
 	LOG("Registering USB driver...");
 	int ret = sceUsbbdRegister(&usb_driver);
 	LOG("returned %i\n", ret);
@@ -576,6 +1900,17 @@ int main(int argc, char *argv[])
 	 */
 	memcpy(&uvc_probe_control_setting, &uvc_probe_control_setting_default,
 	       sizeof(uvc_probe_control_setting));
+	format_conversion_set_color(uvc_select_conversion());
+
+	uvc_set_color_matching(&video_streaming_descriptors.format_uncompressed_yuy2_color_matching,
+			       COLOR_SPACE);
+	uvc_set_color_matching(&video_streaming_descriptors.format_uncompressed_nv12_color_matching,
+			       COLOR_SPACE);
+	uvc_set_color_matching(&video_streaming_descriptors.format_uncompressed_i420_color_matching,
+			       COLOR_SPACE);
+	uvc_set_color_matching(&video_streaming_descriptors.format_mjpeg_color_matching, JPEG_COLOR);
+	uvc_set_color_matching(&video_streaming_descriptors.format_h264_color_matching,
+			       COLOR_SPACE);
 
 	stream = 0;
 
@@ -588,10 +1923,16 @@ int main(int argc, char *argv[])
 		sceCtrlPeekBufferPositive(&pad, 1);
 		if ((pad.Buttons & EXIT_MASK) == EXIT_MASK)
 			run = 0;
+		if (ENABLE_MJPEG_RATE_CONTROL)
+			handle_rate_buttons(pad.Buttons);
+		if (pu_values_changed)
+			uvc_apply_pu_values();
 
 		sceDisplayWaitVblankStart();
 
 		if (sceUsbGetState () & PSP_USB_STATUS_CONNECTION_ESTABLISHED) {
+			if (stream && commit_pending)
+				uvc_apply_commit();
 			if (stream)
 				send_frame();
 		}
@@ -0,0 +1,84 @@
+#include "rate_control.h"
+
+/* Frames under this share of the budget let quality go up a step */
+#define HEADROOM_PERCENT	80
+/* Largest single quality drop */
+#define MAX_STEP_DOWN		10
+
+void rate_control_init(struct rate_control *rc, int quality, int min_quality, int max_quality)
+{
+	rc->quality = quality;
+	rc->min_quality = min_quality;
+	rc->max_quality = max_quality;
+	rc->target_bytes = 0;
+	rc->target_us = 0;
+	rc->throughput = 0;
+	rc->budget = 0;
+}
+
+void rate_control_set_target(struct rate_control *rc, int target_bytes, int target_us)
+{
+	rc->target_bytes = target_bytes;
+	rc->target_us = target_us;
+}
+
+static int clamp_quality(struct rate_control *rc)
+{
+	if (rc->quality < rc->min_quality)
+		rc->quality = rc->min_quality;
+	if (rc->quality > rc->max_quality)
+		rc->quality = rc->max_quality;
+
+	return rc->quality;
+}
+
+static int frame_budget(const struct rate_control *rc)
+{
+	int budget = rc->target_bytes;
+
+	if (rc->target_us && rc->throughput) {
+		int link = (long long)rc->throughput * rc->target_us / 1000;
+
+		if (!budget || link < budget)
+			budget = link;
+	}
+
+	return budget;
+}
+
+int rate_control_update(struct rate_control *rc, int frame_bytes, unsigned int send_us)
+{
+	int percent, step;
+
+	if (send_us) {
+		int sample = (long long)frame_bytes * 1000 / send_us;
+
+		/* Exponential average with a 1/4 weight on the new sample */
+		rc->throughput = rc->throughput ? rc->throughput + (sample - rc->throughput) / 4 : sample;
+	}
+
+	rc->budget = frame_budget(rc);
+	if (!rc->budget)
+		return rc->quality;
+
+	percent = (long long)frame_bytes * 100 / rc->budget;
+
+	if (percent > 100) {
+		/* About one quality step per 5% over budget */
+		step = (percent - 100) / 5 + 1;
+		if (step > MAX_STEP_DOWN)
+			step = MAX_STEP_DOWN;
+		rc->quality -= step;
+	} else if (percent < HEADROOM_PERCENT) {
+		rc->quality++;
+	}
+
+	return clamp_quality(rc);
+}
+
+int rate_control_overflow(struct rate_control *rc)
+{
+	rc->quality -= MAX_STEP_DOWN;
+
+	return clamp_quality(rc);
+}
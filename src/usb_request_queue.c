@@ -0,0 +1,172 @@
+#include "usb_request_queue.h"
+
+/* Counters and the pool are shared with completion context */
+static void request_complete(struct usb_request_queue *queue, struct usb_queued_request *r,
+			     int return_code)
+{
+	int intr;
+
+	r->done(r->arg, return_code);
+
+	intr = sceKernelCpuSuspendIntr();
+	if (return_code >= 0)
+		queue->bytes += r->req.transmitted;
+	if (--queue->in_flight == 0)
+		queue->busy_us += sceKernelGetSystemTimeLow() - queue->busy_start;
+	queue->free_mask |= 1u << (r - queue->requests);
+	sceKernelCpuResumeIntr(intr);
+
+	sceKernelSetEventFlag(queue->evflag, queue->free_bit);
+}
+
+static void request_on_complete(struct UsbbdDeviceRequest *req)
+{
+	struct usb_queued_request *r = (struct usb_queued_request *)req;
+	int intr, queued;
+
+	intr = sceKernelCpuSuspendIntr();
+	queued = r->queued;
+	r->queued = 0;
+	sceKernelCpuResumeIntr(intr);
+
+	/* Already taken back by usb_request_queue_cancel() */
+	if (!queued)
+		return;
+
+	request_complete(r->queue, r, req->returnCode);
+}
+
+void usb_request_queue_init(struct usb_request_queue *queue, struct UsbEndpoint *endpoint,
+			    int depth, SceUID evflag, unsigned int free_bit, unsigned int stop_bit)
+{
+	int i;
+
+	if (depth < 1)
+		depth = 1;
+	if (depth > USB_REQUEST_QUEUE_MAX_DEPTH)
+		depth = USB_REQUEST_QUEUE_MAX_DEPTH;
+
+	queue->endpoint = endpoint;
+	queue->depth = depth;
+	queue->evflag = evflag;
+	queue->free_bit = free_bit;
+	queue->stop_bit = stop_bit;
+	queue->free_mask = depth == 32 ? ~0u : (1u << depth) - 1;
+	queue->in_flight = 0;
+	queue->stats_start = sceKernelGetSystemTimeLow();
+	queue->busy_us = 0;
+	queue->bytes = 0;
+
+	for (i = 0; i < depth; i++) {
+		queue->requests[i].queue = queue;
+		queue->requests[i].queued = 0;
+	}
+}
+
+int usb_request_queue_send(struct usb_request_queue *queue, void *data, int size,
+			   usb_request_done_fn done, void *arg)
+{
+	struct usb_queued_request *r;
+	unsigned int event;
+	int intr, i, ret;
+
+	for (;;) {
+		/* Cleared before looking, so a completion in between still wakes us */
+		sceKernelClearEventFlag(queue->evflag, ~queue->free_bit);
+
+		intr = sceKernelCpuSuspendIntr();
+		for (i = 0; i < queue->depth && !(queue->free_mask & (1u << i)); i++)
+			;
+		if (i < queue->depth)
+			queue->free_mask &= ~(1u << i);
+		sceKernelCpuResumeIntr(intr);
+
+		if (i < queue->depth)
+			break;
+
+		ret = sceKernelWaitEventFlagCB(queue->evflag, queue->free_bit | queue->stop_bit,
+					       PSP_EVENT_WAITOR, &event, NULL);
+		if (ret < 0)
+			return ret;
+		if (event & queue->stop_bit)
+			return USB_REQUEST_QUEUE_STOPPED;
+	}
+
+	r = &queue->requests[i];
+	r->req = (struct UsbbdDeviceRequest){
+		.endpoint = queue->endpoint,
+		.data = data,
+		.size = size,
+		.isControlRequest = 0,
+		.onComplete = request_on_complete,
+		.transmitted = 0,
+		.returnCode = 0,
+		.next = NULL,
+		.unused = NULL,
+		.physicalAddress = NULL
+	};
+	r->done = done;
+	r->arg = arg;
+
+	intr = sceKernelCpuSuspendIntr();
+	r->queued = 1;
+	if (queue->in_flight++ == 0)
+		queue->busy_start = sceKernelGetSystemTimeLow();
+	sceKernelCpuResumeIntr(intr);
+
+	ret = sceUsbbdReqSend(&r->req);
+	if (ret < 0) {
+		/* Never queued, so no completion will come */
+		intr = sceKernelCpuSuspendIntr();
+		r->queued = 0;
+		if (--queue->in_flight == 0)
+			queue->busy_us += sceKernelGetSystemTimeLow() - queue->busy_start;
+		queue->free_mask |= 1u << i;
+		sceKernelCpuResumeIntr(intr);
+		return ret;
+	}
+
+	return 0;
+}
+
+void usb_request_queue_cancel(struct usb_request_queue *queue)
+{
+	int i, intr, queued;
+
+	sceUsbbdClearFIFO(queue->endpoint);
+	sceUsbbdReqCancelAll(queue->endpoint);
+
+	for (i = 0; i < queue->depth; i++) {
+		struct usb_queued_request *r = &queue->requests[i];
+
+		intr = sceKernelCpuSuspendIntr();
+		queued = r->queued;
+		r->queued = 0;
+		sceKernelCpuResumeIntr(intr);
+
+		if (queued)
+			request_complete(queue, r, USB_REQUEST_CANCELLED);
+	}
+}
+
+void usb_request_queue_stats(struct usb_request_queue *queue, struct usb_request_queue_stats *stats)
+{
+	unsigned int now;
+	int intr;
+
+	intr = sceKernelCpuSuspendIntr();
+	now = sceKernelGetSystemTimeLow();
+
+	stats->elapsed_us = now - queue->stats_start;
+	stats->busy_us = queue->busy_us;
+	if (queue->in_flight) {
+		stats->busy_us += now - queue->busy_start;
+		queue->busy_start = now;
+	}
+	stats->bytes = queue->bytes;
+
+	queue->stats_start = now;
+	queue->busy_us = 0;
+	queue->bytes = 0;
+	sceKernelCpuResumeIntr(intr);
+}